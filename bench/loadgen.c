@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../common/framing.h"
+#include "../common/protocol.h"
+
+/*
+ * bench/loadgen.c
+ * - Load generator đo hiệu năng end-to-end của server (build qua `make bench`).
+ * - Mở N connection đồng thời, mỗi connection tự REGISTER/LOGIN rồi bắn mix
+ *   PING/PM_SEND/GM_SEND theo tỉ lệ cấu hình, pipeline tối đa `window`
+ *   request đang chờ response trên mỗi connection.
+ * - Cuối run in throughput + latency p50/p95/p99 theo từng verb, để so sánh
+ *   trước/sau khi sửa handlers.c / sessions.c.
+ *
+ * Usage:
+ *   ./build/loadgen <host> <port> [conns] [seconds] [window] [mix]
+ *   mix mặc định: "ping=10,pm=60,gm=30"
+ */
+
+#define LG_MAX_WINDOW 64
+#define LG_LINE_MAX 8192
+
+// Nội dung tin nhắn cố định, đã encode Base64 sẵn ("benchmark message")
+#define LG_CONTENT_B64 "YmVuY2htYXJrIG1lc3NhZ2U="
+
+// Verb được đo (index vào bảng sample)
+enum { V_LOGIN = 0, V_PING, V_PM, V_GM, V_COUNT };
+static const char* g_verb_names[V_COUNT] = { "LOGIN", "PING", "PM_SEND", "GM_SEND" };
+
+typedef struct {
+    double* us;      // mảng latency (micro giây)
+    int count;
+    int cap;
+} Samples;
+
+typedef struct {
+    int idx;            // số thứ tự connection (0..conns-1)
+    int errors;         // số response ERR nhận được
+    Samples samples[V_COUNT];
+} WorkerResult;
+
+// ============ Config (đọc 1 lần ở main, chỉ đọc từ worker) ============
+
+static const char* g_host = "127.0.0.1";
+static int g_port = 8888;
+static int g_conns = 16;
+static int g_seconds = 5;
+static int g_window = 8;
+static int g_weights[V_COUNT] = { 0, 10, 60, 30 }; // LOGIN chỉ đo lúc setup
+static int g_weight_total = 100;
+
+static pthread_barrier_t g_start_barrier;
+
+// ============ Helpers ============
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static void sample_add(Samples* s, double us)
+{
+    if (s->count >= s->cap) {
+        int new_cap = s->cap ? s->cap * 2 : 1024;
+        double* next = (double*)realloc(s->us, (size_t)new_cap * sizeof(double));
+        if (!next) return; // hết bộ nhớ: bỏ sample, bench vẫn chạy tiếp
+        s->us = next;
+        s->cap = new_cap;
+    }
+    s->us[s->count++] = us;
+}
+
+/*
+ * kv_find
+ * - Tìm value của key trong payload dạng "k=v k=v" (đủ dùng cho parse OK).
+ */
+static int kv_find(const char* payload, const char* key, char* out, size_t cap)
+{
+    size_t klen = strlen(key);
+    const char* p = payload;
+    while (p && *p) {
+        while (*p == ' ') p++;
+        if (strncmp(p, key, klen) == 0 && p[klen] == '=') {
+            p += klen + 1;
+            size_t i = 0;
+            while (*p && *p != ' ' && i + 1 < cap) out[i++] = *p++;
+            out[i] = 0;
+            return 1;
+        }
+        p = strchr(p, ' ');
+    }
+    return 0;
+}
+
+static int connect_to(const char* host, int port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        close(s);
+        return -1;
+    }
+
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int send_line(int sock, const char* line)
+{
+    char buf[LG_LINE_MAX];
+    int n = snprintf(buf, sizeof(buf), "%s\r\n", line);
+    if (n < 0 || n >= (int)sizeof(buf)) return -1;
+
+    int sent = 0;
+    while (sent < n) {
+        int r = (int)send(sock, buf + sent, (size_t)(n - sent), 0);
+        if (r <= 0) return -1;
+        sent += r;
+    }
+    return 0;
+}
+
+/*
+ * recv_response
+ * - Đọc đến khi gặp 1 line response (bỏ qua PUSH).
+ * Return: 1 OK, 0 disconnect, -1 lỗi. out chứa cả line.
+ */
+static int recv_response(int sock, LineFramer* fr, char* out, size_t cap)
+{
+    for (;;) {
+        int r = framer_recv_line(sock, fr, out, cap);
+        if (r <= 0) return r == 0 ? 0 : -1;
+        if (strncmp(out, "PUSH ", 5) == 0) continue;
+        return 1;
+    }
+}
+
+/*
+ * do_request
+ * - Gửi 1 request + chờ response (dùng trong pha setup, đo latency nếu
+ *   verb_idx >= 0). Trả 1 nếu nhận OK, 0 nếu ERR, -1 nếu lỗi kết nối.
+ * - resp_payload (nullable): payload sau "OK <rid> ".
+ */
+static int do_request(int sock, LineFramer* fr, WorkerResult* res, int verb_idx,
+                      const char* line, char* resp_payload, size_t resp_cap)
+{
+    double t0 = now_us();
+    if (send_line(sock, line) != 0) return -1;
+
+    char resp[LG_LINE_MAX];
+    int r = recv_response(sock, fr, resp, sizeof(resp));
+    if (r <= 0) return -1;
+
+    if (verb_idx >= 0) sample_add(&res->samples[verb_idx], now_us() - t0);
+
+    // resp: "OK <rid> payload..." hoặc "ERR <rid> code msg"
+    int ok = strncmp(resp, "OK ", 3) == 0;
+    if (!ok) res->errors++;
+
+    if (ok && resp_payload) {
+        const char* p = strchr(resp + 3, ' ');
+        snprintf(resp_payload, resp_cap, "%s", p ? p + 1 : "");
+    }
+    return ok;
+}
+
+// ============ Worker ============
+
+typedef struct {
+    long rid;
+    int verb_idx;
+    double t_send;
+} Outstanding;
+
+static void* worker_main(void* arg)
+{
+    WorkerResult* res = (WorkerResult*)arg;
+    int idx = res->idx;
+
+    int sock = connect_to(g_host, g_port);
+    if (sock < 0) {
+        fprintf(stderr, "conn %d: connect failed\n", idx);
+        pthread_barrier_wait(&g_start_barrier);
+        return NULL;
+    }
+
+    LineFramer fr;
+    framer_init(&fr, 4096);
+
+    long rid = 1;
+    char line[LG_LINE_MAX];
+    char payload[LG_LINE_MAX];
+    int pid = (int)getpid();
+
+    // REGISTER (bỏ qua lỗi user_exists khi chạy lại trên cùng DB)
+    snprintf(line, sizeof(line),
+             "REGISTER %ld username=bench%d_%d password=benchpass email=bench@example.com",
+             rid++, pid, idx);
+    do_request(sock, &fr, res, -1, line, NULL, 0);
+
+    // Chờ tất cả worker register xong để PM tới peer không bị user_not_found
+    pthread_barrier_wait(&g_start_barrier);
+
+    // LOGIN (đo latency)
+    char token[128] = "";
+    snprintf(line, sizeof(line),
+             "LOGIN %ld username=bench%d_%d password=benchpass", rid++, pid, idx);
+    if (do_request(sock, &fr, res, V_LOGIN, line, payload, sizeof(payload)) != 1 ||
+        !kv_find(payload, "token", token, sizeof(token))) {
+        fprintf(stderr, "conn %d: login failed\n", idx);
+        goto done;
+    }
+
+    // Mỗi connection tự tạo 1 group để bắn GM_SEND (owner là member sẵn)
+    char gid[32] = "";
+    snprintf(line, sizeof(line), "GROUP_CREATE %ld token=%s name=benchg%d_%d",
+             rid++, token, pid, idx);
+    if (do_request(sock, &fr, res, -1, line, payload, sizeof(payload)) == 1) {
+        kv_find(payload, "group_id", gid, sizeof(gid));
+    }
+
+    // Peer nhận PM: worker kế tiếp (vòng tròn)
+    char peer[64];
+    snprintf(peer, sizeof(peer), "bench%d_%d", pid, (idx + 1) % g_conns);
+
+    // ===== Vòng bắn tải: pipeline tối đa g_window request =====
+    Outstanding out[LG_MAX_WINDOW];
+    int out_head = 0, out_count = 0;
+
+    unsigned int seed = (unsigned int)(pid * 131 + idx);
+    double deadline = now_us() + (double)g_seconds * 1e6;
+
+    for (;;) {
+        double now = now_us();
+        int draining = now >= deadline;
+
+        // Nạp thêm request đến khi đầy window (trừ khi đang drain)
+        while (!draining && out_count < g_window) {
+            int pick = (int)(rand_r(&seed) % (unsigned int)g_weight_total);
+            int verb_idx = V_PING;
+            for (int v = 0; v < V_COUNT; v++) {
+                if (pick < g_weights[v]) { verb_idx = v; break; }
+                pick -= g_weights[v];
+            }
+
+            if (verb_idx == V_GM && !gid[0]) verb_idx = V_PING;
+
+            switch (verb_idx) {
+            case V_PM:
+                snprintf(line, sizeof(line), "PM_SEND %ld token=%s to=%s content=%s",
+                         rid, token, peer, LG_CONTENT_B64);
+                break;
+            case V_GM:
+                snprintf(line, sizeof(line), "GM_SEND %ld token=%s group_id=%s content=%s",
+                         rid, token, gid, LG_CONTENT_B64);
+                break;
+            default:
+                snprintf(line, sizeof(line), "PING %ld", rid);
+                break;
+            }
+
+            int slot = (out_head + out_count) % LG_MAX_WINDOW;
+            out[slot].rid = rid;
+            out[slot].verb_idx = verb_idx;
+            out[slot].t_send = now_us();
+            if (send_line(sock, line) != 0) goto done;
+            rid++;
+            out_count++;
+        }
+
+        if (out_count == 0) {
+            if (draining) break;
+            continue;
+        }
+
+        // Nhận 1 response và match rid (server trả theo thứ tự per-connection,
+        // nhưng vẫn scan queue để an toàn)
+        char resp[LG_LINE_MAX];
+        if (recv_response(sock, &fr, resp, sizeof(resp)) <= 0) goto done;
+
+        char rid_str[32] = "";
+        sscanf(resp, "%*s %31s", rid_str);
+        long got_rid = atol(rid_str);
+        if (strncmp(resp, "ERR ", 4) == 0) res->errors++;
+
+        double t_recv = now_us();
+        for (int i = 0; i < out_count; i++) {
+            int slot = (out_head + i) % LG_MAX_WINDOW;
+            if (out[slot].rid == got_rid) {
+                sample_add(&res->samples[out[slot].verb_idx],
+                           t_recv - out[slot].t_send);
+                // Bỏ phần tử khỏi FIFO (thường là head)
+                for (; i > 0; i--) {
+                    int prev = (out_head + i - 1) % LG_MAX_WINDOW;
+                    Outstanding tmp = out[prev];
+                    out[prev] = out[slot];
+                    out[slot] = tmp;
+                    slot = prev;
+                }
+                out_head = (out_head + 1) % LG_MAX_WINDOW;
+                out_count--;
+                break;
+            }
+        }
+    }
+
+    snprintf(line, sizeof(line), "DISCONNECT %ld token=%s", rid++, token);
+    send_line(sock, line);
+
+done:
+    framer_free(&fr);
+    close(sock);
+    return NULL;
+}
+
+// ============ Report ============
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int n, double q)
+{
+    if (n == 0) return 0.0;
+    int i = (int)(q * (double)(n - 1));
+    return sorted[i];
+}
+
+static void parse_mix(const char* mix)
+{
+    // Format: "ping=10,pm=60,gm=30"
+    int w_ping = 0, w_pm = 0, w_gm = 0;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", mix);
+
+    char* save = NULL;
+    for (char* tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(tok, '=');
+        if (!eq) continue;
+        *eq = 0;
+        int w = atoi(eq + 1);
+        if (strcmp(tok, "ping") == 0) w_ping = w;
+        else if (strcmp(tok, "pm") == 0) w_pm = w;
+        else if (strcmp(tok, "gm") == 0) w_gm = w;
+    }
+
+    if (w_ping + w_pm + w_gm <= 0) {
+        fprintf(stderr, "invalid mix '%s', using default\n", mix);
+        return;
+    }
+    g_weights[V_PING] = w_ping;
+    g_weights[V_PM] = w_pm;
+    g_weights[V_GM] = w_gm;
+    g_weight_total = w_ping + w_pm + w_gm;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr,
+                "Usage: %s <host> <port> [conns] [seconds] [window] [mix]\n"
+                "  mix: ping=10,pm=60,gm=30\n", argv[0]);
+        return 1;
+    }
+
+    g_host = argv[1];
+    g_port = atoi(argv[2]);
+    if (argc >= 4) g_conns = atoi(argv[3]);
+    if (argc >= 5) g_seconds = atoi(argv[4]);
+    if (argc >= 6) g_window = atoi(argv[5]);
+    if (argc >= 7) parse_mix(argv[6]);
+
+    if (g_conns < 1) g_conns = 1;
+    if (g_window < 1) g_window = 1;
+    if (g_window > LG_MAX_WINDOW) g_window = LG_MAX_WINDOW;
+
+    printf("loadgen: %s:%d conns=%d seconds=%d window=%d mix=ping:%d,pm:%d,gm:%d\n",
+           g_host, g_port, g_conns, g_seconds, g_window,
+           g_weights[V_PING], g_weights[V_PM], g_weights[V_GM]);
+
+    pthread_barrier_init(&g_start_barrier, NULL, (unsigned int)g_conns);
+
+    WorkerResult* results = (WorkerResult*)calloc((size_t)g_conns, sizeof(WorkerResult));
+    pthread_t* tids = (pthread_t*)calloc((size_t)g_conns, sizeof(pthread_t));
+    if (!results || !tids) return 1;
+
+    double t_start = now_us();
+    for (int i = 0; i < g_conns; i++) {
+        results[i].idx = i;
+        pthread_create(&tids[i], NULL, worker_main, &results[i]);
+    }
+    for (int i = 0; i < g_conns; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed_s = (now_us() - t_start) / 1e6;
+
+    // Gộp sample của tất cả worker theo verb
+    long total = 0, errors = 0;
+    printf("\n%-10s %10s %10s %10s %10s %10s\n",
+           "verb", "count", "req/s", "p50(ms)", "p95(ms)", "p99(ms)");
+
+    for (int v = 0; v < V_COUNT; v++) {
+        int n = 0;
+        for (int i = 0; i < g_conns; i++) n += results[i].samples[v].count;
+        if (n == 0) continue;
+
+        double* all = (double*)malloc((size_t)n * sizeof(double));
+        if (!all) continue;
+        int pos = 0;
+        for (int i = 0; i < g_conns; i++) {
+            Samples* s = &results[i].samples[v];
+            memcpy(all + pos, s->us, (size_t)s->count * sizeof(double));
+            pos += s->count;
+        }
+        qsort(all, (size_t)n, sizeof(double), cmp_double);
+
+        printf("%-10s %10d %10.0f %10.3f %10.3f %10.3f\n",
+               g_verb_names[v], n, (double)n / elapsed_s,
+               percentile(all, n, 0.50) / 1000.0,
+               percentile(all, n, 0.95) / 1000.0,
+               percentile(all, n, 0.99) / 1000.0);
+
+        total += n;
+        free(all);
+    }
+
+    for (int i = 0; i < g_conns; i++) errors += results[i].errors;
+
+    printf("\ntotal: %ld responses in %.2fs (%.0f req/s), %ld ERR\n",
+           total, elapsed_s, (double)total / elapsed_s, errors);
+
+    for (int i = 0; i < g_conns; i++) {
+        for (int v = 0; v < V_COUNT; v++) free(results[i].samples[v].us);
+    }
+    free(results);
+    free(tids);
+    pthread_barrier_destroy(&g_start_barrier);
+    return 0;
+}
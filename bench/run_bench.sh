@@ -0,0 +1,26 @@
+#!/bin/sh
+# bench/run_bench.sh
+# - Chạy benchmark end-to-end: start 1 server tạm (data/ riêng trong tmpdir)
+#   rồi bắn tải bằng build/loadgen. Gọi qua `make bench`.
+# - Override bằng biến môi trường: BENCH_PORT/CONNS/SECONDS/WINDOW/MIX.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${BENCH_PORT:-9199}
+CONNS=${BENCH_CONNS:-16}
+DURATION=${BENCH_SECONDS:-5}
+WINDOW=${BENCH_WINDOW:-8}
+MIX=${BENCH_MIX:-ping=10,pm=60,gm=30}
+
+DIR=$(mktemp -d)
+cd "$DIR"
+
+"$ROOT/build/server" "$PORT" 3600 >server.out 2>&1 &
+SRV=$!
+trap 'kill "$SRV" 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+
+# Chờ server listen
+sleep 1
+
+"$ROOT/build/loadgen" 127.0.0.1 "$PORT" "$CONNS" "$DURATION" "$WINDOW" "$MIX"
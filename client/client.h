@@ -23,6 +23,8 @@
 #include <sys/select.h>
 #include <time.h>
 
+#include "../common/base64.h"
+
 #include "../common/framing.h"
 
 // ===== ANSI colors =====
@@ -53,13 +55,38 @@
 #define ICON_SEND    "➤"
 
 // ===== Client state =====
+
+// Số request được phép outstanding cùng lúc (pipelining).
+#define MAX_PENDING_RESP 8
+
+// Mọi response được receiver thread (client_net.c) stash vào đây theo rid,
+// giữ cho tới khi caller request_wait() đúng rid của nó (pipelining OK).
+typedef struct {
+    int used;
+    char rid[32];
+    char line[8192];
+} PendingResp;
+
 typedef struct {
     int sock;           // Socket kết nối đến server
     LineFramer framer;  // Bộ đệm để tách message theo \r\n
     char token[128];    // Token xác thực (rỗng nếu chưa login)
     int next_id;        // ID tự tăng cho mỗi request
+    PendingResp pending[MAX_PENDING_RESP];  // Stash cho out-of-order response
 } ClientState;
 
+// ===== Receiver thread (client_net.c) =====
+// Reader duy nhất của socket sau khi connect: sở hữu LineFramer, demux
+// inbound line thành response (stash theo req_id cho request_wait) và PUSH
+// (gọi handler ngay trên thread nhận, chưa có handler thì xếp vào queue).
+typedef void (*PushHandlerFn)(const char *line); // line=NULL => mất kết nối
+int  net_recv_start(ClientState *cs);         // gọi 1 lần sau connect
+void net_recv_stop(ClientState *cs);          // dừng + join (trước khi close)
+void net_set_push_handler(PushHandlerFn fn);  // NULL => push quay lại queue
+int  net_pop_push(char *out, size_t cap);     // pop 1 push đã xếp hàng (0 = rỗng)
+int  net_wait_response(ClientState *cs, const char *rid,  // chờ response theo rid
+                       char *resp, size_t resp_cap);      // (core của request_wait)
+
 // ===== Utilities (client_utils.c) =====
 int  client_connect(const char *ip, unsigned short port);  // Kết nối TCP đến server
 void trim_line(char *s);                                    // Xóa \n\r cuối chuỗi
@@ -67,10 +94,10 @@ int  send_line(int sock, const char *line);                // Gửi 1 dòng + \r
 int  kv_get(const char *payload, const char *key, char *out, size_t out_cap);  // Parse key=value
 int  parse_response(const char *line, char *kind, size_t kind_cap,             // Parse response OK/ERR
                     char *rid, size_t rid_cap, char *rest, size_t rest_cap);
+int  request_wait(ClientState *cs, const char *rid,                            // Chờ response theo rid
+                  char *resp, size_t resp_cap);                                // (cho phép pipelining)
 
-// Base64 encoding/decoding
-int base64_encode(const unsigned char *src, size_t src_len, char *out, size_t out_cap);
-int base64_decode(const char *src, unsigned char *out, size_t out_cap);
+// Base64 encode/decode: dùng bản chung (scalar + SIMD) ở common/base64.*
 
 // ===== UI (client_ui.c) =====
 void menu_show(int logged_in);  // Hiển thị menu chính
@@ -47,7 +47,7 @@ void cmd_register(ClientState *cs)
     send_line(cs->sock, req);
 
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -90,7 +90,7 @@ void cmd_login(ClientState *cs)
 
     // Đọc response
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -132,7 +132,7 @@ void cmd_logout(ClientState *cs)
     send_line(cs->sock, req);
 
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -169,7 +169,7 @@ void cmd_whoami(ClientState *cs)
     send_line(cs->sock, req);
 
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -196,10 +196,19 @@ void cmd_raw_send(ClientState *cs)
     if (!req[0])
         return;
 
+    // Lấy req_id user đã gõ (token thứ 2) để chờ đúng response của nó —
+    // socket giờ do receiver thread đọc, không recv trực tiếp ở đây nữa.
+    char rid[32] = {0};
+    sscanf(req, "%*31s %31s", rid);
+    if (!rid[0]) {
+        printf(C_WARN "Missing req_id (format: VERB REQ_ID k=v ...)\n" C_RESET);
+        return;
+    }
+
     send_line(cs->sock, req);
 
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -225,7 +234,7 @@ void cmd_disconnect(ClientState *cs)
         send_line(cs->sock, req);
 
         char resp[4096];
-        int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+        int r = request_wait(cs, rid, resp, sizeof(resp));
         if (r > 0) {
             printf("< %s\n", resp);
         }
@@ -39,7 +39,7 @@ void cmd_friend_invite(ClientState *cs)
     send_line(cs->sock, req);
 
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -81,7 +81,7 @@ void cmd_friend_pending(ClientState *cs)
     send_line(cs->sock, req);
 
     char resp[4096];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -161,7 +161,7 @@ void cmd_friend_pending(ClientState *cs)
 
         send_line(cs->sock, req);
 
-        r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+        r = request_wait(cs, rid, resp, sizeof(resp));
         if (r <= 0) {
             printf("Disconnected\n");
             break;
@@ -191,17 +191,23 @@ void cmd_friend_list(ClientState *cs)
         return;
     }
 
-    // Vòng lặp chính - làm mới danh sách sau mỗi thao tác
+    // Vòng lặp chính - làm mới danh sách sau mỗi thao tác.
+    // list_rid: FRIEND_LIST refresh có thể đã được pipeline cùng FRIEND_DELETE
+    // ở vòng trước (1 round trip cho cả 2) — khi đó chỉ cần chờ response.
+    char list_rid[32] = "";
     for (;;) {
         char rid[32];
-        snprintf(rid, sizeof(rid), "%d", cs->next_id++);
-
         char req[512];
-        snprintf(req, sizeof(req), "FRIEND_LIST %s token=%s", rid, cs->token);
-        send_line(cs->sock, req);
+
+        if (!list_rid[0]) {
+            snprintf(list_rid, sizeof(list_rid), "%d", cs->next_id++);
+            snprintf(req, sizeof(req), "FRIEND_LIST %s token=%s", list_rid, cs->token);
+            send_line(cs->sock, req);
+        }
 
         char resp[4096];
-        int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+        int r = request_wait(cs, list_rid, resp, sizeof(resp));
+        list_rid[0] = 0;
         if (r <= 0) {
             printf("Disconnected\n");
             return;
@@ -293,7 +299,13 @@ void cmd_friend_list(ClientState *cs)
 
         send_line(cs->sock, req);
 
-        r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+        // Pipeline luôn FRIEND_LIST refresh cho vòng sau: 2 request đi trong
+        // cùng 1 round trip, vòng lặp kế chỉ việc chờ response đã về.
+        snprintf(list_rid, sizeof(list_rid), "%d", cs->next_id++);
+        snprintf(req, sizeof(req), "FRIEND_LIST %s token=%s", list_rid, cs->token);
+        send_line(cs->sock, req);
+
+        r = request_wait(cs, rid, resp, sizeof(resp));
         if (r <= 0) {
             printf("Disconnected\n");
             break;
@@ -1,7 +1,7 @@
 /*
  * client/client_gm.c
  * - Tin nhắn nhóm (GM) với real-time messaging.
- * - Nhận tin nhắn thời gian thực qua background thread.
+ * - Nhận tin nhắn thời gian thực qua receiver thread (client_net.c).
  * - Hiển thị lịch sử tin nhắn (cũ nhất trước).
  * - Base64 encoding cho message content (hỗ trợ Unicode).
  * - Thread-safe output với mutex protection.
@@ -12,7 +12,7 @@
  *   GM_SEND       - Gửi tin nhắn đến nhóm
  *   GM_CHAT_END   - Kết thúc phiên chat nhóm
  *
- * PUSH notifications:
+ * PUSH notifications (giao qua push handler của receiver thread - client_net.c):
  *   PUSH GM        - Tin nhắn nhóm mới
  *   PUSH GM_JOIN   - Thành viên vào chat
  *   PUSH GM_LEAVE  - Thành viên rời chat
@@ -22,14 +22,12 @@
 #include "client.h"
 
 // ============ Group Chat Global State ============
-// Các biến này được chia sẻ giữa thread chính và thread nhận
+// Chia sẻ giữa thread chính và receiver thread (gọi push handler)
 
 static volatile int g_in_chat_mode = 0;        // Cờ: đang trong chế độ chat
-static volatile int g_chat_sock = -1;           // Socket để nhận
 static volatile int g_group_chat_id = 0;        // ID nhóm hiện tại
 static char g_group_name[64] = {0};             // Tên nhóm hiện tại
 static char g_my_username[64] = {0};            // Tên của tôi
-static pthread_t g_recv_thread;                 // Handle thread nhận
 static pthread_mutex_t g_print_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex xuất
 
 // ============ Helper Functions ============
@@ -78,13 +76,12 @@ static void print_message(const char *from, const char *content_b64, long ts)
     pthread_mutex_unlock(&g_print_mutex);
 }
 
-// ============ Receive Thread ============
+// ============ Push Handler ============
 
 /*
- * group_chat_recv_thread
- * - Thread nền để nhận tin nhắn nhóm.
- * - Dùng select() với timeout để poll socket.
- * - Xử lý các thông báo PUSH từ server.
+ * gm_push_handler
+ * - Chạy trên receiver thread (client_net.c) NGAY khi push về — tin nhóm
+ *   hiện tức thì, không chờ user bấm enter như scheme poll cũ.
  *
  * Các loại PUSH:
  *   PUSH GM        - Hiển thị tin nhắn nhóm đến
@@ -92,115 +89,59 @@ static void print_message(const char *from, const char *content_b64, long ts)
  *   PUSH GM_LEAVE  - Thông báo thành viên rời
  *   PUSH GM_KICKED - Bạn bị xóa khỏi nhóm
  */
-static void *group_chat_recv_thread(void *arg)
+static void gm_push_handler(const char *line)
 {
-    (void)arg;  // Tham số không dùng
-
-    // Buffer dòng cho tin chưa đầy đủ
-    char buf[8192];
-    int buf_len = 0;
-
-    // Vòng lặp nhận chính
-    while (g_in_chat_mode && g_chat_sock > 0) {
-        // Thiết lập select() cho socket
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(g_chat_sock, &fds);
-
-        // 200ms timeout để phản hồi nhanh
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;
+    // line NULL = mất kết nối: thoát chat mode
+    if (!line) {
+        pthread_mutex_lock(&g_print_mutex);
+        printf(C_WARN "\n[Disconnected from server]\n" C_RESET);
+        fflush(stdout);
+        pthread_mutex_unlock(&g_print_mutex);
+        g_in_chat_mode = 0;
+        return;
+    }
 
-        int ret = select(g_chat_sock + 1, &fds, NULL, NULL, &tv);
+    // Xử lý PUSH GM - Tin nhắn nhóm mới
+    if (strncmp(line, "PUSH GM ", 8) == 0) {
+        const char *payload = line + 8;
 
-        // Kiểm tra xem chế độ chat đã kết thúc chưa
-        if (!g_in_chat_mode)
-            break;
+        // Trích xuất các trường tin nhắn
+        char from[64] = {0}, content[4096] = {0}, ts_str[32] = {0};
 
-        // Không có dữ liệu, tiếp tục poll
-        if (ret <= 0)
-            continue;
+        kv_get(payload, "from", from, sizeof(from));
+        kv_get(payload, "content", content, sizeof(content));
+        kv_get(payload, "ts", ts_str, sizeof(ts_str));
 
-        // Nhận dữ liệu từ socket
-        char tmp[4096];
-        int n = recv(g_chat_sock, tmp, sizeof(tmp) - 1, 0);
-        if (n <= 0) {
-            g_in_chat_mode = 0;
-            break;
+        // Hiển thị tin nhắn nếu hợp lệ
+        if (from[0] && content[0]) {
+            long ts = ts_str[0] ? atol(ts_str) : (long)time(NULL);
+            print_message(from, content, ts);
         }
-
-        tmp[n] = '\0';
-
-        // Thêm vào buffer
-        if (buf_len + n < (int)sizeof(buf) - 1) {
-            memcpy(buf + buf_len, tmp, n + 1);
-            buf_len += n;
+    // Xử lý PUSH GM_JOIN - Thành viên vào
+    } else if (strncmp(line, "PUSH GM_JOIN ", 13) == 0) {
+        const char *payload = line + 13;
+        char user[64] = {0};
+        kv_get(payload, "user", user, sizeof(user));
+        if (user[0]) {
+            printf(C_INFO "\n  >>> %s đã vào nhóm chat <<<\n" C_RESET, user);
+            fflush(stdout);
         }
-
-        // Xử lý các dòng hoàn chỉnh (kết thúc bằng \r\n)
-        char *line_start = buf;
-        char *crlf;
-        while ((crlf = strstr(line_start, "\r\n")) != NULL) {
-            *crlf = '\0';
-
-            // Xử lý PUSH GM - Tin nhắn nhóm mới
-            if (strncmp(line_start, "PUSH GM ", 8) == 0) {
-                char *payload = line_start + 8;
-
-                // Trích xuất các trường tin nhắn
-                char from[64] = {0}, content[4096] = {0}, ts_str[32] = {0};
-
-                kv_get(payload, "from", from, sizeof(from));
-                kv_get(payload, "content", content, sizeof(content));
-                kv_get(payload, "ts", ts_str, sizeof(ts_str));
-
-                // Hiển thị tin nhắn nếu hợp lệ
-                if (from[0] && content[0]) {
-                    long ts = ts_str[0] ? atol(ts_str) : (long)time(NULL);
-                    print_message(from, content, ts);
-                }
-            // Xử lý PUSH GM_JOIN - Thành viên vào
-            } else if (strncmp(line_start, "PUSH GM_JOIN ", 13) == 0) {
-                char *payload = line_start + 13;
-                char user[64] = {0};
-                kv_get(payload, "user", user, sizeof(user));
-                if (user[0]) {
-                    printf(C_INFO "\n  >>> %s đã vào nhóm chat <<<\n" C_RESET, user);
-                    fflush(stdout);
-                }
-            // Xử lý PUSH GM_LEAVE - Thành viên rời
-            } else if (strncmp(line_start, "PUSH GM_LEAVE ", 14) == 0) {
-                char *payload = line_start + 14;
-                char user[64] = {0};
-                kv_get(payload, "user", user, sizeof(user));
-                if (user[0]) {
-                    printf(C_WARN "\n  <<< %s đã rời nhóm chat >>>\n" C_RESET, user);
-                    fflush(stdout);
-                }
-            // Xử lý PUSH GM_KICKED - Bạn bị xóa
-            } else if (strncmp(line_start, "PUSH GM_KICKED ", 15) == 0) {
-                printf(C_WARN "\n  !!! Bạn đã bị xóa khỏi nhóm. Thoát chat mode... !!!\n" C_RESET);
-                fflush(stdout);
-                g_in_chat_mode = 0;  // Buộc thoát chế độ chat
-            }
-
-            // Chuyển đến dòng tiếp theo
-            line_start = crlf + 2;
-        }
-
-        // Xử lý dòng chưa đầy đủ trong buffer
-        if (line_start > buf) {
-            int remaining = buf_len - (line_start - buf);
-            if (remaining > 0) {
-                memmove(buf, line_start, remaining);
-            }
-            buf_len = remaining;
-            buf[buf_len] = '\0';
+    // Xử lý PUSH GM_LEAVE - Thành viên rời
+    } else if (strncmp(line, "PUSH GM_LEAVE ", 14) == 0) {
+        const char *payload = line + 14;
+        char user[64] = {0};
+        kv_get(payload, "user", user, sizeof(user));
+        if (user[0]) {
+            printf(C_WARN "\n  <<< %s đã rời nhóm chat >>>\n" C_RESET, user);
+            fflush(stdout);
         }
+    // Xử lý PUSH GM_KICKED - Bạn bị xóa
+    } else if (strncmp(line, "PUSH GM_KICKED ", 15) == 0) {
+        printf(C_WARN "\n  !!! Bạn đã bị xóa khỏi nhóm. Thoát chat mode... !!!\n" C_RESET);
+        fflush(stdout);
+        g_in_chat_mode = 0;  // Buộc thoát chế độ chat
     }
-
-    return NULL;
+    // PUSH khác (PM, PRESENCE...) không thuộc chat nhóm: bỏ qua
 }
 
 // ============ Display History ============
@@ -314,9 +255,9 @@ static void display_chat_history(const char *history, const char *my_username)
  *   1. Gửi yêu cầu GM_CHAT_START
  *   2. Parse response (history, group_name, me)
  *   3. Hiển thị header và lịch sử
- *   4. Khởi động thread nhận
- *   5. Vòng lặp chính: đọc đầu vào, gửi tin
- *   6. Dọn dẹp khi thoát
+ *   4. Xả hàng đợi push rồi đăng ký push handler
+ *   5. Vòng lặp chính: đọc đầu vào, gửi tin, chờ xác nhận
+ *   6. Dọn dẹp khi thoát (gỡ handler, GM_CHAT_END)
  *
  * Lệnh thoát: quit, q (không phân biệt hoa thường)
  */
@@ -332,7 +273,7 @@ void cmd_group_chat_mode(ClientState *cs, int group_id)
     send_line(cs->sock, req);
 
     // Nhận phản hồi
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -357,11 +298,10 @@ void cmd_group_chat_mode(ClientState *cs, int group_id)
     kv_get(rest, "group_name", group_name, sizeof(group_name));
     kv_get(rest, "me", my_username, sizeof(my_username));
 
-    // Lưu state toàn cục cho thread nhận
+    // Lưu state toàn cục cho push handler
     g_group_chat_id = group_id;
     snprintf(g_group_name, sizeof(g_group_name), "%s", group_name);
     snprintf(g_my_username, sizeof(g_my_username), "%s", my_username);
-    g_chat_sock = cs->sock;
     g_in_chat_mode = 1;
 
     // 3. Hiển thị header chat
@@ -375,12 +315,12 @@ void cmd_group_chat_mode(ClientState *cs, int group_id)
     // Hiển thị lịch sử tin nhắn
     display_chat_history(history, my_username);
 
-    // 4. Khởi động thread nhận tin thời gian thực
-    if (pthread_create(&g_recv_thread, NULL, group_chat_recv_thread, NULL) != 0) {
-        printf("Failed to create receive thread\n");
-        g_in_chat_mode = 0;
-        return;
-    }
+    // 4. Đăng ký push handler với receiver thread: tin đến trước khi đăng ký
+    // đang nằm trong hàng đợi push — xả ra trước để không mất tin
+    char queued[2048];
+    while (net_pop_push(queued, sizeof(queued)))
+        gm_push_handler(queued);
+    net_set_push_handler(gm_push_handler);
 
     // 5. Vòng lặp nhập chính
     while (g_in_chat_mode) {
@@ -410,45 +350,44 @@ void cmd_group_chat_mode(ClientState *cs, int group_id)
             continue;
         }
 
-        // Gửi tin nhắn đến nhóm
+        // Gửi tin nhắn đến nhóm và chờ response (receiver thread demux theo rid)
         snprintf(rid, sizeof(rid), "%d", cs->next_id++);
         snprintf(req, sizeof(req), "GM_SEND %s token=%s group_id=%d content=%s",
                  rid, cs->token, group_id, content_b64);
         send_line(cs->sock, req);
 
-        // Hiển thị tin của mình ngay (optimistic UI)
+        char send_resp[4096];
+        if (request_wait(cs, rid, send_resp, sizeof(send_resp)) <= 0)
+            break;
+
+        char skind[32], srid[32], srest[4096];
+        parse_response(send_resp, skind, sizeof(skind), srid, sizeof(srid),
+                       srest, sizeof(srest));
+        if (strcmp(skind, "OK") != 0) {
+            printf(C_WARN "Send failed: %s\n" C_RESET, srest);
+            continue;
+        }
+
+        // Hiển thị tin của mình sau khi server xác nhận
         print_message(my_username, content_b64, (long)time(NULL));
     }
 
     // 6. Dọn dẹp khi thoát
 
-    // Thông báo server rằng chat nhóm kết thúc
+    // Gỡ push handler trước: push về sau thời điểm này sẽ vào hàng đợi
+    g_in_chat_mode = 0;
+    net_set_push_handler(NULL);
+
+    // Thông báo server rằng chat nhóm kết thúc và chờ xác nhận
     snprintf(rid, sizeof(rid), "%d", cs->next_id++);
     snprintf(req, sizeof(req), "GM_CHAT_END %s token=%s", rid, cs->token);
     send_line(cs->sock, req);
-
-    // Chờ thread nhận kết thúc
-    struct timespec ts_sleep = {0, 300000000};  // 300ms chờ
-    nanosleep(&ts_sleep, NULL);
-    pthread_join(g_recv_thread, NULL);
-
-    // Xả dữ liệu còn lại trong socket
-    struct timeval tv_flush;
-    tv_flush.tv_sec = 0;
-    tv_flush.tv_usec = 100000;  // 100ms timeout
-    fd_set flush_fds;
-    FD_ZERO(&flush_fds);
-    FD_SET(cs->sock, &flush_fds);
-    if (select(cs->sock + 1, &flush_fds, NULL, NULL, &tv_flush) > 0) {
-        char flush_buf[4096];
-        recv(cs->sock, flush_buf, sizeof(flush_buf), 0);
-    }
+    request_wait(cs, rid, resp, sizeof(resp));
 
     // Đặt lại state toàn cục
     g_group_chat_id = 0;
     g_group_name[0] = '\0';
     g_my_username[0] = '\0';
-    g_chat_sock = -1;
 
     printf(C_INFO "\nGroup chat ended. Returning to group menu...\n" C_RESET);
 }
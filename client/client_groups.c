@@ -43,7 +43,7 @@ void cmd_groups_menu(ClientState *cs)
         send_line(cs->sock, req);
 
         char resp[4096];
-        int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+        int r = request_wait(cs, rid, resp, sizeof(resp));
         if (r <= 0) {
             printf("Disconnected\n");
             return;
@@ -141,7 +141,7 @@ void cmd_groups_menu(ClientState *cs)
         // Gửi request và nhận response
         send_line(cs->sock, req);
 
-        r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+        r = request_wait(cs, rid, resp, sizeof(resp));
         if (r <= 0) {
             printf("Disconnected\n");
             return;
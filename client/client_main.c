@@ -28,11 +28,19 @@ int main(int argc, char **argv)
 
     // Khởi tạo client state
     ClientState cs;
+    memset(&cs, 0, sizeof(cs));
     cs.sock = sock;
     framer_init(&cs.framer, 2048);  // Buffer 2KB cho framing
     cs.token[0] = '\0';             // Chưa login nên token rỗng
     cs.next_id = 1;                 // Request ID bắt đầu từ 1
 
+    // Receiver thread: reader duy nhất của socket (response + PUSH)
+    if (net_recv_start(&cs) != 0) {
+        printf("Failed to start receiver thread\n");
+        close(sock);
+        return 1;
+    }
+
     // Vòng lặp chính
     for (;;) {
         menu_show(cs.token[0] != 0);  // Hiển thị menu (khác nhau tùy login state)
@@ -104,6 +112,7 @@ int main(int argc, char **argv)
 
 cleanup:
     // Dọn dẹp tài nguyên
+    net_recv_stop(&cs);
     framer_free(&cs.framer);
     close(sock);
     return 0;
@@ -0,0 +1,198 @@
+/*
+ * client/client_net.c
+ * - Receiver thread của client: reader DUY NHẤT của socket sau khi connect,
+ *   sở hữu LineFramer và demux mọi inbound line tại chỗ:
+ *   + Response (OK/ERR/OK-PART/OK-END): stash theo req_id vào cs->pending,
+ *     đánh thức các request_wait() đang chờ qua condvar.
+ *   + PUSH ...: gọi push handler ngay trên thread nhận (chat mode đăng ký
+ *     handler để in tin tức thì — độ trễ theo network, không theo nhịp gõ
+ *     phím); chưa có handler thì xếp vào queue bounded để UI drain sau.
+ * - Trước đây mỗi chat mode tự spawn 1 thread recv() riêng cạnh tranh socket
+ *   với request_wait() của thread chính (push nằm trong kernel buffer đến
+ *   khi user bấm enter); giờ mọi đường đọc đi qua 1 chỗ.
+ */
+
+#include "client.h"
+
+// Queue push bounded (ring). Đầy thì bỏ push CŨ nhất — push là notification,
+// dữ liệu gốc vẫn lấy lại được qua history/unread.
+#define PUSH_QUEUE_CAP 64
+#define PUSH_LINE_MAX  2048
+
+static pthread_t g_net_thread;
+static pthread_mutex_t g_net_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_resp_cond = PTHREAD_COND_INITIALIZER;
+
+static volatile int g_net_running = 0;
+static int g_net_started = 0;
+static int g_net_dead = 0; // recv lỗi / server đóng kết nối
+static PushHandlerFn g_push_handler = NULL;
+
+static char g_push_q[PUSH_QUEUE_CAP][PUSH_LINE_MAX];
+static int g_push_head = 0;
+static int g_push_count = 0;
+
+static void push_enqueue_unlocked(const char *line)
+{
+    if (g_push_count == PUSH_QUEUE_CAP) {
+        g_push_head = (g_push_head + 1) % PUSH_QUEUE_CAP;
+        g_push_count--;
+    }
+    int slot = (g_push_head + g_push_count) % PUSH_QUEUE_CAP;
+    snprintf(g_push_q[slot], PUSH_LINE_MAX, "%s", line);
+    g_push_count++;
+}
+
+int net_pop_push(char *out, size_t cap)
+{
+    int got = 0;
+    pthread_mutex_lock(&g_net_mutex);
+    if (g_push_count > 0) {
+        snprintf(out, cap, "%s", g_push_q[g_push_head]);
+        g_push_head = (g_push_head + 1) % PUSH_QUEUE_CAP;
+        g_push_count--;
+        got = 1;
+    }
+    pthread_mutex_unlock(&g_net_mutex);
+    return got;
+}
+
+void net_set_push_handler(PushHandlerFn fn)
+{
+    pthread_mutex_lock(&g_net_mutex);
+    g_push_handler = fn;
+    pthread_mutex_unlock(&g_net_mutex);
+}
+
+/*
+ * stash_response_unlocked
+ * - Giữ response theo rid cho tới khi có request_wait() hỏi đến nó.
+ * - Stash đầy => bỏ response mới (chỉ xảy ra khi outstanding vượt
+ *   MAX_PENDING_RESP — giữ nguyên chính sách cũ của request_wait).
+ */
+static void stash_response_unlocked(ClientState *cs, const char *rrid, const char *line)
+{
+    for (int i = 0; i < MAX_PENDING_RESP; i++) {
+        if (!cs->pending[i].used) {
+            cs->pending[i].used = 1;
+            snprintf(cs->pending[i].rid, sizeof(cs->pending[i].rid), "%s", rrid);
+            snprintf(cs->pending[i].line, sizeof(cs->pending[i].line), "%s", line);
+            return;
+        }
+    }
+}
+
+static void handle_line(ClientState *cs, const char *line)
+{
+    // PUSH không có req_id: giao cho handler (nếu có) ngay trên thread này,
+    // NGOÀI mutex — handler in ra terminal, có thể chậm.
+    if (strncmp(line, "PUSH ", 5) == 0) {
+        pthread_mutex_lock(&g_net_mutex);
+        PushHandlerFn h = g_push_handler;
+        if (!h)
+            push_enqueue_unlocked(line);
+        pthread_mutex_unlock(&g_net_mutex);
+        if (h)
+            h(line);
+        return;
+    }
+
+    char kind[32], rrid[32], rest[8192];
+    if (parse_response(line, kind, sizeof(kind), rrid, sizeof(rrid),
+                       rest, sizeof(rest)) != 0)
+        return; // dòng lạ: bỏ
+
+    pthread_mutex_lock(&g_net_mutex);
+    stash_response_unlocked(cs, rrid, line);
+    pthread_cond_broadcast(&g_resp_cond);
+    pthread_mutex_unlock(&g_net_mutex);
+}
+
+int net_wait_response(ClientState *cs, const char *rid, char *resp, size_t resp_cap)
+{
+    pthread_mutex_lock(&g_net_mutex);
+    for (;;) {
+        for (int i = 0; i < MAX_PENDING_RESP; i++) {
+            if (cs->pending[i].used && strcmp(cs->pending[i].rid, rid) == 0) {
+                snprintf(resp, resp_cap, "%s", cs->pending[i].line);
+                cs->pending[i].used = 0;
+                pthread_mutex_unlock(&g_net_mutex);
+                return (int)strlen(resp);
+            }
+        }
+        if (g_net_dead) {
+            pthread_mutex_unlock(&g_net_mutex);
+            return 0;
+        }
+        pthread_cond_wait(&g_resp_cond, &g_net_mutex);
+    }
+}
+
+static void *net_recv_main(void *arg)
+{
+    ClientState *cs = (ClientState *)arg;
+    char line[8192];
+
+    while (g_net_running) {
+        // select timeout ngắn để check cờ dừng định kỳ
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(cs->sock, &fds);
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 200000;
+
+        int ready = select(cs->sock + 1, &fds, NULL, NULL, &tv);
+        if (!g_net_running)
+            break;
+        if (ready <= 0)
+            continue;
+
+        int r = framer_recv_line(cs->sock, &cs->framer, line, sizeof(line));
+        if (r <= 0) {
+            // Mất kết nối: đánh thức mọi request_wait + báo handler (nếu có)
+            pthread_mutex_lock(&g_net_mutex);
+            g_net_dead = 1;
+            PushHandlerFn h = g_push_handler;
+            pthread_cond_broadcast(&g_resp_cond);
+            pthread_mutex_unlock(&g_net_mutex);
+            if (h)
+                h(NULL);
+            break;
+        }
+        handle_line(cs, line);
+
+        // Drain các line server đã pipeline sẵn trong buffer framer
+        for (;;) {
+            int popped = framer_pop_line(&cs->framer, line, sizeof(line));
+            if (popped <= 0)
+                break;
+            handle_line(cs, line);
+        }
+    }
+
+    return NULL;
+}
+
+int net_recv_start(ClientState *cs)
+{
+    g_net_running = 1;
+    g_net_dead = 0;
+    if (pthread_create(&g_net_thread, NULL, net_recv_main, cs) != 0) {
+        g_net_running = 0;
+        return -1;
+    }
+    g_net_started = 1;
+    return 0;
+}
+
+void net_recv_stop(ClientState *cs)
+{
+    (void)cs;
+    if (!g_net_started)
+        return;
+    g_net_running = 0;
+    pthread_join(g_net_thread, NULL);
+    g_net_started = 0;
+}
@@ -12,7 +12,7 @@
  *   PM_SEND          - Gửi tin nhắn
  *   PM_CHAT_END      - Kết thúc chat session
  *
- * PUSH notifications:
+ * PUSH notifications (giao qua push handler của receiver thread - client_net.c):
  *   PUSH PM    - Nhận tin nhắn mới
  *   PUSH JOIN  - Đối phương vào chat
  *   PUSH LEAVE - Đối phương rời chat
@@ -21,13 +21,11 @@
 #include "client.h"
 
 // ============ Chat Mode Global State ============
-// Các biến này được chia sẻ giữa thread chính và thread nhận
+// Chia sẻ giữa thread chính và receiver thread (gọi push handler)
 
 static volatile int g_in_chat_mode = 0;     // Cờ: đang trong chế độ chat
-static volatile int g_chat_sock = -1;        // Socket để nhận
 static char g_chat_partner[64] = {0};        // Tên đối phương đang chat
 static char g_my_username[64] = {0};         // Tên của tôi
-static pthread_t g_recv_thread;              // Handle thread nhận
 static pthread_mutex_t g_print_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex xuất
 
 // ============ Helper Functions ============
@@ -76,125 +74,66 @@ static void print_message(const char *from, const char *content_b64, long ts)
     pthread_mutex_unlock(&g_print_mutex);
 }
 
-// ============ Receive Thread ============
+// ============ Push Handler ============
 
 /*
- * chat_recv_thread
- * - Thread nền để nhận tin nhắn thời gian thực.
- * - Dùng select() với timeout để poll socket.
- * - Xử lý các thông báo PUSH từ server.
+ * pm_push_handler
+ * - Chạy trên receiver thread (client_net.c) NGAY khi push về — tin hiện
+ *   tức thì, không chờ user bấm enter như scheme poll cũ.
  *
  * Các loại PUSH:
  *   PUSH PM    - Hiển thị tin nhắn đến
  *   PUSH JOIN  - Thông báo đối phương vào
  *   PUSH LEAVE - Thông báo đối phương rời
  */
-static void *chat_recv_thread(void *arg)
+static void pm_push_handler(const char *line)
 {
-    (void)arg;  // Tham số không dùng
-
-    // Buffer dòng cho tin chưa đầy đủ
-    char buf[8192];
-    int buf_len = 0;
-
-    // Vòng lặp nhận chính
-    while (g_in_chat_mode && g_chat_sock >= 0) {
-        // Thiết lập select() với timeout 200ms
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;  // 200ms để phản hồi
-
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(g_chat_sock, &fds);
+    // line NULL = mất kết nối: báo và thoát chat mode
+    if (!line) {
+        pthread_mutex_lock(&g_print_mutex);
+        printf(C_WARN "\n[Disconnected from server]\n" C_RESET);
+        fflush(stdout);
+        pthread_mutex_unlock(&g_print_mutex);
+        g_in_chat_mode = 0;
+        return;
+    }
 
-        int ready = select(g_chat_sock + 1, &fds, NULL, NULL, &tv);
+    // Xử lý PUSH PM - Tin nhắn mới
+    if (strncmp(line, "PUSH PM ", 8) == 0) {
+        const char *payload = line + 8;
 
-        // Không có dữ liệu, tiếp tục poll
-        if (ready <= 0)
-            continue;
+        // Trích xuất các trường tin nhắn
+        char from[64] = {0}, content[4096] = {0}, ts_str[32] = {0};
 
-        // Nhận dữ liệu từ socket
-        char tmp[1024];
-        int n = recv(g_chat_sock, tmp, sizeof(tmp) - 1, 0);
-
-        // Xử lý ngắt kết nối
-        if (n <= 0) {
-            if (n == 0) {
-                pthread_mutex_lock(&g_print_mutex);
-                printf(C_WARN "\n[Disconnected from server]\n" C_RESET);
-                fflush(stdout);
-                pthread_mutex_unlock(&g_print_mutex);
-            }
-            g_in_chat_mode = 0;
-            break;
-        }
+        kv_get(payload, "from", from, sizeof(from));
+        kv_get(payload, "content", content, sizeof(content));
+        kv_get(payload, "ts", ts_str, sizeof(ts_str));
 
-        // Thêm vào buffer
-        if (buf_len + n < (int)sizeof(buf) - 1) {
-            memcpy(buf + buf_len, tmp, n);
-            buf_len += n;
-            buf[buf_len] = '\0';
+        // Hiển thị tin nhắn nếu hợp lệ
+        if (from[0] && content[0]) {
+            long ts = ts_str[0] ? atol(ts_str) : (long)time(NULL);
+            print_message(from, content, ts);
         }
-
-        // Xử lý các dòng hoàn chỉnh (kết thúc bằng \r\n)
-        char *line_start = buf;
-        char *crlf;
-        while ((crlf = strstr(line_start, "\r\n")) != NULL) {
-            *crlf = '\0';
-
-            // Xử lý PUSH PM - Tin nhắn mới
-            if (strncmp(line_start, "PUSH PM ", 8) == 0) {
-                char *payload = line_start + 8;
-
-                // Trích xuất các trường tin nhắn
-                char from[64] = {0}, content[4096] = {0}, ts_str[32] = {0};
-
-                kv_get(payload, "from", from, sizeof(from));
-                kv_get(payload, "content", content, sizeof(content));
-                kv_get(payload, "ts", ts_str, sizeof(ts_str));
-
-                // Hiển thị tin nhắn nếu hợp lệ
-                if (from[0] && content[0]) {
-                    long ts = ts_str[0] ? atol(ts_str) : (long)time(NULL);
-                    print_message(from, content, ts);
-                }
-            // Xử lý PUSH JOIN - Đối phương vào
-            } else if (strncmp(line_start, "PUSH JOIN ", 10) == 0) {
-                char *payload = line_start + 10;
-                char user[64] = {0};
-                kv_get(payload, "user", user, sizeof(user));
-                if (user[0]) {
-                    printf(C_INFO "\n  >>> %s đã vào cuộc trò chuyện <<<\n" C_RESET, user);
-                    fflush(stdout);
-                }
-            // Xử lý PUSH LEAVE - Đối phương rời
-            } else if (strncmp(line_start, "PUSH LEAVE ", 11) == 0) {
-                char *payload = line_start + 11;
-                char user[64] = {0};
-                kv_get(payload, "user", user, sizeof(user));
-                if (user[0]) {
-                    printf(C_WARN "\n  <<< %s đã rời cuộc trò chuyện >>>\n" C_RESET, user);
-                    fflush(stdout);
-                }
-            }
-
-            // Chuyển đến dòng tiếp theo
-            line_start = crlf + 2;
+    // Xử lý PUSH JOIN - Đối phương vào
+    } else if (strncmp(line, "PUSH JOIN ", 10) == 0) {
+        const char *payload = line + 10;
+        char user[64] = {0};
+        kv_get(payload, "user", user, sizeof(user));
+        if (user[0]) {
+            printf(C_INFO "\n  >>> %s đã vào cuộc trò chuyện <<<\n" C_RESET, user);
+            fflush(stdout);
         }
-
-        // Xử lý dòng chưa đầy đủ trong buffer
-        if (line_start > buf) {
-            int remaining = buf_len - (line_start - buf);
-            if (remaining > 0) {
-                memmove(buf, line_start, remaining);
-            }
-            buf_len = remaining;
-            buf[buf_len] = '\0';
+    // Xử lý PUSH LEAVE - Đối phương rời
+    } else if (strncmp(line, "PUSH LEAVE ", 11) == 0) {
+        const char *payload = line + 11;
+        char user[64] = {0};
+        kv_get(payload, "user", user, sizeof(user));
+        if (user[0]) {
+            printf(C_WARN "\n  <<< %s đã rời cuộc trò chuyện >>>\n" C_RESET, user);
+            fflush(stdout);
         }
     }
-
-    return NULL;
+    // PUSH khác (GM, PRESENCE...) không thuộc chat 1-1: bỏ qua
 }
 
 // ============ Display History ============
@@ -309,9 +248,9 @@ static void display_chat_history(const char *history, const char *my_username)
  *   2. Hỏi user muốn chat với ai
  *   3. Bắt đầu chat session (PM_CHAT_START)
  *   4. Hiển thị lịch sử tin nhắn
- *   5. Khởi động thread nhận
+ *   5. Đăng ký push handler với receiver thread
  *   6. Vòng lặp chính: đọc đầu vào, gửi tin
- *   7. Dọn dẹp khi thoát
+ *   7. Dọn dẹp khi thoát (gỡ handler, PM_CHAT_END)
  *
  * Lệnh thoát: quit, q, /quit, /q
  */
@@ -330,7 +269,7 @@ void cmd_chat_mode(ClientState *cs)
     send_line(cs->sock, req);
 
     char resp[8192];
-    int r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    int r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -401,7 +340,7 @@ void cmd_chat_mode(ClientState *cs)
     snprintf(req, sizeof(req), "PM_CHAT_START %s token=%s with=%s", rid, cs->token, partner);
     send_line(cs->sock, req);
 
-    r = framer_recv_line(cs->sock, &cs->framer, resp, sizeof(resp));
+    r = request_wait(cs, rid, resp, sizeof(resp));
     if (r <= 0) {
         printf("Disconnected\n");
         return;
@@ -439,15 +378,15 @@ void cmd_chat_mode(ClientState *cs)
 
     printf(C_TITLE "────────────────────────────────────────────\n" C_RESET);
 
-    // 5. Đặt state toàn cục và khởi động thread nhận
+    // 5. Đăng ký push handler với receiver thread: xử lý push dồn lại khi
+    // còn ở menu, rồi để handler nhận trực tiếp các push mới.
     g_in_chat_mode = 1;
-    g_chat_sock = cs->sock;
 
-    if (pthread_create(&g_recv_thread, NULL, chat_recv_thread, NULL) != 0) {
-        printf(C_WARN "Failed to start receive thread\n" C_RESET);
-        g_in_chat_mode = 0;
-        return;
+    char queued[2048];
+    while (net_pop_push(queued, sizeof(queued))) {
+        pm_push_handler(queued);
     }
+    net_set_push_handler(pm_push_handler);
 
     // 6. Vòng lặp nhập chat chính
     while (g_in_chat_mode) {
@@ -484,41 +423,36 @@ void cmd_chat_mode(ClientState *cs)
                  rid, cs->token, partner, content_b64);
         send_line(cs->sock, req);
 
-        // Hiển thị tin của mình ngay (optimistic UI)
+        // Chờ response (receiver thread stash theo rid) và báo lỗi nếu có —
+        // scheme cũ gửi optimistic và vứt response đi.
+        r = request_wait(cs, rid, resp, sizeof(resp));
+        if (r <= 0) {
+            break;
+        }
+        parse_response(resp, kind, sizeof(kind), rrid, sizeof(rrid), rest, sizeof(rest));
+        if (strcmp(kind, "OK") != 0) {
+            printf(C_WARN "Send failed: %s\n" C_RESET, rest);
+            continue;
+        }
+
+        // Hiển thị tin của mình
         long ts = (long)time(NULL);
         print_message(g_my_username, content_b64, ts);
     }
 
-    // 7. Dọn dẹp khi thoát
+    // 7. Dọn dẹp khi thoát: gỡ handler (push sau đó quay lại queue)
     g_in_chat_mode = 0;
+    net_set_push_handler(NULL);
 
     // Thông báo server rằng chat kết thúc
     snprintf(rid, sizeof(rid), "%d", cs->next_id++);
     snprintf(req, sizeof(req), "PM_CHAT_END %s token=%s", rid, cs->token);
     send_line(cs->sock, req);
-
-    // Chờ thread nhận kết thúc
-    struct timespec ts_sleep = {0, 300000000};  // 300ms chờ
-    nanosleep(&ts_sleep, NULL);
-
-    pthread_join(g_recv_thread, NULL);
-
-    // Xả dữ liệu còn lại trong socket
-    struct timeval tv_flush;
-    tv_flush.tv_sec = 0;
-    tv_flush.tv_usec = 100000;  // 100ms timeout
-    fd_set flush_fds;
-    FD_ZERO(&flush_fds);
-    FD_SET(cs->sock, &flush_fds);
-    if (select(cs->sock + 1, &flush_fds, NULL, NULL, &tv_flush) > 0) {
-        char flush_buf[4096];
-        recv(cs->sock, flush_buf, sizeof(flush_buf), 0);
-    }
+    request_wait(cs, rid, resp, sizeof(resp));
 
     // Đặt lại state toàn cục
     g_chat_partner[0] = '\0';
     g_my_username[0] = '\0';
-    g_chat_sock = -1;
 
     printf(C_INFO "\nChat ended. Returning to menu...\n" C_RESET);
 }
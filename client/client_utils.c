@@ -8,35 +8,14 @@
  * - send_line(): Gửi 1 dòng request theo framing protocol
  * - kv_get(): Parse key=value từ payload
  * - parse_response(): Parse response OK/ERR từ server
- * - base64_encode/decode(): Mã hóa/giải mã Base64 cho nội dung tin nhắn
+ * - request_wait(): Chờ response theo req_id (hỗ trợ pipelining nhiều request)
+ *
+ * Base64 encode/decode chuyển sang common/base64.* (dùng chung với server).
  */
 
 #include "client.h"
 
-// ============ Base64 Tables ============
-// Bảng encode: index 0-63 -> ký tự Base64
 
-static const char b64_table[] = 
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-static const int b64_decode_table[256] = {
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,63,
-    52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
-    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
-    15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,
-    -1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
-    41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
-};
 
 // ============ Connection ============
 
@@ -195,106 +174,22 @@ int parse_response(const char *line,
     return 0;
 }
 
-// ============ Base64 ============
-
-/**
- * base64_encode
- * Mã hóa binary data sang Base64 string
- * Dùng để encode nội dung tin nhắn (có thể chứa ký tự đặc biệt, Unicode)
- * @param src: Dữ liệu gốc
- * @param src_len: Độ dài dữ liệu gốc
- * @param out: Buffer output (phải đủ lớn: src_len * 4/3 + 4)
- * @return: Độ dài output nếu thành công, -1 nếu buffer không đủ
- */
-int base64_encode(const unsigned char *src, size_t src_len,
-                  char *out, size_t out_cap)
-{
-    // Tính độ dài output: mỗi 3 bytes input -> 4 bytes output
-    size_t out_len = ((src_len + 2) / 3) * 4;
-    if (out_len + 1 > out_cap)
-        return -1;
 
-    size_t i = 0, j = 0;
-    // Xử lý từng nhóm 3 bytes
-    while (i < src_len) {
-        unsigned int a = i < src_len ? src[i++] : 0;
-        unsigned int b = i < src_len ? src[i++] : 0;
-        unsigned int c = i < src_len ? src[i++] : 0;
 
-        // Ghép 3 bytes thành 24 bits, chia thành 4 nhóm 6 bits
-        unsigned int triple = (a << 16) | (b << 8) | c;
 
-        out[j++] = b64_table[(triple >> 18) & 0x3F];
-        out[j++] = b64_table[(triple >> 12) & 0x3F];
-        out[j++] = b64_table[(triple >> 6) & 0x3F];
-        out[j++] = b64_table[triple & 0x3F];
-    }
-
-    // Thêm padding '=' nếu input không chia hết cho 3
-    size_t mod = src_len % 3;
-    if (mod == 1) {
-        out[j - 1] = '=';
-        out[j - 2] = '=';
-    } else if (mod == 2) {
-        out[j - 1] = '=';
-    }
-
-    out[j] = '\0';
-    return (int)j;
-}
+// ============ Pipelined requests ============
 
 /**
- * base64_decode
- * Giải mã Base64 string về binary data
- * @param src: Base64 string (độ dài phải chia hết cho 4)
- * @param out: Buffer output
- * @return: Độ dài output nếu thành công, -1 nếu lỗi
+ * request_wait
+ * Chờ response cho ĐÚNG request `rid`, cho phép nhiều request outstanding:
+ * gửi liên tiếp N request bằng send_line rồi request_wait từng rid — response
+ * về không đúng thứ tự vẫn match được nhờ req_id trong protocol.
+ * Việc đọc socket do receiver thread (client_net.c) đảm nhiệm: nó stash
+ * response theo rid vào cs->pending và đánh thức hàm này qua condvar; PUSH
+ * đi đường riêng (handler/queue) nên không lẫn vào response.
+ * @return: >0 độ dài response, 0 nếu server đóng kết nối, -1 nếu lỗi
  */
-int base64_decode(const char *src, unsigned char *out, size_t out_cap)
+int request_wait(ClientState *cs, const char *rid, char *resp, size_t resp_cap)
 {
-    size_t src_len = strlen(src);
-    // Base64 luôn có độ dài chia hết cho 4
-    if (src_len % 4 != 0)
-        return -1;
-
-    // Tính độ dài output: mỗi 4 chars -> 3 bytes (trừ padding)
-    size_t out_len = (src_len / 4) * 3;
-    if (src_len > 0 && src[src_len - 1] == '=')
-        out_len--;
-    if (src_len > 1 && src[src_len - 2] == '=')
-        out_len--;
-
-    if (out_len + 1 > out_cap)
-        return -1;
-
-    size_t i = 0, j = 0;
-    // Xử lý từng nhóm 4 chars
-    while (i < src_len) {
-        // Tra bảng decode cho mỗi ký tự
-        int a = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]];
-        i++;
-        int b = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]];
-        i++;
-        int c = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]];
-        i++;
-        int d = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]];
-        i++;
-
-        // Kiểm tra ký tự không hợp lệ
-        if (a < 0 || b < 0 || c < 0 || d < 0)
-            return -1;
-
-        // Ghép 4 nhóm 6 bits thành 3 bytes
-        unsigned int triple = (a << 18) | (b << 12) | (c << 6) | d;
-
-        if (j < out_len)
-            out[j++] = (triple >> 16) & 0xFF;
-        if (j < out_len)
-            out[j++] = (triple >> 8) & 0xFF;
-        if (j < out_len)
-            out[j++] = triple & 0xFF;
-    }
-
-    out[j] = '\0';
-    return (int)out_len;
+    return net_wait_response(cs, rid, resp, resp_cap);
 }
@@ -0,0 +1,337 @@
+#include "base64.h"
+
+#include <string.h>
+
+/*
+ * common/base64.c
+ * - Scalar path: xử lý từng nhóm 3 byte / 4 ký tự (chuyển từ server/messages.c
+ *   và client/client_utils.c — trước đây 2 bản copy giống nhau).
+ * - SIMD path (x86 + GCC): kernel SSSE3 (12 byte/vòng) và AVX2 (24 byte/vòng)
+ *   theo kỹ thuật của Muła/aklomp: shuffle tách nhóm 6 bit rồi cộng offset
+ *   tra bảng thay vì lookup từng byte. Kernel chỉ ăn các block "giữa" input;
+ *   phần đuôi (gồm cả padding '=') luôn do scalar xử lý nên semantics — kể cả
+ *   các case lỗi — giống hệt bản cũ.
+ * - Chọn kernel 1 lần bằng __builtin_cpu_supports; compile bằng
+ *   __attribute__((target(...))) nên không cần đổi CFLAGS.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_SIMD 1
+#include <immintrin.h>
+#endif
+
+static const char b64_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const int b64_decode_table[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,63,
+    52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
+    15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,
+    -1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+    41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+#ifdef B64_SIMD
+
+// 0 = scalar, 1 = SSSE3, 2 = AVX2; -1 = chưa detect.
+static int g_simd_level = -1;
+
+static int simd_level(void)
+{
+    if (g_simd_level < 0) {
+        if (__builtin_cpu_supports("avx2")) g_simd_level = 2;
+        else if (__builtin_cpu_supports("ssse3")) g_simd_level = 1;
+        else g_simd_level = 0;
+    }
+    return g_simd_level;
+}
+
+/*
+ * encode kernel
+ * - Mỗi vòng: shuffle 12 byte input thành 4 nhóm 16-bit chứa sẵn 2 nhóm 6 bit,
+ *   mul/and tách thành 16 index 0-63, rồi cộng offset ASCII tra qua 1 lần
+ *   shuffle (offset phụ thuộc "vùng" của index: A-Z/a-z/0-9/+/).
+ */
+
+__attribute__((target("ssse3")))
+static __m128i enc_translate_128(__m128i indices)
+{
+    const __m128i lut = _mm_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    __m128i sel = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    sel = _mm_sub_epi8(sel, _mm_cmpgt_epi8(indices, _mm_set1_epi8(25)));
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(lut, sel));
+}
+
+__attribute__((target("ssse3")))
+static __m128i enc_reshuffle_128(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+// Encode các block 12 byte chừng nào còn load được 16 byte an toàn.
+// Cập nhật *i/*j, phần còn lại để scalar.
+__attribute__((target("ssse3")))
+static void encode_ssse3(const unsigned char* src, size_t src_len,
+                         char* out, size_t* i, size_t* j)
+{
+    while (*i + 16 <= src_len) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + *i));
+        __m128i indices = enc_reshuffle_128(in);
+        _mm_storeu_si128((__m128i*)(out + *j), enc_translate_128(indices));
+        *i += 12;
+        *j += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(const unsigned char* src, size_t src_len,
+                        char* out, size_t* i, size_t* j)
+{
+    const __m256i shuf = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i lut = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+    // Load 2 lane 16 byte lệch nhau 12 (đọc trước i+28 byte) => 24 byte/vòng.
+    while (*i + 28 <= src_len) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(src + *i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(src + *i + 12));
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+        in = _mm256_shuffle_epi8(in, shuf);
+        __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i sel = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        sel = _mm256_sub_epi8(sel, _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(25)));
+        __m256i ascii = _mm256_add_epi8(indices, _mm256_shuffle_epi8(lut, sel));
+
+        _mm256_storeu_si256((__m256i*)(out + *j), ascii);
+        *i += 24;
+        *j += 32;
+    }
+}
+
+/*
+ * decode kernel
+ * - Validate bằng 2 bảng bit-flag tra theo nibble cao/thấp: ký tự hợp lệ khi
+ *   flags giao nhau bằng 0. Gặp ký tự lạ (gồm cả '=') thì DỪNG, để scalar xử
+ *   lý từ vị trí đó — giữ nguyên hành vi lỗi/padding của bản cũ.
+ * - Ký tự hợp lệ: cộng offset (tra theo nibble cao) ra giá trị 6 bit, rồi
+ *   madd gom 4 nhóm 6 bit thành 3 byte.
+ */
+
+__attribute__((target("ssse3")))
+static void decode_ssse3(const char* src, size_t src_len,
+                         unsigned char* out, size_t* i, size_t* j)
+{
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_0F = _mm_set1_epi8(0x0F);
+    const __m128i mask_2F = _mm_set1_epi8(0x2F);
+
+    while (*i + 16 <= src_len) {
+        __m128i str = _mm_loadu_si128((const __m128i*)(src + *i));
+        __m128i hi_nib = _mm_and_si128(_mm_srli_epi32(str, 4), mask_0F);
+        __m128i lo_nib = _mm_and_si128(str, mask_0F);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nib);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nib);
+
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+                                             _mm_setzero_si128()))) {
+            return; // có ký tự không hợp lệ hoặc '=': scalar xử lý tiếp
+        }
+
+        __m128i eq_2F = _mm_cmpeq_epi8(str, mask_2F);
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2F, hi_nib));
+        str = _mm_add_epi8(str, roll);
+
+        __m128i merge = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        __m128i packed = _mm_madd_epi16(merge, _mm_set1_epi32(0x00011000));
+        packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+        // 12 byte output: 8 + 4
+        _mm_storel_epi64((__m128i*)(out + *j), packed);
+        int tail = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        memcpy(out + *j + 8, &tail, 4);
+        *i += 16;
+        *j += 12;
+    }
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(const char* src, size_t src_len,
+                        unsigned char* out, size_t* i, size_t* j)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_0F = _mm256_set1_epi8(0x0F);
+    const __m256i mask_2F = _mm256_set1_epi8(0x2F);
+
+    while (*i + 32 <= src_len) {
+        __m256i str = _mm256_loadu_si256((const __m256i*)(src + *i));
+        __m256i hi_nib = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_0F);
+        __m256i lo_nib = _mm256_and_si256(str, mask_0F);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nib);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nib);
+
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi),
+                                                   _mm256_setzero_si256()))) {
+            return; // scalar xử lý tiếp từ *i
+        }
+
+        __m256i eq_2F = _mm256_cmpeq_epi8(str, mask_2F);
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2F, hi_nib));
+        str = _mm256_add_epi8(str, roll);
+
+        __m256i merge = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        __m256i packed = _mm256_madd_epi16(merge, _mm256_set1_epi32(0x00011000));
+        packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        packed = _mm256_permutevar8x32_epi32(packed,
+            _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 0, 0));
+
+        // 24 byte output: 16 + 8
+        _mm_storeu_si128((__m128i*)(out + *j), _mm256_castsi256_si128(packed));
+        _mm_storel_epi64((__m128i*)(out + *j + 16),
+                         _mm256_extracti128_si256(packed, 1));
+        *i += 32;
+        *j += 24;
+    }
+}
+
+#endif // B64_SIMD
+
+int base64_encode(const unsigned char* src, size_t src_len,
+                  char* out, size_t out_cap)
+{
+    size_t out_len = ((src_len + 2) / 3) * 4;
+    if (out_len + 1 > out_cap) return -1;
+
+    size_t i = 0, j = 0;
+
+#ifdef B64_SIMD
+    // Kernel chỉ ăn các block nguyên (để lại >=4 byte đọc thừa an toàn);
+    // group cuối + padding luôn do scalar bên dưới xử lý.
+    int lvl = simd_level();
+    if (lvl == 2) encode_avx2(src, src_len, out, &i, &j);
+    else if (lvl == 1) encode_ssse3(src, src_len, out, &i, &j);
+#endif
+
+    while (i < src_len) {
+        unsigned int a = i < src_len ? src[i++] : 0;
+        unsigned int b = i < src_len ? src[i++] : 0;
+        unsigned int c = i < src_len ? src[i++] : 0;
+
+        unsigned int triple = (a << 16) | (b << 8) | c;
+
+        out[j++] = b64_table[(triple >> 18) & 0x3F];
+        out[j++] = b64_table[(triple >> 12) & 0x3F];
+        out[j++] = b64_table[(triple >> 6) & 0x3F];
+        out[j++] = b64_table[triple & 0x3F];
+    }
+
+    // Padding
+    size_t mod = src_len % 3;
+    if (mod == 1) {
+        out[j - 1] = '=';
+        out[j - 2] = '=';
+    } else if (mod == 2) {
+        out[j - 1] = '=';
+    }
+
+    out[j] = '\0';
+    return (int)j;
+}
+
+int base64_decode(const char* src, unsigned char* out, size_t out_cap)
+{
+    size_t src_len = strlen(src);
+    if (src_len % 4 != 0) return -1;
+
+    size_t out_len = (src_len / 4) * 3;
+    if (src_len > 0 && src[src_len - 1] == '=') out_len--;
+    if (src_len > 1 && src[src_len - 2] == '=') out_len--;
+
+    if (out_len + 1 > out_cap) return -1;
+
+    size_t i = 0, j = 0;
+
+#ifdef B64_SIMD
+    // Kernel dừng ở block đầu tiên chứa ký tự ngoài bảng Base64 (kể cả '='),
+    // scalar bên dưới tiếp tục từ đó với semantics y như cũ.
+    int lvl = simd_level();
+    if (lvl == 2) decode_avx2(src, src_len, out, &i, &j);
+    else if (lvl == 1) decode_ssse3(src, src_len, out, &i, &j);
+#endif
+
+    while (i < src_len) {
+        int a = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
+        int b = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
+        int c = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
+        int d = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
+
+        if (a < 0 || b < 0 || c < 0 || d < 0) return -1;
+
+        unsigned int triple = (a << 18) | (b << 12) | (c << 6) | d;
+
+        if (j < out_len) out[j++] = (triple >> 16) & 0xFF;
+        if (j < out_len) out[j++] = (triple >> 8) & 0xFF;
+        if (j < out_len) out[j++] = triple & 0xFF;
+    }
+
+    out[j] = '\0';
+    return (int)out_len;
+}
+
+int base64_encode_str(const char* text, char* out, size_t out_cap)
+{
+    return base64_encode((const unsigned char*)text, strlen(text), out, out_cap);
+}
+
+int base64_decode_str(const char* b64, char* out, size_t out_cap)
+{
+    return base64_decode(b64, (unsigned char*)out, out_cap);
+}
@@ -0,0 +1,29 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <stddef.h>
+
+/*
+ * common/base64.*
+ * - Encode/decode Base64 dùng chung cho server (messages) và client.
+ * - Hot path: chạy trên MỌI nội dung PM/GM 2 chiều, nên ngoài scalar còn có
+ *   kernel SSSE3/AVX2 (x86, GCC) chọn theo CPU lúc runtime — xử lý 12/24 byte
+ *   mỗi vòng thay vì 3; máy không hỗ trợ tự rơi về scalar, kết quả giống hệt.
+ */
+
+// Encode binary data thành Base64 string (NUL-terminated).
+// Return độ dài chuỗi encoded, hoặc -1 nếu out_cap không đủ.
+int base64_encode(const unsigned char* src, size_t src_len,
+                  char* out, size_t out_cap);
+
+// Decode Base64 string (độ dài phải chia hết cho 4) thành binary data.
+// Return độ dài data decoded, hoặc -1 nếu input/out_cap không hợp lệ.
+int base64_decode(const char* src, unsigned char* out, size_t out_cap);
+
+// Helper: encode plain text to Base64 (convenience wrapper)
+int base64_encode_str(const char* text, char* out, size_t out_cap);
+
+// Helper: decode Base64 to plain text (convenience wrapper)
+int base64_decode_str(const char* b64, char* out, size_t out_cap);
+
+#endif
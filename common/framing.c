@@ -1,20 +1,61 @@
-﻿#include "framing.h"
+#include "framing.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
 /*
  * common/framing.c
  * - Nhận dữ liệu TCP vào buffer nội bộ và tách theo delimiter "\r\n".
  * - Cho phép recv() trả về mảnh/ghép (stream) nhưng app vẫn xử lý theo từng dòng.
- * - Nếu không gặp "\r\n" mà buffer vượt ~64KB => coi là dòng quá dài.
+ * - Tối ưu cho batch nhiều line trong 1 lần recv:
+ *   + `head`: pop 1 line chỉ dịch con trỏ, không memmove phần còn lại.
+ *   + `scan`: nhớ vị trí đã quét nên mỗi byte chỉ bị tìm "\r\n" đúng 1 lần
+ *     (dùng memchr thay vì loop từng byte từ đầu buffer).
+ * - Nếu không gặp "\r\n" mà dữ liệu pending vượt ~64KB => coi là dòng quá dài.
  */
 
-static int ensure_capacity(LineFramer* framer, size_t need)
+// recv() theo khối lớn để giảm số syscall khi client gửi dồn nhiều line.
+#define FRAMER_RECV_CHUNK (16 * 1024)
+
+// Tổng byte đã feed vào mọi framer của process (phục vụ STATS phía server).
+// Cộng 1 lần mỗi chunk recv nên mutex không đáng kể.
+static pthread_mutex_t g_bytes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long long g_bytes_received = 0;
+
+long long framer_bytes_received(void)
+{
+    pthread_mutex_lock(&g_bytes_mutex);
+    long long n = g_bytes_received;
+    pthread_mutex_unlock(&g_bytes_mutex);
+    return n;
+}
+
+/*
+ * compact
+ * - Dồn vùng pending (data[head..len)) về đầu buffer, thu hồi phần đã tiêu thụ.
+ */
+static void compact(LineFramer* framer)
+{
+    if (framer->head == 0) return;
+    size_t pending = framer->len - framer->head;
+    memmove(framer->data, framer->data + framer->head, pending);
+    framer->len = pending;
+    framer->scan -= framer->head;
+    framer->head = 0;
+}
+
+// Đảm bảo còn chỗ append thêm `extra` byte sau len hiện tại.
+static int ensure_capacity(LineFramer* framer, size_t extra)
 {
-    if (need <= framer->cap) return 0;
+    if (framer->len + extra <= framer->cap) return 0;
+
+    // Compact trước khi grow: có thể đủ chỗ mà không cần realloc.
+    compact(framer);
+    if (framer->len + extra <= framer->cap) return 0;
 
+    size_t need = framer->len + extra;
     size_t new_cap = framer->cap ? framer->cap : 256;
     while (new_cap < need) new_cap *= 2;
 
@@ -40,6 +81,8 @@ int framer_init(LineFramer* framer, size_t initial_cap)
     if (!framer->data) return -1;
     framer->cap = initial_cap;
     framer->len = 0;
+    framer->head = 0;
+    framer->scan = 0;
     return 0;
 }
 
@@ -54,41 +97,136 @@ void framer_free(LineFramer* framer)
     framer->data = NULL;
     framer->len = 0;
     framer->cap = 0;
+    framer->head = 0;
+    framer->scan = 0;
 }
 
+void framer_set_mode(LineFramer* framer, int mode)
+{
+    framer->mode = mode;
+}
+
+/*
+ * framer_pending
+ * - Số byte đã nhận nhưng chưa pop được thành line.
+ */
+size_t framer_pending(const LineFramer* framer)
+{
+    return framer->len - framer->head;
+}
+
+/*
+ * framer_feed
+ * - Append dữ liệu đã nhận từ bên ngoài vào buffer (không tự recv).
+ * - Phục vụ chế độ event-loop: worker tự recv() rồi feed vào framer.
+ * Return: 0 nếu OK, -1 nếu lỗi cấp phát.
+ */
+int framer_feed(LineFramer* framer, const char* data, size_t len)
+{
+    if (len == 0) return 0;
+    pthread_mutex_lock(&g_bytes_mutex);
+    g_bytes_received += (long long)len;
+    pthread_mutex_unlock(&g_bytes_mutex);
+    if (framer->head == framer->len) {
+        // Buffer rỗng: reset về đầu để khỏi tích lũy offset.
+        framer->head = framer->len = framer->scan = 0;
+    }
+    if (ensure_capacity(framer, len + 1) != 0) return -1;
+    memcpy(framer->data + framer->len, data, len);
+    framer->len += len;
+    framer->data[framer->len] = 0;
+    return 0;
+}
+
+/*
+ * find_crlf
+ * - Tìm "\r\n" trong vùng pending, tiếp tục từ vị trí `scan` của lần trước.
+ * - Sau khi trả NULL, scan đứng ở len-1 (phòng '\r' cuối buffer ghép với
+ *   '\n' của lần recv sau) hoặc len nếu byte cuối không phải '\r'.
+ */
 static char* find_crlf(LineFramer* framer)
 {
-    if (framer->len < 2) return NULL;
-    for (size_t i = 0; i + 1 < framer->len; i++) {
-        if (framer->data[i] == '\r' && framer->data[i + 1] == '\n') {
-            return framer->data + i;
+    size_t pos = framer->scan > framer->head ? framer->scan : framer->head;
+    while (pos + 1 < framer->len) {
+        char* p = (char*)memchr(framer->data + pos, '\r', framer->len - pos - 1);
+        if (!p) {
+            framer->scan = framer->len;
+            if (framer->len > 0 && framer->data[framer->len - 1] == '\r') {
+                framer->scan = framer->len - 1;
+            }
+            return NULL;
         }
+        if (p[1] == '\n') {
+            framer->scan = (size_t)(p - framer->data);
+            return p;
+        }
+        pos = (size_t)(p - framer->data) + 1;
     }
+    framer->scan = pos;
     return NULL;
 }
 
 /*
  * framer_pop_line
- * - Tìm "\r\n" trong buffer, nếu có thì copy ra `out` và remove khỏi buffer.
+ * - Tìm "\r\n" trong buffer, nếu có thì copy ra `out` và tiêu thụ bằng cách
+ *   dịch `head` (không memmove; compact được thực hiện lazily khi cần chỗ).
  * Return:
  *   1  : đã pop được 1 line
  *   0  : chưa đủ dữ liệu (chưa thấy "\r\n")
  *  -2  : out_cap không đủ (line quá dài so với buffer output)
  */
+/*
+ * pop_length_prefixed
+ * - Chế độ binary: frame = 4 byte big-endian độ dài + đúng chừng đó byte
+ *   payload. Không scan delimiter nên payload chứa byte bất kỳ (kể cả \r\n).
+ * Return: giống framer_pop_line.
+ */
+static int pop_length_prefixed(LineFramer* framer, char* out, size_t out_cap)
+{
+    size_t pending = framer->len - framer->head;
+    if (pending < 4) return 0;
+
+    const unsigned char* p = (const unsigned char*)framer->data + framer->head;
+    size_t flen = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) |
+                  ((size_t)p[2] << 8) | (size_t)p[3];
+
+    // Cùng giới hạn với chế độ line (~64KB): prefix lớn hơn coi như peer hỏng.
+    if (flen > 64 * 1024) return -2;
+    if (pending < 4 + flen) return 0;
+    if (flen + 1 > out_cap) return -2;
+
+    memcpy(out, framer->data + framer->head + 4, flen);
+    out[flen] = 0;
+
+    framer->head += 4 + flen;
+    framer->scan = framer->head;
+    if (framer->head == framer->len) {
+        framer->head = framer->len = framer->scan = 0;
+    }
+
+    return 1;
+}
+
 int framer_pop_line(LineFramer* framer, char* out, size_t out_cap)
 {
+    if (framer->mode == FRAMER_MODE_LENGTH) {
+        return pop_length_prefixed(framer, out, out_cap);
+    }
+
     char* crlf = find_crlf(framer);
     if (!crlf) return 0;
 
-    size_t line_len = (size_t)(crlf - framer->data);
+    size_t line_len = (size_t)(crlf - (framer->data + framer->head));
     if (line_len + 1 > out_cap) return -2;
 
-    memcpy(out, framer->data, line_len);
+    memcpy(out, framer->data + framer->head, line_len);
     out[line_len] = 0;
 
-    size_t remain = framer->len - (line_len + 2);
-    memmove(framer->data, crlf + 2, remain);
-    framer->len = remain;
+    framer->head += line_len + 2;
+    framer->scan = framer->head;
+    if (framer->head == framer->len) {
+        framer->head = framer->len = framer->scan = 0;
+    }
 
     return 1;
 }
@@ -109,18 +247,15 @@ int framer_recv_line(int sock, LineFramer* framer, char* out, size_t out_cap)
         if (popped == 1) return (int)strlen(out);
         if (popped < 0) return popped;
 
-        char tmp[512];
+        char tmp[FRAMER_RECV_CHUNK];
         int r = (int)recv(sock, tmp, (int)sizeof(tmp), 0);
         if (r == 0) return 0;
         if (r < 0) return -1;
 
-        if (ensure_capacity(framer, framer->len + (size_t)r + 1) != 0) return -1;
-        memcpy(framer->data + framer->len, tmp, (size_t)r);
-        framer->len += (size_t)r;
-        framer->data[framer->len] = 0;
+        if (framer_feed(framer, tmp, (size_t)r) != 0) return -1;
 
         // Guard: tránh trường hợp client gửi 1 line không có delimiter.
-        if (framer->len > 64 * 1024) {
+        if (framer_pending(framer) > 64 * 1024) {
             return -2;
         }
     }
@@ -1,4 +1,4 @@
-﻿#ifndef FRAMING_H
+#ifndef FRAMING_H
 #define FRAMING_H
 
 #include <stddef.h>
@@ -7,19 +7,44 @@
  * common/framing.*
  * - TCP là stream nên recv() có thể trả về mảnh/ghép nhiều message.
  * - Module này gom buffer và tách message theo delimiter "\r\n" (line-based).
+ * - Buffer tiêu thụ theo head-pointer: pop 1 line chỉ dịch con trỏ `head`
+ *   thay vì memmove phần còn lại; vùng đã đọc được compact khi cần.
  */
 
+// Chế độ tách frame (xem framer_set_mode).
+#define FRAMER_MODE_LINE   0  // delimiter "\r\n" (mặc định)
+#define FRAMER_MODE_LENGTH 1  // prefix 4 byte big-endian độ dài frame
+
 typedef struct {
     // Buffer nội bộ (dữ liệu TCP đã nhận nhưng chưa pop hết thành line)
     char* data;
-    size_t len;
+    size_t len;   // tổng số byte hợp lệ trong data
     size_t cap;
+    size_t head;  // offset byte đầu tiên CHƯA tiêu thụ (data[head..len) là pending)
+    size_t scan;  // offset đã quét tìm "\r\n" (tránh quét lại từ đầu mỗi lần)
+    int mode;     // FRAMER_MODE_LINE / FRAMER_MODE_LENGTH
 } LineFramer;
 
 // Khởi tạo/giải phóng bộ đệm của framer.
 int framer_init(LineFramer* framer, size_t initial_cap);
 void framer_free(LineFramer* framer);
 
+// Chuyển chế độ tách frame (sau khi negotiate UPGRADE). Dữ liệu pending
+// trong buffer sẽ được parse theo chế độ mới — caller phải đảm bảo peer
+// không pipeline frame cũ qua điểm chuyển.
+void framer_set_mode(LineFramer* framer, int mode);
+
+// Số byte đã nhận nhưng chưa tách được thành line (dùng cho guard line quá dài).
+size_t framer_pending(const LineFramer* framer);
+
+// Tổng byte đã feed vào mọi framer của process (counter cho STATS).
+long long framer_bytes_received(void);
+
+// Append dữ liệu đã nhận (từ recv bên ngoài) vào buffer của framer.
+// Dùng cho chế độ event-loop, nơi caller tự recv() non-blocking.
+// Trả về: 0 nếu OK, -1 nếu lỗi cấp phát.
+int framer_feed(LineFramer* framer, const char* data, size_t len);
+
 // Trả về: 1 nếu pop được 1 dòng, 0 nếu chưa đủ dữ liệu, -1 lỗi, -2 dòng quá dài.
 int framer_pop_line(LineFramer* framer, char* out, size_t out_cap);
 
@@ -1,15 +1,21 @@
 ﻿#include "protocol.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 /*
  * common/protocol.c
  * - Parse 1 line thành (verb, req_id, payload).
  * - Gửi response theo format: OK <rid> ... / ERR <rid> <code> <message>.
  * - Không parse sâu payload (kv) để giữ layer protocol đơn giản.
+ * - Per-connection output buffer: server bật quanh 1 batch request để gom
+ *   nhiều response/push nhỏ thành 1 lần send (thay vì 1 syscall mỗi frame).
  */
 
 /*
@@ -29,6 +35,592 @@ static int send_all(int sock, const char* data, size_t len)
     return 0;
 }
 
+// Tổng byte outbound của process, cộng tại proto_send_frame (đường đi chung
+// của mọi frame, buffered lẫn direct) — counter cho STATS phía server.
+static pthread_mutex_t g_bytes_out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long long g_bytes_sent = 0;
+
+long long proto_bytes_sent(void)
+{
+    pthread_mutex_lock(&g_bytes_out_mutex);
+    long long n = g_bytes_sent;
+    pthread_mutex_unlock(&g_bytes_out_mutex);
+    return n;
+}
+
+// ============ Per-connection output buffering ============
+
+typedef struct {
+    int active;   // 1 = đang trong batch, proto_send_* sẽ append thay vì send
+    int binary;   // 1 = connection đã UPGRADE: frame outbound có length prefix
+    char* data;
+    size_t len;
+    size_t cap;
+
+    // Hàng đợi push (các frame hoàn chỉnh nối tiếp): proto_send_push enqueue
+    // không block, drain bằng MSG_DONTWAIT tại chỗ hoặc bởi writer thread.
+    char* pq;
+    size_t pq_len;
+    size_t pq_cap;
+    int draining; // 1 = có thread đang gửi pq ngoài lock (giữ thứ tự byte)
+} OutBuf;
+
+// Bảng OutBuf index trực tiếp theo fd (fd là số nhỏ, grow theo nhu cầu).
+// Mutex bảo vệ cả bảng lẫn nội dung buffer: append là memcpy ngắn nên giữ
+// lock không đáng kể; send luôn thực hiện NGOÀI lock để không chặn nhau.
+static pthread_mutex_t g_out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OutBuf* g_out = NULL;
+static int g_out_cap = 0;
+
+// Đánh thức writer thread khi có socket mới vào hàng đợi push.
+static pthread_cond_t g_pq_cond = PTHREAD_COND_INITIALIZER;
+// Báo proto_out_close khi writer nhả socket (draining -> 0).
+static pthread_cond_t g_pq_drain_cond = PTHREAD_COND_INITIALIZER;
+// Số frame push đã drop do hàng đợi recipient đầy (bảo vệ bởi g_out_mutex).
+static long long g_pushes_dropped = 0;
+
+static int pq_append_unlocked(OutBuf* ob, const char* data, size_t len);
+
+// Giữ lại tối đa chừng này capacity giữa các batch để tránh malloc lặp lại.
+#define OUTBUF_KEEP_CAP (16 * 1024)
+
+/*
+ * out_get_unlocked
+ * - Lấy OutBuf cho fd, grow bảng nếu cần. Return NULL nếu lỗi cấp phát.
+ */
+static OutBuf* out_get_unlocked(int sock)
+{
+    if (sock < 0) return NULL;
+    if (sock >= g_out_cap) {
+        int new_cap = g_out_cap ? g_out_cap : 64;
+        while (new_cap <= sock) new_cap *= 2;
+        OutBuf* next = (OutBuf*)realloc(g_out, (size_t)new_cap * sizeof(OutBuf));
+        if (!next) return NULL;
+        memset(next + g_out_cap, 0, (size_t)(new_cap - g_out_cap) * sizeof(OutBuf));
+        g_out = next;
+        g_out_cap = new_cap;
+    }
+    return &g_out[sock];
+}
+
+/*
+ * out_append_unlocked
+ * - Append 1 frame hoàn chỉnh vào buffer của socket.
+ */
+static int out_append_unlocked(OutBuf* ob, const char* data, size_t len)
+{
+    if (ob->len + len > ob->cap) {
+        size_t new_cap = ob->cap ? ob->cap : 1024;
+        while (new_cap < ob->len + len) new_cap *= 2;
+        char* next = (char*)realloc(ob->data, new_cap);
+        if (!next) return -1;
+        ob->data = next;
+        ob->cap = new_cap;
+    }
+    memcpy(ob->data + ob->len, data, len);
+    ob->len += len;
+    return 0;
+}
+
+int proto_set_binary(int sock, int enabled)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = out_get_unlocked(sock);
+    if (!ob) {
+        pthread_mutex_unlock(&g_out_mutex);
+        return -1;
+    }
+    ob->binary = enabled ? 1 : 0;
+    pthread_mutex_unlock(&g_out_mutex);
+    return 0;
+}
+
+static int is_binary(int sock)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    int b = (sock >= 0 && sock < g_out_cap) ? g_out[sock].binary : 0;
+    pthread_mutex_unlock(&g_out_mutex);
+    return b;
+}
+
+int proto_out_begin(int sock)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = out_get_unlocked(sock);
+    if (!ob) {
+        pthread_mutex_unlock(&g_out_mutex);
+        return -1;
+    }
+    ob->active = 1;
+    ob->len = 0;
+    pthread_mutex_unlock(&g_out_mutex);
+    return 0;
+}
+
+int proto_out_end(int sock)
+{
+    /*
+     * Cuối batch: tách buffer ra khỏi entry (dưới lock) rồi send ngoài lock,
+     * để 1 connection chậm không chặn các thread khác đang append/push.
+     */
+    char* data = NULL;
+    size_t len = 0;
+    int queued = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = (sock >= 0 && sock < g_out_cap) ? &g_out[sock] : NULL;
+    if (ob && ob->active) {
+        ob->active = 0;
+        if (ob->len > 0) {
+            data = ob->data;
+            len = ob->len;
+            ob->data = NULL;
+            ob->len = 0;
+            ob->cap = 0;
+        } else if (ob->cap > OUTBUF_KEEP_CAP) {
+            free(ob->data);
+            ob->data = NULL;
+            ob->cap = 0;
+        }
+    }
+    // Hàng đợi push còn byte đang đợi: batch phải xếp sau để giữ thứ tự
+    // (writer thread gửi nốt), không send vượt mặt.
+    if (data && ob && (ob->pq_len > 0 || ob->draining)) {
+        if (pq_append_unlocked(ob, data, len) == 0) {
+            queued = 1;
+            pthread_cond_signal(&g_pq_cond);
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&g_out_mutex);
+
+    if (!data) return 0;
+    if (rc != 0) {
+        free(data);
+        return rc;
+    }
+
+    if (!queued) rc = send_all(sock, data, len);
+
+    // Trả buffer lại cho entry nếu còn trống (giảm malloc cho batch sau).
+    pthread_mutex_lock(&g_out_mutex);
+    ob = (sock < g_out_cap) ? &g_out[sock] : NULL;
+    if (ob && ob->data == NULL && len <= OUTBUF_KEEP_CAP) {
+        ob->data = data;
+        ob->cap = len;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&g_out_mutex);
+
+    free(data);
+    return rc;
+}
+
+/*
+ * out_try_buffer
+ * - Nếu socket đang trong batch: append frame vào buffer, return 1.
+ * - Ngược lại return 0 (caller tự send trực tiếp); -1 nếu lỗi cấp phát.
+ */
+static int out_try_buffer(int sock, const struct iovec* iov, int iovcnt)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = (sock >= 0 && sock < g_out_cap) ? &g_out[sock] : NULL;
+    if (!ob || !ob->active) {
+        pthread_mutex_unlock(&g_out_mutex);
+        return 0;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (out_append_unlocked(ob, (const char*)iov[i].iov_base, iov[i].iov_len) != 0) {
+            pthread_mutex_unlock(&g_out_mutex);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&g_out_mutex);
+    return 1;
+}
+
+/*
+ * send_iov
+ * - Gửi 1 frame gồm nhiều mảnh bằng writev (1 syscall thay vì 1 send/mảnh).
+ * - Short write (backpressure) thì gửi nốt phần còn lại bằng send_all.
+ */
+static int send_iov(int sock, struct iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    ssize_t n = writev(sock, iov, iovcnt);
+    if (n < 0) return -1;
+    if ((size_t)n == total) return 0;
+
+    // Gửi nốt phần còn thiếu
+    size_t skip = (size_t)n;
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        if (send_all(sock, (const char*)iov[i].iov_base + skip, iov[i].iov_len - skip) != 0) {
+            return -1;
+        }
+        skip = 0;
+    }
+    return 0;
+}
+
+// ============ Bounded non-blocking push delivery ============
+
+/*
+ * pq_append_unlocked
+ * - Append bytes vào hàng đợi push của socket. Gọi khi đang giữ g_out_mutex.
+ * - Ngoài lúc drain, pq luôn bắt đầu tại offset 0 (drain dở sẽ dồn phần còn
+ *   lại về đầu trước khi trả buffer lại entry).
+ */
+static int pq_append_unlocked(OutBuf* ob, const char* data, size_t len)
+{
+    if (ob->pq_len + len > ob->pq_cap) {
+        size_t new_cap = ob->pq_cap ? ob->pq_cap : 1024;
+        while (new_cap < ob->pq_len + len) new_cap *= 2;
+        char* next = (char*)realloc(ob->pq, new_cap);
+        if (!next) return -1;
+        ob->pq = next;
+        ob->pq_cap = new_cap;
+    }
+    memcpy(ob->pq + ob->pq_len, data, len);
+    ob->pq_len += len;
+    return 0;
+}
+
+/*
+ * out_drain
+ * - Gửi hàng đợi push của socket bằng MSG_DONTWAIT (không bao giờ block).
+ * - Steal buffer ra khỏi entry để send NGOÀI lock (enqueue trong lúc đó tạo
+ *   buffer mới); gửi được 1 phần thì ghép remainder TRƯỚC phần mới enqueue
+ *   rồi để writer thread poll POLLOUT gửi nốt.
+ * - Lỗi send khác EAGAIN => connection coi như chết, vứt toàn bộ hàng đợi
+ *   (fd sẽ được reader phát hiện và đóng như mọi khi).
+ */
+static void out_drain(int sock)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = (sock >= 0 && sock < g_out_cap) ? &g_out[sock] : NULL;
+    if (!ob || ob->draining || ob->pq_len == 0) {
+        pthread_mutex_unlock(&g_out_mutex);
+        return;
+    }
+    ob->draining = 1;
+
+    while (ob && ob->pq_len > 0) {
+        // Steal buffer hiện tại để send ngoài lock
+        char* data = ob->pq;
+        size_t len = ob->pq_len;
+        size_t cap = ob->pq_cap;
+        size_t off = 0;
+        ob->pq = NULL;
+        ob->pq_len = 0;
+        ob->pq_cap = 0;
+        pthread_mutex_unlock(&g_out_mutex);
+
+        int dead = 0;
+        while (off < len) {
+            ssize_t n = send(sock, data + off, len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                off += (size_t)n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            dead = 1; // peer đóng hoặc lỗi socket
+            break;
+        }
+
+        pthread_mutex_lock(&g_out_mutex);
+        ob = (sock < g_out_cap) ? &g_out[sock] : NULL;
+        if (!ob) {
+            free(data);
+            break;
+        }
+        if (dead) {
+            free(data);
+            free(ob->pq);
+            ob->pq = NULL;
+            ob->pq_len = 0;
+            ob->pq_cap = 0;
+            break;
+        }
+        if (off >= len) {
+            // Gửi hết phần steal: trả buffer lại entry nếu còn trống
+            if (ob->pq == NULL) {
+                ob->pq = data;
+                ob->pq_cap = cap;
+            } else {
+                free(data);
+            }
+            continue; // còn phần enqueue trong lúc gửi thì drain tiếp
+        }
+
+        // Short write (socket đầy): dồn remainder về đầu, ghép phần mới
+        // enqueue (nếu có) ra sau để giữ thứ tự, rồi để writer poll.
+        size_t rem = len - off;
+        memmove(data, data + off, rem);
+        if (ob->pq_len > 0) {
+            size_t need = rem + ob->pq_len;
+            if (need > cap) {
+                char* next = (char*)realloc(data, need);
+                if (next) {
+                    data = next;
+                    cap = need;
+                }
+            }
+            if (rem + ob->pq_len <= cap) {
+                memcpy(data + rem, ob->pq, ob->pq_len);
+                rem += ob->pq_len;
+            } else {
+                // Hết bộ nhớ: đành vứt phần mới (giữ remainder cho liền mạch)
+                g_pushes_dropped++;
+            }
+            free(ob->pq);
+        }
+        ob->pq = data;
+        ob->pq_len = rem;
+        ob->pq_cap = cap;
+        break;
+    }
+
+    if (ob) ob->draining = 0;
+    pthread_cond_broadcast(&g_pq_drain_cond);
+    if (ob && ob->pq_len > 0) pthread_cond_signal(&g_pq_cond);
+    pthread_mutex_unlock(&g_out_mutex);
+}
+
+#define PQ_WRITER_MAX_FDS 256
+#define PQ_WRITER_POLL_MS 200
+
+/*
+ * pq_writer_main
+ * - Writer thread nền: gom các socket còn hàng đợi push, poll POLLOUT rồi
+ *   drain socket nào ghi được. Ngủ trên condvar khi không còn gì để gửi;
+ *   timeout poll 200ms để quét lại socket chết im lặng.
+ */
+static void* pq_writer_main(void* arg)
+{
+    (void)arg;
+    struct pollfd pfds[PQ_WRITER_MAX_FDS];
+
+    for (;;) {
+        int n = 0;
+
+        pthread_mutex_lock(&g_out_mutex);
+        for (;;) {
+            n = 0;
+            for (int fd = 0; fd < g_out_cap && n < PQ_WRITER_MAX_FDS; fd++) {
+                if (g_out[fd].pq_len > 0 && !g_out[fd].draining) {
+                    pfds[n].fd = fd;
+                    pfds[n].events = POLLOUT;
+                    pfds[n].revents = 0;
+                    n++;
+                }
+            }
+            if (n > 0) break;
+            pthread_cond_wait(&g_pq_cond, &g_out_mutex);
+        }
+        pthread_mutex_unlock(&g_out_mutex);
+
+        if (poll(pfds, (nfds_t)n, PQ_WRITER_POLL_MS) < 0) continue;
+
+        for (int i = 0; i < n; i++) {
+            // POLLNVAL: fd đã bị đóng (proto_out_close đã dọn hàng đợi)
+            if (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                out_drain(pfds[i].fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Writer thread khởi động lười ở lần enqueue đầu tiên: client link chung
+// protocol.c nhưng không gọi proto_send_push nên không tốn thread.
+static pthread_once_t g_pq_writer_once = PTHREAD_ONCE_INIT;
+
+static void pq_writer_start(void)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, pq_writer_main, NULL) == 0) {
+        pthread_detach(tid);
+    }
+}
+
+int proto_send_push(int sock, const char* data, size_t len)
+{
+    pthread_once(&g_pq_writer_once, pq_writer_start);
+
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = out_get_unlocked(sock);
+    if (!ob) {
+        pthread_mutex_unlock(&g_out_mutex);
+        return -1;
+    }
+
+    // Connection binary: frame có 4 byte big-endian độ dài lên đầu
+    // (cùng format với proto_send_frame).
+    unsigned char prefix[4];
+    size_t frame_len = len;
+    int has_prefix = ob->binary;
+    if (has_prefix) {
+        prefix[0] = (unsigned char)(len >> 24);
+        prefix[1] = (unsigned char)(len >> 16);
+        prefix[2] = (unsigned char)(len >> 8);
+        prefix[3] = (unsigned char)len;
+        frame_len += sizeof(prefix);
+    }
+
+    int rc = 0;
+    int queued = 0;
+    if (ob->active) {
+        // Recipient đang trong batch của thread sở hữu socket: append vào
+        // output buffer như proto_send_raw (flush ở proto_out_end).
+        if (has_prefix) rc = out_append_unlocked(ob, (const char*)prefix, sizeof(prefix));
+        if (rc == 0) rc = out_append_unlocked(ob, data, len);
+    } else if (ob->pq_len + frame_len > PROTO_PUSH_QUEUE_MAX) {
+        // Recipient quá chậm: drop push thay vì stall sender.
+        g_pushes_dropped++;
+        pthread_mutex_unlock(&g_out_mutex);
+        return 0;
+    } else {
+        if (has_prefix) rc = pq_append_unlocked(ob, (const char*)prefix, sizeof(prefix));
+        if (rc == 0) rc = pq_append_unlocked(ob, data, len);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&g_out_mutex);
+
+    if (rc != 0) return -1;
+
+    pthread_mutex_lock(&g_bytes_out_mutex);
+    g_bytes_sent += (long long)frame_len;
+    pthread_mutex_unlock(&g_bytes_out_mutex);
+
+    // Thử drain ngay (không block): phần gửi không hết do writer lo.
+    if (queued) out_drain(sock);
+    return 0;
+}
+
+long long proto_pushes_dropped(void)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    long long n = g_pushes_dropped;
+    pthread_mutex_unlock(&g_out_mutex);
+    return n;
+}
+
+void proto_out_close(int sock)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = (sock >= 0 && sock < g_out_cap) ? &g_out[sock] : NULL;
+    if (ob) {
+        // Chờ writer nhả socket rồi mới vứt hàng đợi: send sau close(fd)
+        // có thể trúng connection khác nếu OS tái sử dụng fd.
+        while (ob->draining) {
+            pthread_cond_wait(&g_pq_drain_cond, &g_out_mutex);
+        }
+        free(ob->pq);
+        ob->pq = NULL;
+        ob->pq_len = 0;
+        ob->pq_cap = 0;
+        ob->active = 0;
+        ob->binary = 0;
+    }
+    pthread_mutex_unlock(&g_out_mutex);
+}
+
+/*
+ * out_queue_if_pending
+ * - Socket còn byte push đang đợi (hoặc đang được drain ngoài lock): frame
+ *   mới phải xếp SAU trong hàng đợi để giữ thứ tự byte stream — response
+ *   không drop nên bỏ qua cap PROTO_PUSH_QUEUE_MAX.
+ * Return: 1 nếu đã queue, 0 nếu caller gửi trực tiếp được, -1 nếu lỗi.
+ */
+static int out_queue_if_pending(int sock, const struct iovec* iov, int iovcnt)
+{
+    pthread_mutex_lock(&g_out_mutex);
+    OutBuf* ob = (sock >= 0 && sock < g_out_cap) ? &g_out[sock] : NULL;
+    if (!ob || (ob->pq_len == 0 && !ob->draining)) {
+        pthread_mutex_unlock(&g_out_mutex);
+        return 0;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (pq_append_unlocked(ob, (const char*)iov[i].iov_base, iov[i].iov_len) != 0) {
+            pthread_mutex_unlock(&g_out_mutex);
+            return -1;
+        }
+    }
+    pthread_cond_signal(&g_pq_cond);
+    pthread_mutex_unlock(&g_out_mutex);
+    return 1;
+}
+
+// ============ Per-connection parse arena ============
+
+// Header đặt trước mỗi allocation quá cỡ (chain để reset giải phóng).
+typedef struct ArenaOverflow {
+    struct ArenaOverflow* next;
+} ArenaOverflow;
+
+int proto_arena_init(ProtoArena* arena, size_t initial_cap)
+{
+    memset(arena, 0, sizeof(*arena));
+    if (initial_cap == 0) initial_cap = 8192;
+    arena->data = (char*)malloc(initial_cap);
+    if (!arena->data) return -1;
+    arena->cap = initial_cap;
+    return 0;
+}
+
+void proto_arena_destroy(ProtoArena* arena)
+{
+    if (!arena) return;
+    proto_arena_reset(arena);
+    free(arena->data);
+    arena->data = NULL;
+    arena->cap = 0;
+}
+
+void* proto_arena_alloc(ProtoArena* arena, size_t n)
+{
+    if (!arena || !arena->data) return NULL;
+
+    // Bump từ block chính (align 8 cho allocation kế tiếp)
+    size_t need = (n + 7) & ~(size_t)7;
+    if (arena->used + need <= arena->cap) {
+        void* p = arena->data + arena->used;
+        arena->used += need;
+        return p;
+    }
+
+    // Quá cỡ block: fallback malloc, nối vào chain để reset giải phóng.
+    // (Không realloc block chính vì sẽ làm hỏng các pointer đã cấp.)
+    ArenaOverflow* ov = (ArenaOverflow*)malloc(sizeof(ArenaOverflow) + n);
+    if (!ov) return NULL;
+    ov->next = (ArenaOverflow*)arena->overflow;
+    arena->overflow = ov;
+    return ov + 1;
+}
+
+void proto_arena_reset(ProtoArena* arena)
+{
+    if (!arena) return;
+    arena->used = 0;
+    ArenaOverflow* ov = (ArenaOverflow*)arena->overflow;
+    while (ov) {
+        ArenaOverflow* next = ov->next;
+        free(ov);
+        ov = next;
+    }
+    arena->overflow = NULL;
+}
+
 // Bỏ khoảng trắng ở đầu chuỗi (phục vụ parse token).
 static void trim_left(const char** p)
 {
@@ -44,7 +636,7 @@ static void trim_left(const char** p)
  * - Hàm chỉ dựa trên khoảng trắng để tách token; không hỗ trợ quoted string.
  * - Nếu VERB/REQ_ID rỗng => trả lỗi.
  */
-int proto_parse_line(const char* line, ProtoMsg* out)
+int proto_parse_line_arena(const char* line, ProtoMsg* out, ProtoArena* arena)
 {
     memset(out, 0, sizeof(*out));
 
@@ -74,21 +666,80 @@ int proto_parse_line(const char* line, ProtoMsg* out)
 
     // PAYLOAD (optional)
     if (*p) {
-        out->payload = (char*)malloc(strlen(p) + 1);
+        size_t len = strlen(p) + 1;
+        if (arena) {
+            out->payload = (char*)proto_arena_alloc(arena, len);
+            out->payload_in_arena = 1;
+        } else {
+            out->payload = (char*)malloc(len);
+        }
         if (!out->payload) return -1;
-        strcpy(out->payload, p);
+        memcpy(out->payload, p, len);
     }
 
     return 0;
 }
 
+int proto_parse_line(const char* line, ProtoMsg* out)
+{
+    return proto_parse_line_arena(line, out, NULL);
+}
+
 void proto_free(ProtoMsg* msg)
 {
     if (!msg) return;
-    free(msg->payload);
+    // Payload trong arena sẽ được thu hồi bởi proto_arena_reset
+    if (!msg->payload_in_arena) {
+        free(msg->payload);
+    }
     msg->payload = NULL;
 }
 
+/*
+ * proto_send_frame
+ * - Đường đi chung của mọi frame outbound: nếu socket đang trong batch thì
+ *   append vào output buffer, ngược lại gửi ngay bằng writev (1 syscall cho
+ *   cả frame nhiều mảnh, không interleave với frame của thread khác).
+ */
+static int proto_send_frame(int sock, struct iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    // Connection đã UPGRADE mode=binary: chèn 4 byte big-endian độ dài frame
+    // lên đầu (nội dung frame giữ nguyên, gồm cả "\r\n" cuối — client binary
+    // dựa vào prefix, không dựa vào delimiter).
+    unsigned char prefix[4];
+    struct iovec biov[4];
+    if (is_binary(sock)) {
+        prefix[0] = (unsigned char)(total >> 24);
+        prefix[1] = (unsigned char)(total >> 16);
+        prefix[2] = (unsigned char)(total >> 8);
+        prefix[3] = (unsigned char)total;
+        biov[0].iov_base = prefix;
+        biov[0].iov_len = sizeof(prefix);
+        for (int i = 0; i < iovcnt; i++) biov[i + 1] = iov[i];
+        iov = biov;
+        iovcnt++;
+        total += sizeof(prefix);
+    }
+
+    pthread_mutex_lock(&g_bytes_out_mutex);
+    g_bytes_sent += (long long)total;
+    pthread_mutex_unlock(&g_bytes_out_mutex);
+
+    int buffered = out_try_buffer(sock, iov, iovcnt);
+    if (buffered < 0) return -1;
+    if (buffered == 1) return 0;
+
+    // Giữ thứ tự với push đang đợi: nếu hàng đợi còn byte thì frame này
+    // phải xếp sau (writer thread gửi), không được send vượt mặt.
+    int queued = out_queue_if_pending(sock, iov, iovcnt);
+    if (queued < 0) return -1;
+    if (queued == 1) return 0;
+    return send_iov(sock, iov, iovcnt);
+}
+
 /*
  * proto_send_ok
  * - Gửi response OK theo format: "OK <req_id> <payload>\r\n".
@@ -97,18 +748,24 @@ void proto_free(ProtoMsg* msg)
 int proto_send_ok(int sock, const char* req_id, const char* payload)
 {
     char header[128];
-    if (payload && payload[0]) {
-        snprintf(header, sizeof(header), "OK %s ", req_id);
-    } else {
-        snprintf(header, sizeof(header), "OK %s", req_id);
-    }
+    int has_payload = (payload && payload[0]);
+    snprintf(header, sizeof(header), has_payload ? "OK %s " : "OK %s", req_id);
 
-    if (send_all(sock, header, strlen(header)) != 0) return -1;
-    if (payload && payload[0]) {
-        if (send_all(sock, payload, strlen(payload)) != 0) return -1;
+    struct iovec iov[3];
+    int n = 0;
+    iov[n].iov_base = header;
+    iov[n].iov_len = strlen(header);
+    n++;
+    if (has_payload) {
+        iov[n].iov_base = (void*)payload;
+        iov[n].iov_len = strlen(payload);
+        n++;
     }
-    if (send_all(sock, "\r\n", 2) != 0) return -1;
-    return 0;
+    iov[n].iov_base = (void*)"\r\n";
+    iov[n].iov_len = 2;
+    n++;
+
+    return proto_send_frame(sock, iov, n);
 }
 
 /*
@@ -120,5 +777,115 @@ int proto_send_err(int sock, const char* req_id, int code, const char* message)
 {
     char line[512];
     snprintf(line, sizeof(line), "ERR %s %d %s\r\n", req_id, code, message ? message : "");
-    return send_all(sock, line, strlen(line));
+
+    struct iovec iov[1];
+    iov[0].iov_base = line;
+    iov[0].iov_len = strlen(line);
+    return proto_send_frame(sock, iov, 1);
+}
+
+// ============ Streaming response (OK-PART / OK-END) ============
+
+void proto_stream_begin(ProtoStream* st, int sock, const char* req_id)
+{
+    memset(st, 0, sizeof(*st));
+    st->sock = sock;
+    snprintf(st->req_id, sizeof(st->req_id), "%s", req_id ? req_id : "");
+}
+
+// Gửi 1 frame "OK-PART <rid> <payload>\r\n" (payload truyền rời, không copy).
+static int stream_send_part(ProtoStream* st, const char* payload, size_t len)
+{
+    char header[64];
+    snprintf(header, sizeof(header), "OK-PART %s ", st->req_id);
+
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void*)"\r\n";
+    iov[2].iov_len = 2;
+
+    st->parts++;
+    if (proto_send_frame(st->sock, iov, 3) != 0) {
+        st->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Flush part đang gom (nếu có) như 1 OK-PART.
+static int stream_flush(ProtoStream* st)
+{
+    if (st->used == 0) return 0;
+    size_t len = st->used;
+    st->used = 0;
+    return stream_send_part(st, st->buf, len);
+}
+
+int proto_stream_emit(void* ud, const char* item)
+{
+    ProtoStream* st = (ProtoStream*)ud;
+    if (st->failed) return 0;
+
+    size_t len = strlen(item);
+
+    // Item quá cỡ frame: flush part dở rồi gửi item 1 mình trong part riêng
+    // (client ghép theo part nên item không bao giờ bị cắt đôi).
+    if (len > sizeof(st->buf)) {
+        if (stream_flush(st) != 0) return 0;
+        return stream_send_part(st, item, len) == 0 ? 1 : 0;
+    }
+
+    // Không còn chỗ cho ",item" => flush part hiện tại trước.
+    if (st->used + len + 1 > sizeof(st->buf)) {
+        if (stream_flush(st) != 0) return 0;
+    }
+
+    if (st->used > 0) st->buf[st->used++] = ',';
+    memcpy(st->buf + st->used, item, len);
+    st->used += len;
+    return 1;
+}
+
+int proto_stream_end(ProtoStream* st)
+{
+    if (stream_flush(st) != 0) return -1;
+
+    char line[128];
+    snprintf(line, sizeof(line), "OK-END %s parts=%d\r\n", st->req_id, st->parts);
+
+    struct iovec iov[1];
+    iov[0].iov_base = line;
+    iov[0].iov_len = strlen(line);
+    return proto_send_frame(st->sock, iov, 1);
+}
+
+int proto_joinbuf_emit(void* ud, const char* item)
+{
+    ProtoJoinBuf* jb = (ProtoJoinBuf*)ud;
+    size_t len = strlen(item);
+
+    if (jb->used + len + 2 >= jb->cap) return 0; // đầy: truncate như cũ
+
+    if (jb->used > 0) jb->out[jb->used++] = ',';
+    memcpy(jb->out + jb->used, item, len);
+    jb->used += len;
+    jb->out[jb->used] = '\0';
+    return 1;
+}
+
+/*
+ * proto_send_raw
+ * - Gửi 1 frame đã format sẵn (chủ yếu là PUSH ...\r\n tới socket khác).
+ * - Nếu socket đích đang trong batch của thread sở hữu nó thì frame được
+ *   append vào buffer (giữ nguyên thứ tự, không xé frame); không thì gửi ngay.
+ */
+int proto_send_raw(int sock, const char* data, size_t len)
+{
+    struct iovec iov[1];
+    iov[0].iov_base = (void*)data;
+    iov[0].iov_len = len;
+    return proto_send_frame(sock, iov, 1);
 }
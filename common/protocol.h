@@ -20,16 +20,135 @@ typedef struct {
     char verb[32];
     // REQ_ID: client tự sinh để match response (không có dấu cách)
     char req_id[32];
-    // Phần còn lại của line sau REQ_ID (nullable), cấp phát heap
-    char* payload; // heap (nullable)
+    // Phần còn lại của line sau REQ_ID (nullable), heap hoặc arena
+    char* payload; // nullable
+    // 1 = payload nằm trong arena (proto_free không được free)
+    int payload_in_arena;
 } ProtoMsg;
 
+// ============ Per-connection parse arena ============
+// Bump allocator reset sau mỗi request: payload của ProtoMsg (và scratch
+// buffer lớn của handler) cấp phát từ đây thay vì malloc/free mỗi message.
+// Vượt quá block cố định thì fallback malloc, reset sẽ giải phóng.
+
+typedef struct {
+    char* data;      // block chính (bump)
+    size_t used;
+    size_t cap;
+    void* overflow;  // chain các allocation quá cỡ (hiếm)
+} ProtoArena;
+
+// Khởi tạo/giải phóng arena. initial_cap = 0 => mặc định 8KB.
+int proto_arena_init(ProtoArena* arena, size_t initial_cap);
+void proto_arena_destroy(ProtoArena* arena);
+
+// Cấp phát n byte từ arena (align 8). NULL nếu hết bộ nhớ hoặc arena NULL.
+void* proto_arena_alloc(ProtoArena* arena, size_t n);
+
+// Reset về rỗng (gọi sau mỗi handle_request). Không trả block chính về heap.
+void proto_arena_reset(ProtoArena* arena);
+
 // Parse 1 line đã được framing (không gồm \r\n).
+// Bản _arena cấp phát payload từ arena (arena NULL => malloc như cũ).
 int proto_parse_line(const char* line, ProtoMsg* out);
+int proto_parse_line_arena(const char* line, ProtoMsg* out, ProtoArena* arena);
 void proto_free(ProtoMsg* msg);
 
 // Helper gửi response theo format OK/ERR.
 int proto_send_ok(int sock, const char* req_id, const char* payload);
 int proto_send_err(int sock, const char* req_id, int code, const char* message);
 
+// Gửi 1 frame đã format sẵn (PUSH ...\r\n) tới socket bất kỳ.
+// Đi qua output buffer của socket đó nếu đang trong batch (tránh interleave).
+int proto_send_raw(int sock, const char* data, size_t len);
+
+// ============ Bounded non-blocking push delivery ============
+// PUSH tới socket của user KHÁC không còn send blocking từ thread của người
+// gửi: frame được enqueue vào hàng đợi gửi per-socket rồi drain non-blocking
+// (MSG_DONTWAIT) ngay tại chỗ; phần socket chưa nhận kịp do writer thread nền
+// gửi nốt khi POLLOUT. Nhờ đó 1 recipient có TCP window đầy (link chậm)
+// không chặn request thread của sender, và broadcast nhóm không bị trễ dây
+// chuyền theo recipient chậm nhất. Quá PROTO_PUSH_QUEUE_MAX byte đang đợi
+// thì DROP push mới (đếm qua proto_pushes_dropped) — push real-time mất
+// được, stall thì không; client vào lại chat mode sẽ thấy tin qua history.
+
+#define PROTO_PUSH_QUEUE_MAX (64 * 1024)
+
+// Enqueue 1 frame push đã format sẵn (PUSH ...\r\n). Không bao giờ block.
+// Return 0 nếu đã enqueue/gửi (kể cả khi bị drop do hàng đợi đầy), -1 nếu
+// lỗi cấp phát.
+int proto_send_push(int sock, const char* data, size_t len);
+
+// Tổng số frame push bị drop do hàng đợi của recipient đầy (cho STATS).
+long long proto_pushes_dropped(void);
+
+// Dọn trạng thái outbound của socket TRƯỚC khi close(fd): chờ writer nhả
+// socket rồi vứt dữ liệu còn đợi (fd sắp được OS tái sử dụng cho client khác).
+void proto_out_close(int sock);
+
+// ============ Per-connection output buffering ============
+// Server bật buffer cho socket quanh 1 "batch" (tất cả line pop được từ 1 lần
+// recv): proto_send_* sẽ append vào buffer thay vì send ngay, và toàn bộ
+// response của batch được flush bằng 1 lần send duy nhất.
+// Client không gọi các hàm này => proto_send_* giữ nguyên hành vi gửi ngay.
+
+// Bật buffering cho socket (đầu batch). Return 0 nếu OK, -1 nếu lỗi cấp phát.
+int proto_out_begin(int sock);
+
+// Flush buffer + tắt buffering (cuối batch, trước khi block chờ recv tiếp).
+// Return 0 nếu OK, -1 nếu send lỗi.
+int proto_out_end(int sock);
+
+// Tổng byte outbound của process qua proto_send_* (counter cho STATS).
+long long proto_bytes_sent(void);
+
+// Bật/tắt binary framing outbound cho socket (sau khi negotiate UPGRADE):
+// mỗi frame được chèn 4 byte big-endian độ dài lên đầu, nội dung giữ nguyên.
+// Phải gọi với enabled=0 khi socket mới accept (fd được OS tái sử dụng).
+int proto_set_binary(int sock, int enabled);
+
+// ============ Streaming response (OK-PART / OK-END) ============
+// Response lớn được gửi thành chuỗi frame bounded thay vì build toàn bộ vào
+// 1 buffer cố định:
+//   OK-PART <REQ_ID> <items...>\r\n   (lặp lại, mỗi frame <= ~1KB payload)
+//   OK-END  <REQ_ID> parts=<n>\r\n
+// Client ghép payload các part theo thứ tự, join bằng ','. Mỗi item luôn
+// nằm trọn trong 1 part (không bao giờ bị cắt đôi). Handler opt-in qua
+// tham số stream=1 của request; không có stream=1 thì vẫn là 1 frame OK.
+
+// Sink nhận từng item đã format từ producer (friends_list, pm_get_history...).
+// Return 1 để tiếp tục, 0 để producer dừng sớm.
+typedef int (*ProtoItemFn)(void* ud, const char* item);
+
+#define PROTO_STREAM_CHUNK 1024
+
+typedef struct {
+    int sock;
+    char req_id[32];
+    char buf[PROTO_STREAM_CHUNK]; // payload của part đang gom
+    size_t used;
+    int parts;  // số OK-PART đã gửi
+    int failed; // send lỗi => bỏ qua item còn lại
+} ProtoStream;
+
+// Khởi tạo stream cho (sock, req_id). Chưa gửi gì.
+void proto_stream_begin(ProtoStream* st, int sock, const char* req_id);
+
+// ProtoItemFn adapter: append item vào part hiện tại, tự flush OK-PART
+// khi frame đầy (item quá cỡ frame được gửi 1 mình trong part riêng).
+int proto_stream_emit(void* ud, const char* item);
+
+// Flush part dở + gửi OK-END parts=<n>. Return 0 nếu OK, -1 nếu send lỗi.
+int proto_stream_end(ProtoStream* st);
+
+// ProtoItemFn append vào buffer cố định, join bằng ',' (path không
+// streaming). Return 0 khi buffer đầy — giữ semantics truncate cũ.
+typedef struct {
+    char* out;
+    size_t cap;
+    size_t used;
+} ProtoJoinBuf;
+
+int proto_joinbuf_emit(void* ud, const char* item);
+
 #endif
@@ -1,4 +1,5 @@
-﻿#include "accounts.h"
+#include "accounts.h"
+#include "journal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,13 +14,38 @@
  * server/accounts.c
  * - DB dạng text file (data/users.db) để đơn giản hoá việc deploy/chạy thử.
  * - Không lưu plaintext password: lưu (salt, hash) và verify khi LOGIN.
- * - Dùng mutex để tránh race khi nhiều thread đọc/ghi file cùng lúc.
- *
+ * - Toàn bộ account được load vào RAM tại accounts_init() với 2 hash index
+ *   (username -> record, user_id -> record) để lookup O(1) không I/O.
+ * - accounts_register() ghi qua journal group-commit (server/journal.*)
+ *   thay vì append users.db từng op: cập nhật index + 1 record "ACC|..."
+ *   vào journal, nhiều register đồng thời chia sẻ 1 lần fsync. users.db
+ *   được rewrite lại từ memory khi journal checkpoint (accounts_compact).
+ * - Dùng mutex để tránh race khi nhiều thread đọc/ghi cùng lúc.
  */
 
+typedef struct {
+    int id;
+    char username[ACC_USERNAME_MAX + 1];
+    char salt[64];
+    char hash[32];
+    char email[ACC_EMAIL_MAX + 1];
+    int active;
+} AccountRec;
+
 static pthread_mutex_t g_accounts_mutex = PTHREAD_MUTEX_INITIALIZER;
 static char g_db_path[512] = {0};
 
+// In-memory store: mảng record + 2 bảng index open-addressing (chứa idx+1,
+// 0 = slot trống). Bảng luôn giữ load factor <= 50% để probe ngắn.
+static AccountRec* g_records = NULL;
+static int g_record_count = 0;
+static int g_record_cap = 0;
+static int g_max_id = 0;
+
+static int* g_idx_by_name = NULL; // probe theo hash(username)
+static int* g_idx_by_id = NULL;   // probe theo hash(user_id)
+static size_t g_idx_cap = 0;      // power of two
+
 static int ensure_data_dir(const char* path)
 {
     // nếu path bắt đầu bằng "data/" thì đảm bảo thư mục "data" tồn tại.
@@ -108,32 +134,149 @@ static void compute_password_hash(const char* salt, const char* password, char o
     hex64(fnv1a64(buf), out_hash);
 }
 
-static int read_next_id_unlocked(FILE* f, int* out_next_id)
+// ============ In-memory index (gọi khi đang giữ mutex) ============
+
+static unsigned long long hash_id(int user_id)
 {
-    int max_id = 0;
-    char line[512];
-    rewind(f);
+    // Knuth multiplicative hash cho int key.
+    return (unsigned long long)((unsigned int)user_id * 2654435761u);
+}
+
+/*
+ * index_insert_unlocked
+ * - Chèn record idx vào cả 2 bảng index (không kiểm tra trùng;
+ *   caller đã đảm bảo username/id chưa tồn tại).
+ */
+static void index_insert_unlocked(int idx)
+{
+    size_t mask = g_idx_cap - 1;
+
+    size_t slot = (size_t)fnv1a64(g_records[idx].username) & mask;
+    while (g_idx_by_name[slot]) slot = (slot + 1) & mask;
+    g_idx_by_name[slot] = idx + 1;
+
+    slot = (size_t)hash_id(g_records[idx].id) & mask;
+    while (g_idx_by_id[slot]) slot = (slot + 1) & mask;
+    g_idx_by_id[slot] = idx + 1;
+}
+
+/*
+ * index_grow_unlocked
+ * - Đảm bảo bảng index đủ chỗ cho record_count phần tử (load factor <= 50%);
+ *   rehash toàn bộ khi cần mở rộng.
+ * Return: 0 nếu OK, -1 nếu hết bộ nhớ.
+ */
+static int index_grow_unlocked(int record_count)
+{
+    if (g_idx_cap && (size_t)record_count * 2 <= g_idx_cap) return 0;
+
+    size_t new_cap = g_idx_cap ? g_idx_cap * 2 : 256;
+    while ((size_t)record_count * 2 > new_cap) new_cap *= 2;
+
+    int* by_name = (int*)calloc(new_cap, sizeof(int));
+    int* by_id = (int*)calloc(new_cap, sizeof(int));
+    if (!by_name || !by_id) {
+        free(by_name);
+        free(by_id);
+        return -1;
+    }
+
+    free(g_idx_by_name);
+    free(g_idx_by_id);
+    g_idx_by_name = by_name;
+    g_idx_by_id = by_id;
+    g_idx_cap = new_cap;
 
+    for (int i = 0; i < g_record_count; i++) {
+        index_insert_unlocked(i);
+    }
+    return 0;
+}
+
+// Tìm record theo username. Return con trỏ record hoặc NULL.
+static AccountRec* find_by_name_unlocked(const char* username)
+{
+    if (!g_idx_cap) return NULL;
+    size_t mask = g_idx_cap - 1;
+    size_t slot = (size_t)fnv1a64(username) & mask;
+    while (g_idx_by_name[slot]) {
+        AccountRec* r = &g_records[g_idx_by_name[slot] - 1];
+        if (strcmp(r->username, username) == 0) return r;
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+// Tìm record theo user_id. Return con trỏ record hoặc NULL.
+static AccountRec* find_by_id_unlocked(int user_id)
+{
+    if (!g_idx_cap) return NULL;
+    size_t mask = g_idx_cap - 1;
+    size_t slot = (size_t)hash_id(user_id) & mask;
+    while (g_idx_by_id[slot]) {
+        AccountRec* r = &g_records[g_idx_by_id[slot] - 1];
+        if (r->id == user_id) return r;
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+/*
+ * record_append_unlocked
+ * - Thêm 1 record vào mảng + index; theo dõi max_id để cấp id mới.
+ * Return: 0 nếu OK, -1 nếu hết bộ nhớ.
+ */
+static int record_append_unlocked(const AccountRec* rec)
+{
+    if (g_record_count >= g_record_cap) {
+        int new_cap = g_record_cap ? g_record_cap * 2 : 128;
+        AccountRec* next = (AccountRec*)realloc(g_records, (size_t)new_cap * sizeof(AccountRec));
+        if (!next) return -1;
+        g_records = next;
+        g_record_cap = new_cap;
+    }
+
+    if (index_grow_unlocked(g_record_count + 1) != 0) return -1;
+
+    g_records[g_record_count] = *rec;
+    index_insert_unlocked(g_record_count);
+    g_record_count++;
+
+    if (rec->id > g_max_id) g_max_id = rec->id;
+    return 0;
+}
+
+/*
+ * load_db_unlocked
+ * - Parse toàn bộ file DB vào memory (chạy 1 lần tại accounts_init).
+ */
+static int load_db_unlocked(void)
+{
+    FILE* f = fopen(g_db_path, "r");
+    if (!f) return ACC_ERR_IO;
+
+    char line[512];
     while (fgets(line, sizeof(line), f)) {
-        int id = 0;
-        char username[ACC_USERNAME_MAX + 8];
-        char salt[64];
-        char hash[32];
-        char email[ACC_EMAIL_MAX + 8];
-        int active = 0;
-
-        if (sscanf(line, "%d|%31[^|]|%63[^|]|%31[^|]|%95[^|]|%d", &id, username, salt, hash, email, &active) == 6) {
-            if (id > max_id) max_id = id;
+        AccountRec rec;
+        memset(&rec, 0, sizeof(rec));
+
+        if (sscanf(line, "%d|%32[^|]|%63[^|]|%31[^|]|%96[^|]|%d",
+                   &rec.id, rec.username, rec.salt, rec.hash, rec.email, &rec.active) == 6) {
+            if (record_append_unlocked(&rec) != 0) {
+                fclose(f);
+                return ACC_ERR_IO;
+            }
         }
     }
 
-    *out_next_id = max_id + 1;
-    return 0;
+    fclose(f);
+    return ACC_OK;
 }
 
 int accounts_init(const char* db_path)
 {
-    // Khởi tạo đường dẫn DB và tạo file nếu chưa tồn tại (thread-safe).
+    // Khởi tạo đường dẫn DB, tạo file nếu chưa tồn tại và load toàn bộ
+    // account vào in-memory index (thread-safe).
     if (!db_path || !db_path[0]) return ACC_ERR_INVALID;
 
     pthread_mutex_lock(&g_accounts_mutex);
@@ -149,42 +292,31 @@ int accounts_init(const char* db_path)
     }
     fclose(f);
 
+    // Reset store (phòng init lại) rồi load từ file.
+    free(g_records);
+    free(g_idx_by_name);
+    free(g_idx_by_id);
+    g_records = NULL;
+    g_idx_by_name = NULL;
+    g_idx_by_id = NULL;
+    g_record_count = 0;
+    g_record_cap = 0;
+    g_idx_cap = 0;
+    g_max_id = 0;
+
+    int rc = load_db_unlocked();
+
     pthread_mutex_unlock(&g_accounts_mutex);
-    return ACC_OK;
+    return rc;
 }
 
 int accounts_username_exists(const char* username)
 {
-    // Helper: scan file DB để kiểm tra trùng username.
+    // Lookup index in-memory, không còn scan file.
     if (!username || !username[0]) return 0;
 
     pthread_mutex_lock(&g_accounts_mutex);
-
-    FILE* f = fopen(g_db_path, "r");
-    if (!f) {
-        pthread_mutex_unlock(&g_accounts_mutex);
-        return 0;
-    }
-
-    char line[512];
-    int exists = 0;
-    while (fgets(line, sizeof(line), f)) {
-        int id = 0;
-        char file_user[ACC_USERNAME_MAX + 8];
-        char salt[64];
-        char hash[32];
-        char email[ACC_EMAIL_MAX + 8];
-        int active = 0;
-
-        if (sscanf(line, "%d|%31[^|]|%63[^|]|%31[^|]|%95[^|]|%d", &id, file_user, salt, hash, email, &active) == 6) {
-            if (strcmp(file_user, username) == 0) {
-                exists = 1;
-                break;
-            }
-        }
-    }
-
-    fclose(f);
+    int exists = find_by_name_unlocked(username) != NULL;
     pthread_mutex_unlock(&g_accounts_mutex);
     return exists;
 }
@@ -198,9 +330,11 @@ int accounts_register(const char* username,
      * Flow:
      * - Validate input
      * - Lock mutex
-     * - Check duplicate username
+     * - Check duplicate username (index lookup)
      * - Compute (salt, hash)
-     * - Append 1 dòng vào DB và trả về user_id mới
+     * - Thêm vào index in-memory, rồi append record vào journal (ngoài
+     *   mutex): nhiều register đồng thời được group-commit chung 1 fsync;
+     *   users.db chỉ được ghi lại khi journal checkpoint.
      */
     if (!out_user_id) return ACC_ERR_INVALID;
     *out_user_id = 0;
@@ -212,50 +346,107 @@ int accounts_register(const char* username,
 
     pthread_mutex_lock(&g_accounts_mutex);
 
-    FILE* f = fopen(g_db_path, "r+");
-    if (!f) {
+    if (find_by_name_unlocked(username)) {
+        pthread_mutex_unlock(&g_accounts_mutex);
+        return ACC_ERR_EXISTS;
+    }
+
+    AccountRec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.id = g_max_id + 1;
+    snprintf(rec.username, sizeof(rec.username), "%s", username);
+    snprintf(rec.email, sizeof(rec.email), "%s", email);
+    rec.active = 1;
+    random_hex(rec.salt, 33);
+    compute_password_hash(rec.salt, password, rec.hash);
+
+    if (record_append_unlocked(&rec) != 0) {
         pthread_mutex_unlock(&g_accounts_mutex);
         return ACC_ERR_IO;
     }
 
-    // Check duplicate
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        int id = 0;
-        char file_user[ACC_USERNAME_MAX + 8];
-        char salt[64];
-        char hash[32];
-        char file_email[ACC_EMAIL_MAX + 8];
-        int active = 0;
-
-        if (sscanf(line, "%d|%31[^|]|%63[^|]|%31[^|]|%95[^|]|%d", &id, file_user, salt, hash, file_email, &active) == 6) {
-            if (strcmp(file_user, username) == 0) {
-                fclose(f);
-                pthread_mutex_unlock(&g_accounts_mutex);
-                return ACC_ERR_EXISTS;
-            }
-        }
+    pthread_mutex_unlock(&g_accounts_mutex);
+
+    char jrec[512];
+    snprintf(jrec, sizeof(jrec), "ACC|%d|%s|%s|%s|%s|%d",
+             rec.id, rec.username, rec.salt, rec.hash, rec.email, rec.active);
+    if (journal_append(jrec) != JRN_OK) {
+        return ACC_ERR_IO;
     }
 
-    int next_id = 1;
-    read_next_id_unlocked(f, &next_id);
+    *out_user_id = rec.id;
+    return ACC_OK;
+}
 
-    char salt[33];
-    char hash[17];
-    random_hex(salt, sizeof(salt));
-    compute_password_hash(salt, password, hash);
+int accounts_compact(void)
+{
+    /*
+     * Rewrite users.db từ state in-memory (tmp + rename để atomic).
+     * Được gọi làm compact callback của journal khi checkpoint.
+     */
+    pthread_mutex_lock(&g_accounts_mutex);
 
-    fseek(f, 0, SEEK_END);
-    fprintf(f, "%d|%s|%s|%s|%s|%d\n", next_id, username, salt, hash, email, 1);
-    fflush(f);
+    if (!g_db_path[0]) {
+        pthread_mutex_unlock(&g_accounts_mutex);
+        return ACC_ERR_INVALID;
+    }
+
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_db_path);
+
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) {
+        pthread_mutex_unlock(&g_accounts_mutex);
+        return ACC_ERR_IO;
+    }
+
+    for (int i = 0; i < g_record_count; i++) {
+        AccountRec* r = &g_records[i];
+        fprintf(f, "%d|%s|%s|%s|%s|%d\n",
+                r->id, r->username, r->salt, r->hash, r->email, r->active);
+    }
 
     fclose(f);
-    pthread_mutex_unlock(&g_accounts_mutex);
 
-    *out_user_id = next_id;
+    if (rename(tmp_path, g_db_path) != 0) {
+        remove(tmp_path);
+        pthread_mutex_unlock(&g_accounts_mutex);
+        return ACC_ERR_IO;
+    }
+
+    pthread_mutex_unlock(&g_accounts_mutex);
     return ACC_OK;
 }
 
+int accounts_replay_journal(const char* rec)
+{
+    /*
+     * Replay 1 record "ACC|id|username|salt|hash|email|active" từ journal
+     * lúc startup. Idempotent: record đã có trong users.db (đã compact
+     * trước khi crash) bị bỏ qua theo username.
+     */
+    if (!rec || strncmp(rec, "ACC|", 4) != 0) return ACC_ERR_INVALID;
+
+    AccountRec r;
+    memset(&r, 0, sizeof(r));
+    if (sscanf(rec + 4, "%d|%32[^|]|%63[^|]|%31[^|]|%96[^|]|%d",
+               &r.id, r.username, r.salt, r.hash, r.email, &r.active) != 6) {
+        return ACC_ERR_INVALID;
+    }
+
+    pthread_mutex_lock(&g_accounts_mutex);
+
+    if (find_by_name_unlocked(r.username)) {
+        pthread_mutex_unlock(&g_accounts_mutex);
+        return ACC_OK; // đã compact từ trước
+    }
+
+    int rc = record_append_unlocked(&r) == 0 ? ACC_OK : ACC_ERR_IO;
+
+    pthread_mutex_unlock(&g_accounts_mutex);
+    return rc;
+}
+
 int accounts_authenticate(const char* username,
                           const char* password,
                           int* out_user_id)
@@ -264,7 +455,7 @@ int accounts_authenticate(const char* username,
      * Flow:
      * - Validate
      * - Lock mutex
-     * - Tìm record theo username
+     * - Tìm record theo username (index lookup)
      * - Verify hash(password, salt) == stored_hash
      * - Trả user_id nếu hợp lệ
      */
@@ -276,59 +467,25 @@ int accounts_authenticate(const char* username,
 
     pthread_mutex_lock(&g_accounts_mutex);
 
-    FILE* f = fopen(g_db_path, "r");
-    if (!f) {
-        pthread_mutex_unlock(&g_accounts_mutex);
-        return ACC_ERR_IO;
-    }
-
-    char line[512];
-    int found = 0;
-    int active = 0;
-    int user_id = 0;
-    char salt[64] = {0};
-    char stored_hash[32] = {0};
-
-    while (fgets(line, sizeof(line), f)) {
-        int id = 0;
-        char file_user[ACC_USERNAME_MAX + 8];
-        char file_salt[64];
-        char file_hash[32];
-        char file_email[ACC_EMAIL_MAX + 8];
-        int file_active = 0;
-
-        if (sscanf(line, "%d|%31[^|]|%63[^|]|%31[^|]|%95[^|]|%d", &id, file_user, file_salt, file_hash, file_email, &file_active) == 6) {
-            if (strcmp(file_user, username) == 0) {
-                found = 1;
-                active = file_active;
-                user_id = id;
-                snprintf(salt, sizeof(salt), "%s", file_salt);
-                snprintf(stored_hash, sizeof(stored_hash), "%s", file_hash);
-                break;
-            }
-        }
-    }
-
-    fclose(f);
-
-    if (!found) {
+    AccountRec* r = find_by_name_unlocked(username);
+    if (!r) {
         pthread_mutex_unlock(&g_accounts_mutex);
         return ACC_ERR_NOT_FOUND;
     }
 
-    if (!active) {
+    if (!r->active) {
         pthread_mutex_unlock(&g_accounts_mutex);
         return ACC_ERR_INACTIVE;
     }
 
     char computed[17];
-    compute_password_hash(salt, password, computed);
-    if (strcmp(computed, stored_hash) != 0) {
+    compute_password_hash(r->salt, password, computed);
+    if (strcmp(computed, r->hash) != 0) {
         pthread_mutex_unlock(&g_accounts_mutex);
         return ACC_ERR_BAD_PASSWORD;
     }
 
-    *out_user_id = user_id;
+    *out_user_id = r->id;
     pthread_mutex_unlock(&g_accounts_mutex);
     return ACC_OK;
 }
@@ -338,34 +495,8 @@ int accounts_get_user_id(const char* username)
     if (!username || !username[0]) return -1;
 
     pthread_mutex_lock(&g_accounts_mutex);
-
-    FILE* f = fopen(g_db_path, "r");
-    if (!f) {
-        pthread_mutex_unlock(&g_accounts_mutex);
-        return -1;
-    }
-
-    char line[512];
-    int result = -1;
-
-    while (fgets(line, sizeof(line), f)) {
-        int id = 0;
-        char file_user[ACC_USERNAME_MAX + 8];
-        char salt[64];
-        char hash[32];
-        char email[ACC_EMAIL_MAX + 8];
-        int active = 0;
-
-        if (sscanf(line, "%d|%31[^|]|%63[^|]|%31[^|]|%95[^|]|%d", 
-                   &id, file_user, salt, hash, email, &active) == 6) {
-            if (strcmp(file_user, username) == 0) {
-                result = id;
-                break;
-            }
-        }
-    }
-
-    fclose(f);
+    AccountRec* r = find_by_name_unlocked(username);
+    int result = r ? r->id : -1;
     pthread_mutex_unlock(&g_accounts_mutex);
     return result;
 }
@@ -376,35 +507,12 @@ int accounts_get_username(int user_id, char* out, size_t out_cap)
     out[0] = '\0';
 
     pthread_mutex_lock(&g_accounts_mutex);
-
-    FILE* f = fopen(g_db_path, "r");
-    if (!f) {
-        pthread_mutex_unlock(&g_accounts_mutex);
-        return 0;
-    }
-
-    char line[512];
+    AccountRec* r = find_by_id_unlocked(user_id);
     int found = 0;
-
-    while (fgets(line, sizeof(line), f)) {
-        int id = 0;
-        char file_user[ACC_USERNAME_MAX + 8];
-        char salt[64];
-        char hash[32];
-        char email[ACC_EMAIL_MAX + 8];
-        int active = 0;
-
-        if (sscanf(line, "%d|%31[^|]|%63[^|]|%31[^|]|%95[^|]|%d", 
-                   &id, file_user, salt, hash, email, &active) == 6) {
-            if (id == user_id) {
-                snprintf(out, out_cap, "%s", file_user);
-                found = 1;
-                break;
-            }
-        }
+    if (r) {
+        snprintf(out, out_cap, "%s", r->username);
+        found = 1;
     }
-
-    fclose(f);
     pthread_mutex_unlock(&g_accounts_mutex);
     return found;
-}
\ No newline at end of file
+}
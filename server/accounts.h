@@ -46,4 +46,10 @@ int accounts_get_user_id(const char* username);
 // Get username by user_id. Returns 1 if found, 0 if not.
 int accounts_get_username(int user_id, char* out, size_t out_cap);
 
+// Rewrite users.db từ state in-memory (compact callback của journal).
+int accounts_compact(void);
+
+// Replay 1 record "ACC|..." từ journal lúc startup (idempotent).
+int accounts_replay_journal(const char* rec);
+
 #endif
@@ -0,0 +1,192 @@
+#include "event_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../common/framing.h"
+#include "../common/protocol.h"
+#include "handlers.h"
+#include "sessions.h"
+
+/*
+ * server/event_loop.c
+ * - Event-loop mode: main thread accept, rồi phân connection round-robin
+ *   cho N worker. Mỗi worker có epoll fd riêng và sở hữu toàn bộ socket
+ *   đã được gán cho nó (thêm/xóa epoll, đọc, đóng).
+ * - Socket giữ blocking mode: epoll (level-triggered) chỉ báo readable,
+ *   mỗi event worker recv() đúng 1 lần rồi feed vào LineFramer và pop
+ *   từng line cho handle_request() — giống pipeline của client_thread.
+ * - Guard dòng quá dài (~64KB) giống framer_recv_line: vượt quá thì đóng
+ *   connection.
+ */
+
+#define EVLOOP_MAX_EVENTS 64
+#define EVLOOP_RECV_CHUNK (16 * 1024)
+#define EVLOOP_MAX_LINE (64 * 1024)
+
+typedef struct {
+    int sock;
+    LineFramer fr;
+    ProtoArena arena;
+    ServerCtx ctx;
+} Conn;
+
+typedef struct {
+    int epoll_fd;
+    pthread_t tid;
+} Worker;
+
+static void conn_close(Worker* w, Conn* conn)
+{
+    // Dọn dẹp 1 connection: bỏ khỏi epoll, hủy session theo socket, đóng fd.
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+    sessions_remove_by_socket(conn->sock);
+    proto_arena_destroy(&conn->arena);
+    framer_free(&conn->fr);
+    proto_out_close(conn->sock); // dọn hàng đợi push trước khi fd tái sử dụng
+    close(conn->sock);
+    free(conn);
+}
+
+/*
+ * conn_handle_readable
+ * - Xử lý 1 EPOLLIN event: recv 1 lần, feed framer, dispatch tất cả line
+ *   đã hoàn chỉnh trong buffer.
+ * Return: 0 nếu connection còn sống, -1 nếu cần đóng.
+ */
+static int conn_handle_readable(Conn* conn)
+{
+    char tmp[EVLOOP_RECV_CHUNK];
+    int r = (int)recv(conn->sock, tmp, (int)sizeof(tmp), 0);
+    if (r <= 0) return -1; // peer đóng hoặc lỗi recv
+
+    if (framer_feed(&conn->fr, tmp, (size_t)r) != 0) return -1;
+
+    // Batch: mọi response của các line trong lần recv này được gom vào
+    // output buffer và flush 1 lần ở cuối.
+    int rc = 0;
+    proto_out_begin(conn->sock);
+
+    char line[4096];
+    for (;;) {
+        int popped = framer_pop_line(&conn->fr, line, sizeof(line));
+        if (popped == 0) break;
+        if (popped < 0) { // line quá dài so với out buffer
+            rc = -1;
+            break;
+        }
+        if (handle_request(&conn->ctx, line) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    // Guard: client gửi dòng không có delimiter vượt ~64KB.
+    if (rc == 0 && framer_pending(&conn->fr) > EVLOOP_MAX_LINE) rc = -1;
+
+    if (proto_out_end(conn->sock) != 0) rc = -1;
+    return rc;
+}
+
+static void* worker_thread(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(w->epoll_fd, events, EVLOOP_MAX_EVENTS, -1);
+        if (n < 0) continue; // EINTR
+
+        for (int i = 0; i < n; i++) {
+            Conn* conn = (Conn*)events[i].data.ptr;
+
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                conn_close(w, conn);
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN) {
+                if (conn_handle_readable(conn) < 0) {
+                    conn_close(w, conn);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int event_loop_run(int listen_sock, int num_workers)
+{
+    if (num_workers <= 0) num_workers = EVLOOP_DEFAULT_WORKERS;
+
+    Worker* workers = (Worker*)calloc((size_t)num_workers, sizeof(Worker));
+    if (!workers) return -1;
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].epoll_fd = epoll_create1(0);
+        if (workers[i].epoll_fd < 0) {
+            free(workers);
+            return -1;
+        }
+        pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+
+    // Accept loop: gán connection mới cho worker theo round-robin.
+    // epoll_ctl(ADD) từ accept thread vào epoll fd của worker là thread-safe.
+    int next_worker = 0;
+    for (;;) {
+        struct sockaddr_in caddr;
+        socklen_t clen = sizeof(caddr);
+        int c = accept(listen_sock, (struct sockaddr*)&caddr, &clen);
+        if (c < 0) continue;
+
+        Conn* conn = (Conn*)calloc(1, sizeof(Conn));
+        if (!conn) {
+            close(c);
+            continue;
+        }
+
+        conn->sock = c;
+        conn->ctx.client_sock = c;
+        if (framer_init(&conn->fr, 2048) != 0) {
+            close(c);
+            free(conn);
+            continue;
+        }
+        if (proto_arena_init(&conn->arena, 0) != 0) {
+            framer_free(&conn->fr);
+            close(c);
+            free(conn);
+            continue;
+        }
+        conn->ctx.arena = &conn->arena;
+        conn->ctx.framer = &conn->fr;
+
+        // fd có thể được OS tái sử dụng: reset framing mode của connection.
+        proto_set_binary(c, 0);
+
+        Worker* w = &workers[next_worker];
+        next_worker = (next_worker + 1) % num_workers;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c, &ev) != 0) {
+            proto_arena_destroy(&conn->arena);
+            framer_free(&conn->fr);
+            close(c);
+            free(conn);
+            continue;
+        }
+    }
+
+    return 0;
+}
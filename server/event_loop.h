@@ -0,0 +1,20 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/*
+ * server/event_loop.*
+ * - Chế độ server thứ 2 dựa trên epoll + worker pool cố định.
+ * - Thay vì 1 thread/connection (server.c), mỗi worker sở hữu 1 epoll set
+ *   và xử lý nhiều socket cùng lúc qua LineFramer/handle_request có sẵn.
+ * - Phù hợp khi số connection lớn (hàng chục nghìn idle client) vì không
+ *   tốn stack/thread cho từng socket.
+ */
+
+// Số worker mặc định nếu không chỉ định.
+#define EVLOOP_DEFAULT_WORKERS 4
+
+// Chạy accept loop + worker pool trên listen_sock.
+// Chỉ return khi có lỗi không phục hồi được (return -1).
+int event_loop_run(int listen_sock, int num_workers);
+
+#endif
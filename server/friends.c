@@ -1,171 +1,240 @@
 #include "friends.h"
+#include "accounts.h"
+#include "journal.h"
 #include "sessions.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
 
-#define USERS_DB_PATH "data/users.db"
 #define FRIENDS_DB_PATH "data/friends.db"
 
 #define LINE_MAX 512
 
 static pthread_mutex_t friends_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Lookup user qua index in-memory của accounts.c thay vì scan users.db
+// từng dòng cho mỗi request (users.db giờ chỉ được ghi lúc compact nên
+// không còn là nguồn fresh nhất).
+
 static int get_username_by_id(int user_id, char *out, size_t cap)
 {
-    FILE *f = fopen(USERS_DB_PATH, "r");
-    if (!f)
-        return 0;
+    return accounts_get_username(user_id, out, cap);
+}
 
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
-    {
-        int id, active;
-        char username[64], salt[64], hash[64], email[128];
+static int username_exists(const char *username)
+{
+    return accounts_username_exists(username);
+}
 
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%63[^|]|%127[^|]|%d",
-                   &id, username, salt, hash, email, &active) == 6)
-        {
-            if (id == user_id)
-            {
-                snprintf(out, cap, "%s", username);
-                fclose(f);
-                return 1;
-            }
-        }
+static int get_user_id_by_username(const char *username)
+{
+    return accounts_get_user_id(username);
+}
+
+// ============ Adjacency index in-memory ============
+//
+// friends.db vẫn là nguồn persistent (write-through + journal) nhưng mọi
+// đường đọc (list/pending/dup check) đi qua index này thay vì scan file.
+// Index load 1 lần ở friends_init() và được các hàm *_apply() cập nhật,
+// nên journal replay lúc startup cũng tự duy trì index.
+// Mọi thao tác index đều chạy dưới friends_mutex.
+
+typedef struct {
+    int user_id;
+    int *friends;       // user_id các friend ACCEPTED
+    int friend_count;
+    int friend_cap;
+    int *pending_from;  // user_id người đã mời user này (đang PENDING)
+    int pending_count;
+    int pending_cap;
+} FriendAdj;
+
+static FriendAdj *g_adj = NULL;
+static int g_adj_count = 0;
+static int g_adj_cap = 0;
+
+// Tìm entry của user trong index, NULL nếu chưa có.
+static FriendAdj* adj_find(int user_id)
+{
+    for (int i = 0; i < g_adj_count; i++) {
+        if (g_adj[i].user_id == user_id) return &g_adj[i];
     }
+    return NULL;
+}
 
-    fclose(f);
+// Tìm hoặc tạo entry cho user (grow mảng khi đầy).
+static FriendAdj* adj_get(int user_id)
+{
+    FriendAdj *a = adj_find(user_id);
+    if (a) return a;
+
+    if (g_adj_count >= g_adj_cap) {
+        int new_cap = g_adj_cap ? g_adj_cap * 2 : 64;
+        FriendAdj *p = realloc(g_adj, (size_t)new_cap * sizeof(FriendAdj));
+        if (!p) return NULL;
+        g_adj = p;
+        g_adj_cap = new_cap;
+    }
+
+    a = &g_adj[g_adj_count++];
+    memset(a, 0, sizeof(*a));
+    a->user_id = user_id;
+    return a;
+}
+
+static int id_list_has(const int *arr, int count, int id)
+{
+    for (int i = 0; i < count; i++) {
+        if (arr[i] == id) return 1;
+    }
     return 0;
 }
 
-static int username_exists(const char *username)
+static int id_list_add(int **arr, int *count, int *cap, int id)
 {
-    FILE *f = fopen(USERS_DB_PATH, "r");
-    if (!f)
-        return 0;
+    if (id_list_has(*arr, *count, id)) return 1;
+
+    if (*count >= *cap) {
+        int new_cap = *cap ? *cap * 2 : 8;
+        int *p = realloc(*arr, (size_t)new_cap * sizeof(int));
+        if (!p) return 0;
+        *arr = p;
+        *cap = new_cap;
+    }
 
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
-    {
-        int id, active;
-        char u[64], salt[64], hash[64], email[128];
+    (*arr)[(*count)++] = id;
+    return 1;
+}
 
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%63[^|]|%127[^|]|%d",
-                   &id, u, salt, hash, email, &active) == 6)
-        {
-            if (strcmp(u, username) == 0 && active)
-            {
-                fclose(f);
-                return 1;
-            }
+static void id_list_remove(int *arr, int *count, int id)
+{
+    for (int i = 0; i < *count; i++) {
+        if (arr[i] == id) {
+            arr[i] = arr[--(*count)]; // swap-delete, thứ tự không quan trọng
+            return;
         }
     }
+}
 
-    fclose(f);
-    return 0;
+static int idx_has_pending(int from_id, int to_id)
+{
+    FriendAdj *a = adj_find(to_id);
+    return a && id_list_has(a->pending_from, a->pending_count, from_id);
 }
 
-static int get_user_id_by_username(const char *username)
+static int idx_is_friend(int a_id, int b_id)
 {
-    FILE *f = fopen(USERS_DB_PATH, "r");
-    if (!f)
-        return -1;
+    FriendAdj *a = adj_find(a_id);
+    return a && id_list_has(a->friends, a->friend_count, b_id);
+}
 
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
-    {
-        int id, active;
-        char u[64], salt[64], hash[64], email[128];
+static void idx_add_pending(int from_id, int to_id)
+{
+    FriendAdj *a = adj_get(to_id);
+    if (a) id_list_add(&a->pending_from, &a->pending_count,
+                       &a->pending_cap, from_id);
+}
 
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%63[^|]|%127[^|]|%d",
-                   &id, u, salt, hash, email, &active) == 6)
-        {
-            if (strcmp(u, username) == 0)
-            {
-                fclose(f);
-                return id;
-            }
-        }
-    }
+static void idx_remove_pending(int from_id, int to_id)
+{
+    FriendAdj *a = adj_find(to_id);
+    if (a) id_list_remove(a->pending_from, &a->pending_count, from_id);
+}
 
-    fclose(f);
-    return -1;
+// Friendship ACCEPTED là đối xứng: lưu ở cả 2 phía để list là 1 memory walk.
+static void idx_add_friend(int a_id, int b_id)
+{
+    FriendAdj *a = adj_get(a_id);
+    if (a) id_list_add(&a->friends, &a->friend_count, &a->friend_cap, b_id);
+    FriendAdj *b = adj_get(b_id);
+    if (b) id_list_add(&b->friends, &b->friend_count, &b->friend_cap, a_id);
 }
 
-int friends_send_invite(int from_user_id, const char *to_username)
+static void idx_remove_friend(int a_id, int b_id)
 {
-    char from_username[64];
+    FriendAdj *a = adj_find(a_id);
+    if (a) id_list_remove(a->friends, &a->friend_count, b_id);
+    FriendAdj *b = adj_find(b_id);
+    if (b) id_list_remove(b->friends, &b->friend_count, a_id);
+}
 
-    if (!to_username || !to_username[0])
-    {
-        return FRIEND_ERR_INTERNAL;
-    }
+int friends_init(void)
+{
+    pthread_mutex_lock(&friends_mutex);
 
-    // Lấy username người gửi
-    if (!get_username_by_id(from_user_id, from_username, sizeof(from_username)))
+    FILE *f = fopen(FRIENDS_DB_PATH, "r");
+    if (!f)
     {
-        return FRIEND_ERR_INTERNAL;
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_OK; // chưa có file => index rỗng
     }
 
-    // Không cho mời chính mình
-    if (strcmp(from_username, to_username) == 0)
-    {
-        return FRIEND_ERR_SELF;
-    }
+    char line[LINE_MAX];
 
-    // Kiểm tra user nhận tồn tại
-    if (!username_exists(to_username))
+    while (fgets(line, sizeof(line), f))
     {
-        return FRIEND_ERR_NOT_FOUND;
-    }
+        char from[64], to[64], status[32];
+        long ts;
 
-    pthread_mutex_lock(&friends_mutex);
+        if (sscanf(line, "%63[^|]|%63[^|]|%31[^|]|%ld",
+                   from, to, status, &ts) != 4)
+            continue;
 
-    FILE *f = fopen(FRIENDS_DB_PATH, "r");
-    if (f)
-    {
-        char line[LINE_MAX];
-        while (fgets(line, sizeof(line), f))
-        {
-            char from[64], to[64], status[32];
-            long ts;
+        int from_id = get_user_id_by_username(from);
+        int to_id = get_user_id_by_username(to);
+        if (from_id <= 0 || to_id <= 0)
+            continue; // row mồ côi (user không còn trong accounts)
 
-            if (sscanf(line, "%63[^|]|%63[^|]|%31[^|]|%ld",
-                       from, to, status, &ts) == 4)
-            {
+        if (strcmp(status, "ACCEPTED") == 0)
+            idx_add_friend(from_id, to_id);
+        else if (strcmp(status, "PENDING") == 0)
+            idx_add_pending(from_id, to_id);
+    }
 
-                // from -> to
-                if (strcmp(from, from_username) == 0 &&
-                    strcmp(to, to_username) == 0 &&
-                    (strcmp(status, "PENDING") == 0 ||
-                     strcmp(status, "ACCEPTED") == 0))
-                {
+    fclose(f);
+    pthread_mutex_unlock(&friends_mutex);
+    return FRIEND_OK;
+}
 
-                    fclose(f);
-                    pthread_mutex_unlock(&friends_mutex);
-                    return FRIEND_ERR_EXISTS;
-                }
+// Journal 1 mutation friend trước khi áp vào friends.db (gọi khi đang
+// giữ friends_mutex). Group commit ở journal.c gom fsync của các op
+// đồng thời; replay lúc startup áp lại op nếu crash trước khi ghi db.
+static int journal_friend_op(const char *op, const char *a, const char *b)
+{
+    char jrec[256];
+    snprintf(jrec, sizeof(jrec), "FRN|%s|%s|%s", op, a, b);
+    return journal_append(jrec) == JRN_OK ? FRIEND_OK : FRIEND_ERR_INTERNAL;
+}
 
-                // to -> from (đã là bạn)
-                if (strcmp(from, to_username) == 0 &&
-                    strcmp(to, from_username) == 0 &&
-                    strcmp(status, "ACCEPTED") == 0)
-                {
+static int invite_apply(const char *from_username, const char *to_username,
+                        int journal_it)
+{
+    int from_id = get_user_id_by_username(from_username);
+    int to_id = get_user_id_by_username(to_username);
 
-                    fclose(f);
-                    pthread_mutex_unlock(&friends_mutex);
-                    return FRIEND_ERR_EXISTS;
-                }
-            }
-        }
-        fclose(f);
+    pthread_mutex_lock(&friends_mutex);
+
+    // Dup check qua index thay vì scan friends.db: đã mời (PENDING chờ
+    // to accept) hoặc đã là bạn (ACCEPTED đối xứng) đều chặn.
+    if (from_id > 0 && to_id > 0 &&
+        (idx_has_pending(from_id, to_id) || idx_is_friend(from_id, to_id)))
+    {
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_EXISTS;
+    }
+
+    if (journal_it &&
+        journal_friend_op("INVITE", from_username, to_username) != FRIEND_OK)
+    {
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_INTERNAL;
     }
 
     // Append lời mời mới
-    f = fopen(FRIENDS_DB_PATH, "a");
+    FILE *f = fopen(FRIENDS_DB_PATH, "a");
     if (!f)
     {
         pthread_mutex_unlock(&friends_mutex);
@@ -176,25 +245,68 @@ int friends_send_invite(int from_user_id, const char *to_username)
             from_username, to_username, time(NULL));
 
     fclose(f);
+
+    if (from_id > 0 && to_id > 0)
+        idx_add_pending(from_id, to_id);
+
     pthread_mutex_unlock(&friends_mutex);
 
     return FRIEND_OK;
 }
 
-int friends_accept_invite(int to_user_id, const char *from_username)
+int friends_send_invite(int from_user_id, const char *to_username)
 {
-    char to_username[64];
-    if (!from_username || !from_username[0])
+    char from_username[64];
+
+    if (!to_username || !to_username[0])
+    {
         return FRIEND_ERR_INTERNAL;
+    }
 
-    if (!get_username_by_id(to_user_id, to_username, sizeof(to_username)))
+    // Lấy username người gửi
+    if (!get_username_by_id(from_user_id, from_username, sizeof(from_username)))
+    {
         return FRIEND_ERR_INTERNAL;
+    }
 
-    if (strcmp(to_username, from_username) == 0)
+    // Không cho mời chính mình
+    if (strcmp(from_username, to_username) == 0)
+    {
         return FRIEND_ERR_SELF;
+    }
+
+    // Kiểm tra user nhận tồn tại
+    if (!username_exists(to_username))
+    {
+        return FRIEND_ERR_NOT_FOUND;
+    }
+
+    return invite_apply(from_username, to_username, 1);
+}
+
+static int accept_apply(const char *from_username, const char *to_username,
+                        int journal_it)
+{
+    int from_id = get_user_id_by_username(from_username);
+    int to_id = get_user_id_by_username(to_username);
 
     pthread_mutex_lock(&friends_mutex);
 
+    // Fast path qua index: đã là bạn / không có lời mời thì khỏi rewrite db.
+    if (from_id > 0 && to_id > 0)
+    {
+        if (idx_is_friend(from_id, to_id))
+        {
+            pthread_mutex_unlock(&friends_mutex);
+            return FRIEND_ERR_EXISTS;
+        }
+        if (!idx_has_pending(from_id, to_id))
+        {
+            pthread_mutex_unlock(&friends_mutex);
+            return FRIEND_ERR_NOT_FOUND;
+        }
+    }
+
     FILE *in = fopen(FRIENDS_DB_PATH, "r");
     if (!in)
     {
@@ -258,12 +370,27 @@ int friends_accept_invite(int to_user_id, const char *from_username)
         return FRIEND_ERR_NOT_FOUND;
     }
 
+    if (journal_it &&
+        journal_friend_op("ACCEPT", from_username, to_username) != FRIEND_OK)
+    {
+        remove(FRIENDS_DB_PATH ".tmp");
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_INTERNAL;
+    }
+
     rename(FRIENDS_DB_PATH ".tmp", FRIENDS_DB_PATH);
+
+    if (from_id > 0 && to_id > 0)
+    {
+        idx_remove_pending(from_id, to_id);
+        idx_add_friend(from_id, to_id);
+    }
+
     pthread_mutex_unlock(&friends_mutex);
     return FRIEND_OK;
 }
 
-int friends_reject_invite(int to_user_id, const char *from_username)
+int friends_accept_invite(int to_user_id, const char *from_username)
 {
     char to_username[64];
     if (!from_username || !from_username[0])
@@ -275,8 +402,24 @@ int friends_reject_invite(int to_user_id, const char *from_username)
     if (strcmp(to_username, from_username) == 0)
         return FRIEND_ERR_SELF;
 
+    return accept_apply(from_username, to_username, 1);
+}
+
+static int reject_apply(const char *from_username, const char *to_username,
+                        int journal_it)
+{
+    int from_id = get_user_id_by_username(from_username);
+    int to_id = get_user_id_by_username(to_username);
+
     pthread_mutex_lock(&friends_mutex);
 
+    // Không có lời mời trong index => khỏi rewrite db.
+    if (from_id > 0 && to_id > 0 && !idx_has_pending(from_id, to_id))
+    {
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_NOT_FOUND;
+    }
+
     FILE *in = fopen(FRIENDS_DB_PATH, "r");
     if (!in)
     {
@@ -326,157 +469,139 @@ int friends_reject_invite(int to_user_id, const char *from_username)
         return FRIEND_ERR_NOT_FOUND;
     }
 
+    if (journal_it &&
+        journal_friend_op("REJECT", from_username, to_username) != FRIEND_OK)
+    {
+        remove(FRIENDS_DB_PATH ".tmp");
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_INTERNAL;
+    }
+
     rename(FRIENDS_DB_PATH ".tmp", FRIENDS_DB_PATH);
+
+    if (from_id > 0 && to_id > 0)
+        idx_remove_pending(from_id, to_id);
+
     pthread_mutex_unlock(&friends_mutex);
     return FRIEND_OK;
 }
 
-int friends_pending(int user_id, char *out, size_t cap)
+int friends_reject_invite(int to_user_id, const char *from_username)
 {
-    char my_username[64];
-    out[0] = 0;
+    char to_username[64];
+    if (!from_username || !from_username[0])
+        return FRIEND_ERR_INTERNAL;
 
-    if (!get_username_by_id(user_id, my_username, sizeof(my_username)))
-    {
+    if (!get_username_by_id(to_user_id, to_username, sizeof(to_username)))
         return FRIEND_ERR_INTERNAL;
-    }
+
+    if (strcmp(to_username, from_username) == 0)
+        return FRIEND_ERR_SELF;
+
+    return reject_apply(from_username, to_username, 1);
+}
+
+int friends_pending(int user_id, char *out, size_t cap)
+{
+    // Walk list pending_from trong index - zero file I/O.
+    out[0] = 0;
 
     pthread_mutex_lock(&friends_mutex);
 
-    FILE *f = fopen(FRIENDS_DB_PATH, "r");
-    if (!f)
+    FriendAdj *a = adj_find(user_id);
+    if (!a)
     {
         pthread_mutex_unlock(&friends_mutex);
-        return FRIEND_OK; // chưa có file => không có pending
+        return FRIEND_OK; // chưa có entry => không có pending
     }
 
-    char line[LINE_MAX];
     size_t used = 0;
 
-    while (fgets(line, sizeof(line), f))
+    for (int i = 0; i < a->pending_count; i++)
     {
-        char from[64], to[64], status[32];
-        long ts;
+        char from[64];
 
-        if (sscanf(line, "%63[^|]|%63[^|]|%31[^|]|%ld",
-                   from, to, status, &ts) != 4)
+        if (!get_username_by_id(a->pending_from[i], from, sizeof(from)))
             continue;
 
-        if (strcmp(to, my_username) == 0 &&
-            strcmp(status, "PENDING") == 0)
-        {
-
-            size_t len = strlen(from);
-            if (used + len + 2 >= cap)
-                break;
-
-            if (used > 0)
-            {
-                out[used++] = ',';
-            }
+        size_t len = strlen(from);
+        if (used + len + 2 >= cap)
+            break;
 
-            memcpy(out + used, from, len);
-            used += len;
-            out[used] = 0;
+        if (used > 0)
+        {
+            out[used++] = ',';
         }
+
+        memcpy(out + used, from, len);
+        used += len;
+        out[used] = 0;
     }
 
-    fclose(f);
     pthread_mutex_unlock(&friends_mutex);
     return FRIEND_OK;
 }
 
-int friends_list(int user_id, char *out, size_t cap)
+int friends_list_emit(int user_id, ProtoItemFn emit, void *ud)
 {
-    char my_username[64];
-    out[0] = 0;
-
-    if (!get_username_by_id(user_id, my_username, sizeof(my_username)))
-    {
-        return FRIEND_ERR_INTERNAL;
-    }
-
+    // Walk list friends trong index - zero file I/O. Mỗi entry đẩy qua
+    // sink (stream OK-PART hoặc joinbuf của friends_list).
     pthread_mutex_lock(&friends_mutex);
 
-    FILE *f = fopen(FRIENDS_DB_PATH, "r");
-    if (!f)
+    FriendAdj *a = adj_find(user_id);
+    if (!a)
     {
         pthread_mutex_unlock(&friends_mutex);
-        return FRIEND_OK; // chưa có file => không có pending
+        return FRIEND_OK; // chưa có entry => không có friend
     }
 
-    char line[LINE_MAX];
-    size_t used = 0;
-
-    while (fgets(line, sizeof(line), f))
+    for (int i = 0; i < a->friend_count; i++)
     {
-        char from[64], to[64], status[32], friend_name[64];
-        long ts;
+        int friend_id = a->friends[i];
+        char friend_name[64];
 
-        if (sscanf(line, "%63[^|]|%63[^|]|%31[^|]|%ld",
-                   from, to, status, &ts) != 4)
+        if (!get_username_by_id(friend_id, friend_name, sizeof(friend_name)))
             continue;
 
-        if ((strcmp(to, my_username) == 0 || strcmp(from, my_username) == 0) &&
-            strcmp(status, "ACCEPTED") == 0)
+        const char *online_status = "offline";
+        if (sessions_is_online(friend_id))
         {
+            online_status = "online";
+        }
 
-            if (strcmp(to, my_username) == 0)
-            {
-                strcpy(friend_name, from);
-            }
-            else
-            {
-                strcpy(friend_name, to);
-            }
-
-            // Lấy user_id của friend và check online status
-            int friend_id = get_user_id_by_username(friend_name);
-            const char *online_status = "offline";
-            if (friend_id > 0 && sessions_is_online(friend_id))
-            {
-                online_status = "online";
-            }
-
-            // Format: username:online hoặc username:offline
-            char entry[128];
-            snprintf(entry, sizeof(entry), "%s:%s", friend_name, online_status);
-
-            size_t len = strlen(entry);
-            if (used + len + 2 >= cap)
-                break;
+        // Format: username:online hoặc username:offline
+        char entry[128];
+        snprintf(entry, sizeof(entry), "%s:%s", friend_name, online_status);
 
-            if (used > 0)
-            {
-                out[used++] = ',';
-            }
-
-            memcpy(out + used, entry, len);
-            used += len;
-            out[used] = 0;
-        }
+        if (!emit(ud, entry))
+            break;
     }
 
-    fclose(f);
     pthread_mutex_unlock(&friends_mutex);
     return FRIEND_OK;
 }
 
-int friends_delete(int user_id, const char *other_username)
+int friends_list(int user_id, char *out, size_t cap)
 {
-    char my_username[64];
-
-    if (!other_username || !other_username[0])
-        return FRIEND_ERR_INTERNAL;
-
-    if (!get_username_by_id(user_id, my_username, sizeof(my_username)))
-        return FRIEND_ERR_INTERNAL;
+    ProtoJoinBuf jb = { out, cap, 0 };
+    out[0] = 0;
+    return friends_list_emit(user_id, proto_joinbuf_emit, &jb);
+}
 
-    if (strcmp(my_username, other_username) == 0)
-        return FRIEND_ERR_SELF;
+static int delete_apply(const char *my_username, const char *other_username,
+                        int journal_it)
+{
+    int my_id = get_user_id_by_username(my_username);
+    int other_id = get_user_id_by_username(other_username);
 
     pthread_mutex_lock(&friends_mutex);
 
+    // Không phải bạn theo index => khỏi rewrite db.
+    if (my_id > 0 && other_id > 0 && !idx_is_friend(my_id, other_id)) {
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_NOT_FOUND;
+    }
+
     FILE *in = fopen(FRIENDS_DB_PATH, "r");
     if (!in) {
         pthread_mutex_unlock(&friends_mutex);
@@ -526,7 +651,88 @@ int friends_delete(int user_id, const char *other_username)
         return FRIEND_ERR_NOT_FOUND;
     }
 
+    if (journal_it &&
+        journal_friend_op("DELETE", my_username, other_username) != FRIEND_OK)
+    {
+        remove(FRIENDS_DB_PATH ".tmp");
+        pthread_mutex_unlock(&friends_mutex);
+        return FRIEND_ERR_INTERNAL;
+    }
+
     rename(FRIENDS_DB_PATH ".tmp", FRIENDS_DB_PATH);
+
+    if (my_id > 0 && other_id > 0)
+        idx_remove_friend(my_id, other_id);
+
+    pthread_mutex_unlock(&friends_mutex);
+    return FRIEND_OK;
+}
+
+int friends_get_friend_ids(int user_id, int *out_ids, int max_ids)
+{
+    // Lấy danh sách user_id các friend ACCEPTED - dùng cho presence
+    // subscribe. Copy thẳng từ index. Return số friend hoặc -1 nếu lỗi.
+    if (!out_ids || max_ids <= 0)
+        return -1;
+
+    pthread_mutex_lock(&friends_mutex);
+
+    FriendAdj *a = adj_find(user_id);
+    if (!a)
+    {
+        pthread_mutex_unlock(&friends_mutex);
+        return 0; // chưa có entry => chưa có friend
+    }
+
+    int count = a->friend_count;
+    if (count > max_ids)
+        count = max_ids;
+
+    memcpy(out_ids, a->friends, (size_t)count * sizeof(int));
+
     pthread_mutex_unlock(&friends_mutex);
+    return count;
+}
+
+int friends_delete(int user_id, const char *other_username)
+{
+    char my_username[64];
+
+    if (!other_username || !other_username[0])
+        return FRIEND_ERR_INTERNAL;
+
+    if (!get_username_by_id(user_id, my_username, sizeof(my_username)))
+        return FRIEND_ERR_INTERNAL;
+
+    if (strcmp(my_username, other_username) == 0)
+        return FRIEND_ERR_SELF;
+
+    return delete_apply(my_username, other_username, 1);
+}
+
+int friends_replay_journal(const char *rec)
+{
+    /*
+     * Replay 1 record "FRN|OP|a|b" từ journal lúc startup: áp lại op vào
+     * friends.db qua đúng path apply (không journal lại). Idempotent -
+     * op đã có trong db trước khi crash trả EXISTS/NOT_FOUND và bị bỏ qua.
+     */
+    char op[16], a[64], b[64];
+
+    if (!rec || strncmp(rec, "FRN|", 4) != 0)
+        return FRIEND_ERR_INTERNAL;
+
+    if (sscanf(rec + 4, "%15[^|]|%63[^|]|%63[^|\n]", op, a, b) != 3)
+        return FRIEND_ERR_INTERNAL;
+
+    if (strcmp(op, "INVITE") == 0)
+        invite_apply(a, b, 0);
+    else if (strcmp(op, "ACCEPT") == 0)
+        accept_apply(a, b, 0);
+    else if (strcmp(op, "REJECT") == 0)
+        reject_apply(a, b, 0);
+    else if (strcmp(op, "DELETE") == 0)
+        delete_apply(a, b, 0);
+
     return FRIEND_OK;
 }
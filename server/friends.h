@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 
+#include "../common/protocol.h" // ProtoItemFn
+
 #define FRIEND_OK             0
 #define FRIEND_ERR_SELF       1   // mời / accept chính mình
 #define FRIEND_ERR_NOT_FOUND  2   // không có lời mời
@@ -11,11 +13,27 @@
 
 #pragma once
 
+// Load friends.db vào adjacency index in-memory. Gọi 1 lần lúc startup,
+// sau accounts_init() (cần map username -> user_id) và TRƯỚC journal
+// replay (replay đi qua các path apply nên tự cập nhật index).
+int friends_init(void);
+
 int friends_send_invite(int from_user_id, const char *to_username);
 int friends_accept_invite(int to_user_id, const char *from_username);
 int friends_reject_invite(int to_user_id, const char *from_username);
 int friends_pending(int user_id, char *out, size_t cap);
 int friends_list(int user_id, char *out, size_t cap);
+
+// Biến thể streaming của friends_list: đẩy từng entry "username:online|offline"
+// qua sink thay vì build vào buffer cố định (sink trả 0 => dừng sớm).
+int friends_list_emit(int user_id, ProtoItemFn emit, void *ud);
 int friends_delete(int user_id, const char *other_username);
 
+// Lấy user_id các friend ACCEPTED của user (cho presence subscribe).
+// Return số friend ghi vào out_ids, hoặc -1 nếu lỗi.
+int friends_get_friend_ids(int user_id, int *out_ids, int max_ids);
+
+// Replay 1 record "FRN|..." từ journal lúc startup (idempotent).
+int friends_replay_journal(const char *rec);
+
 #endif
@@ -1,5 +1,6 @@
 #include "group_messages.h"
 #include "accounts.h"
+#include "groups.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,23 +8,36 @@
 #include <time.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dirent.h>
 
 /*
  * server/group_messages.c
  * - Lưu tin nhắn group vào data/gm/{group_id}.txt
  * - Format mỗi dòng: msg_id|from_user_id|content_base64|timestamp
- * - Thread-safe với mutex
+ * - Thread-safe: lock striped theo group_id + mutex riêng cho counter
  */
 
 #define GM_DIR "data/gm"
-#define GROUP_MEMBERS_DB "data/group_members.db"
-#define GROUPS_DB "data/groups.db"
 #define LINE_MAX 8192
 
-static pthread_mutex_t gm_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Lock striped theo group_id: 2 group khác stripe gửi/đọc song song
+// thay vì serialize qua 1 gm_mutex toàn cục (cùng scheme với pm_locks
+// bên messages.c). Counter msg_id có mutex riêng.
+#define GM_LOCK_STRIPES 64
+
+static pthread_mutex_t gm_locks[GM_LOCK_STRIPES];
+static pthread_mutex_t gm_id_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int gm_next_msg_id = 1;
 
+static pthread_mutex_t* gm_lock_for(int group_id)
+{
+    unsigned h = (unsigned)group_id * 2654435761u;
+    return &gm_locks[h & (GM_LOCK_STRIPES - 1)];
+}
+
 // ============ Helpers ============
 
 static void get_gm_filepath(int group_id, char *out, size_t cap)
@@ -33,28 +47,19 @@ static void get_gm_filepath(int group_id, char *out, size_t cap)
 
 static int group_exists(int group_id)
 {
-    FILE *f = fopen(GROUPS_DB, "r");
-    if (!f) return 0;
-    
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        int gid;
-        if (sscanf(line, "%d|", &gid) == 1) {
-            if (gid == group_id) {
-                fclose(f);
-                return 1;
-            }
-        }
-    }
-    
-    fclose(f);
-    return 0;
+    // Membership/group cache nằm ở groups.c (load lúc groups_init()).
+    return groups_exists(group_id);
 }
 
 // ============ Public APIs ============
 
 int gm_init(void)
 {
+    // Stripe lock init (chạy 1 lần lúc startup, trước khi có thread).
+    for (int i = 0; i < GM_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&gm_locks[i], NULL);
+    }
+
     // Tạo thư mục data/gm nếu chưa có
     mkdir("data", 0755);
     mkdir(GM_DIR, 0755);
@@ -91,77 +96,18 @@ int gm_init(void)
 
 int gm_is_member(int user_id, int group_id)
 {
-    char username[64];
-    if (!accounts_get_username(user_id, username, sizeof(username))) {
-        return 0;
-    }
-    
-    FILE *f = fopen(GROUP_MEMBERS_DB, "r");
-    if (!f) return 0;
-    
-    char line[256];
-    while (fgets(line, sizeof(line), f)) {
-        int gid;
-        char member[64];
-        if (sscanf(line, "%d|%63s", &gid, member) == 2) {
-            if (gid == group_id && strcmp(member, username) == 0) {
-                fclose(f);
-                return 1;
-            }
-        }
-    }
-    
-    fclose(f);
-    return 0;
+    // Delegate sang cache membership trong groups.c (lookup bộ nhớ).
+    return groups_is_member_id(user_id, group_id);
 }
 
 int gm_get_member_ids(int group_id, int *out_ids, int max_ids)
 {
-    FILE *f = fopen(GROUP_MEMBERS_DB, "r");
-    if (!f) return 0;
-    
-    int count = 0;
-    char line[256];
-    
-    while (fgets(line, sizeof(line), f) && count < max_ids) {
-        int gid;
-        char member[64];
-        if (sscanf(line, "%d|%63s", &gid, member) == 2) {
-            if (gid == group_id) {
-                int uid = accounts_get_user_id(member);
-                if (uid > 0) {
-                    out_ids[count++] = uid;
-                }
-            }
-        }
-    }
-    
-    fclose(f);
-    return count;
+    return groups_get_member_ids(group_id, out_ids, max_ids);
 }
 
 int gm_get_group_name(int group_id, char *out, size_t cap)
 {
-    FILE *f = fopen(GROUPS_DB, "r");
-    if (!f) return 0;
-    
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        int gid;
-        char name[64], owner[64];
-        long ts;
-        
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%ld", &gid, name, owner, &ts) >= 2) {
-            if (gid == group_id) {
-                snprintf(out, cap, "%s", name);
-                fclose(f);
-                return 1;
-            }
-        }
-    }
-    
-    fclose(f);
-    return 0;
+    return groups_get_name(group_id, out, cap);
 }
 
 int gm_send(int from_user_id, int group_id,
@@ -181,35 +127,41 @@ int gm_send(int from_user_id, int group_id,
         return GM_ERR_NOT_MEMBER;
     }
     
-    pthread_mutex_lock(&gm_mutex);
-    
+    pthread_mutex_t *lock = gm_lock_for(group_id);
+    pthread_mutex_lock(lock);
+
     char filepath[256];
     get_gm_filepath(group_id, filepath, sizeof(filepath));
-    
+
     FILE *f = fopen(filepath, "a");
     if (!f) {
-        pthread_mutex_unlock(&gm_mutex);
+        pthread_mutex_unlock(lock);
         return GM_ERR_INTERNAL;
     }
-    
+
+    // Cấp id nested trong lock group để msg_id trong từng file luôn tăng
+    // đơn điệu (cursor của gm_get_history dựa vào đó).
+    pthread_mutex_lock(&gm_id_mutex);
     int msg_id = gm_next_msg_id++;
+    pthread_mutex_unlock(&gm_id_mutex);
     long ts = (long)time(NULL);
-    
+
     // Format: msg_id|from_user_id|content_base64|timestamp
     fprintf(f, "%d|%d|%s|%ld\n", msg_id, from_user_id, content_base64, ts);
     fclose(f);
-    
-    pthread_mutex_unlock(&gm_mutex);
+
+    pthread_mutex_unlock(lock);
     
     if (out_msg_id) *out_msg_id = msg_id;
     return GM_OK;
 }
 
-int gm_get_history(int user_id, int group_id,
-                   char* out, size_t out_cap, int limit)
+int gm_get_history_emit(int user_id, int group_id,
+                        int limit, int before_msg_id,
+                        ProtoItemFn emit, void* ud)
 {
-    out[0] = '\0';
-    
+    if (!emit) return GM_ERR_INTERNAL;
+
     // Kiểm tra group tồn tại
     if (!group_exists(group_id)) {
         return GM_ERR_NOT_FOUND;
@@ -220,93 +172,111 @@ int gm_get_history(int user_id, int group_id,
         return GM_ERR_NOT_MEMBER;
     }
     
-    pthread_mutex_lock(&gm_mutex);
-    
+    pthread_mutex_t *lock = gm_lock_for(group_id);
+    pthread_mutex_lock(lock);
+
     char filepath[256];
     get_gm_filepath(group_id, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "r");
-    if (!f) {
+
+    // mmap cả file và parse record tại chỗ: không copy từng line qua
+    // buffer trung gian, fetch lặp lại cùng group ăn thẳng page cache.
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
         // File chưa có = chưa có tin nhắn
-        pthread_mutex_unlock(&gm_mutex);
+        pthread_mutex_unlock(lock);
         return GM_OK;
     }
-    
-    // Đọc tất cả messages vào mảng tạm
-    typedef struct {
-        int msg_id;
-        int from_id;
-        char content[4096];
-        long ts;
-    } TempMsg;
-    
-    TempMsg *msgs = malloc(sizeof(TempMsg) * 1000);
-    int count = 0;
-    
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f) && count < 1000) {
-        int mid, fid;
-        char content[4096];
-        long ts;
-        
-        // Parse: msg_id|from_user_id|content_base64|timestamp
-        char *p = line;
-        char *tok;
-        
-        tok = strtok(p, "|");
-        if (!tok) continue;
-        mid = atoi(tok);
-        
-        tok = strtok(NULL, "|");
-        if (!tok) continue;
-        fid = atoi(tok);
-        
-        tok = strtok(NULL, "|");
-        if (!tok) continue;
-        strncpy(content, tok, sizeof(content) - 1);
-        content[sizeof(content) - 1] = '\0';
-        
-        tok = strtok(NULL, "|\n");
-        if (!tok) continue;
-        ts = atol(tok);
-        
-        msgs[count].msg_id = mid;
-        msgs[count].from_id = fid;
-        strcpy(msgs[count].content, content);
-        msgs[count].ts = ts;
-        count++;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        pthread_mutex_unlock(lock);
+        return GM_OK;
     }
-    
-    fclose(f);
-    pthread_mutex_unlock(&gm_mutex);
-    
-    // Lấy limit messages mới nhất (từ cuối)
-    int start = count - limit;
-    if (start < 0) start = 0;
-    
-    // Build output: msg_id:from_username:content_base64:timestamp,...
+
+    size_t map_size = (size_t)st.st_size;
+    char *map = (char*)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        pthread_mutex_unlock(lock);
+        return GM_ERR_INTERNAL;
+    }
+
+    // Quét 1 lượt qua các newline, giữ offset của `limit` record cuối
+    // trong ring buffer (không cần load toàn bộ message vào bộ nhớ).
+    long ring[256];
+    int ring_cap = limit;
+    if (ring_cap < 1) ring_cap = 1;
+    if (ring_cap > (int)(sizeof(ring) / sizeof(ring[0]))) {
+        ring_cap = (int)(sizeof(ring) / sizeof(ring[0]));
+    }
+    int ring_head = 0, ring_count = 0;
+
     size_t pos = 0;
-    for (int i = start; i < count && pos < out_cap - 1; i++) {
+    while (pos < map_size) {
+        // Cursor: msg_id tăng đơn điệu trong file nên gặp record >= cursor
+        // là dừng — ring đang giữ đúng `limit` record cuối TRƯỚC cursor.
+        if (before_msg_id > 0 && atoi(map + pos) >= before_msg_id) break;
+
+        if (ring_count < ring_cap) {
+            ring[(ring_head + ring_count) % ring_cap] = (long)pos;
+            ring_count++;
+        } else {
+            ring[ring_head] = (long)pos;
+            ring_head = (ring_head + 1) % ring_cap;
+        }
+
+        const char *nl = memchr(map + pos, '\n', map_size - pos);
+        if (!nl) break;
+        pos = (size_t)(nl - map) + 1;
+    }
+
+    // Emit từng entry (cũ -> mới trong số limit record cuối) qua sink:
+    // msg_id:from_username:content_base64:timestamp
+    for (int i = 0; i < ring_count; i++) {
+        long off = ring[(ring_head + i) % ring_cap];
+        const char *rec = map + off;
+        size_t rec_max = map_size - (size_t)off;
+
+        // Parse tại chỗ: msg_id|from_user_id|content_base64|timestamp
+        const char *p1 = memchr(rec, '|', rec_max);
+        if (!p1) continue;
+        const char *p2 = memchr(p1 + 1, '|', rec_max - (size_t)(p1 + 1 - rec));
+        if (!p2) continue;
+        const char *p3 = memchr(p2 + 1, '|', rec_max - (size_t)(p2 + 1 - rec));
+        if (!p3) continue;
+
+        int msg_id = atoi(rec);
+        int from_id = atoi(p1 + 1);
+        long ts = atol(p3 + 1);
+
         char from_username[64];
-        if (!accounts_get_username(msgs[i].from_id, from_username, sizeof(from_username))) {
+        if (!accounts_get_username(from_id, from_username, sizeof(from_username))) {
             strcpy(from_username, "unknown");
         }
-        
-        char entry[8192];
-        snprintf(entry, sizeof(entry), "%d:%s:%s:%ld",
-                 msgs[i].msg_id, from_username, msgs[i].content, msgs[i].ts);
-        
-        if (pos > 0 && pos < out_cap - 1) {
-            out[pos++] = ',';
-        }
-        
-        size_t elen = strlen(entry);
-        if (pos + elen >= out_cap) break;
-        
-        strcpy(out + pos, entry);
-        pos += elen;
+
+        // Chỉ cần 1 entry buffer dù history lớn đến đâu (sink streaming
+        // đẩy entry đi ngay thành frame bounded).
+        char entry[LINE_MAX + 160];
+        int n = snprintf(entry, sizeof(entry), "%d:%s:%.*s:%ld",
+                         msg_id, from_username,
+                         (int)(p3 - p2 - 1), p2 + 1, ts);
+        if (n < 0 || (size_t)n >= sizeof(entry)) continue; // record hỏng: bỏ
+
+        if (!emit(ud, entry)) break;
     }
-    
-    free(msgs);
+
+    munmap(map, map_size);
+    pthread_mutex_unlock(lock);
     return GM_OK;
 }
+
+int gm_get_history(int user_id, int group_id,
+                   char* out, size_t out_cap, int limit, int before_msg_id)
+{
+    out[0] = '\0';
+
+    ProtoJoinBuf jb = { out, out_cap, 0 };
+    return gm_get_history_emit(user_id, group_id, limit, before_msg_id,
+                               proto_joinbuf_emit, &jb);
+}
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 
+#include "../common/protocol.h" // ProtoItemFn
+
 /*
  * server/group_messages.*
  * - Module Group Message (GM) - nhắn tin trong nhóm chat.
@@ -26,9 +28,17 @@ int gm_send(int from_user_id, int group_id,
 
 // Lấy history chat của group
 // Return format: "msg_id:from_username:content_base64:timestamp,..."
-// Message mới nhất trước, giới hạn bởi 'limit'
+// Message mới nhất trước, giới hạn bởi 'limit'.
+// before_msg_id > 0: chỉ lấy message CŨ HƠN msg_id đó (cursor scroll ngược,
+// giống pm_get_history); 0 = từ message mới nhất.
 int gm_get_history(int user_id, int group_id,
-                   char* out, size_t out_cap, int limit);
+                   char* out, size_t out_cap, int limit, int before_msg_id);
+
+// Biến thể streaming: đẩy từng entry "msg_id:from:content:ts" qua sink
+// (stream OK-PART) thay vì build vào buffer cố định. Sink trả 0 => dừng sớm.
+int gm_get_history_emit(int user_id, int group_id,
+                        int limit, int before_msg_id,
+                        ProtoItemFn emit, void* ud);
 
 // Kiểm tra user có phải member của group không
 int gm_is_member(int user_id, int group_id);
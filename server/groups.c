@@ -1,131 +1,281 @@
 #include "groups.h"
+#include "accounts.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
 
-#define USERS_DB_PATH "data/users.db"
 #define GROUPS_DB_PATH "data/groups.db"
 #define GROUP_MEMBERS_DB_PATH "data/group_members.db"
 
 #define LINE_MAX 512
 
+/*
+ * server/groups.c
+ * - Quản lý group + membership, lưu ở data/groups.db và data/group_members.db.
+ * - Toàn bộ group/membership được load vào cache in-memory tại groups_init():
+ *   check owner/member là lookup bộ nhớ thay vì re-parse file mỗi request
+ *   (gm_send gọi check member trên MỖI tin nhắn group).
+ * - File vẫn là source of truth trên disk: mọi mutation ghi file trước,
+ *   thành công rồi mới cập nhật cache (dưới groups_mutex).
+ */
+
 static pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* ===== Helpers ===== */
+// ============ In-memory cache ============
 
-static int get_username_by_id(int user_id, char *out, size_t cap)
+typedef struct {
+    int gid;
+    char name[64];
+    char owner[64];
+    // Danh sách member theo username (giữ nguyên thứ tự như file)
+    char (*members)[64];
+    int member_count;
+    int member_cap;
+} GroupRec;
+
+static GroupRec* g_groups = NULL;
+static int g_group_count = 0;
+static int g_group_cap = 0;
+
+// Hash index gid -> slot+1 (0 = trống). Group không bao giờ bị xóa nên
+// không cần tombstone.
+static int* g_idx_gid = NULL;
+static size_t g_idx_cap = 0;
+
+static unsigned long long hash_int(int v)
 {
-    FILE *f = fopen(USERS_DB_PATH, "r");
-    if (!f)
-        return 0;
-
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
-    {
-        int id, active;
-        char username[64], salt[64], hash[64], email[128];
+    // Knuth multiplicative hash
+    return (unsigned long long)((unsigned int)v * 2654435761u);
+}
 
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%63[^|]|%127[^|]|%d",
-                   &id, username, salt, hash, email, &active) == 6)
-        {
-            if (id == user_id && active)
-            {
-                snprintf(out, cap, "%s", username);
-                fclose(f);
-                return 1;
-            }
-        }
+static void idx_insert_unlocked(int gid, int slot)
+{
+    size_t i = (size_t)hash_int(gid) & (g_idx_cap - 1);
+    while (g_idx_gid[i] != 0) {
+        i = (i + 1) & (g_idx_cap - 1);
     }
+    g_idx_gid[i] = slot + 1;
+}
 
-    fclose(f);
+static int idx_grow_unlocked(void)
+{
+    size_t new_cap = g_idx_cap ? g_idx_cap * 2 : 64;
+    free(g_idx_gid);
+    g_idx_gid = (int*)calloc(new_cap, sizeof(int));
+    if (!g_idx_gid) {
+        g_idx_cap = 0;
+        return -1;
+    }
+    g_idx_cap = new_cap;
+    for (int s = 0; s < g_group_count; s++) {
+        idx_insert_unlocked(g_groups[s].gid, s);
+    }
     return 0;
 }
 
-static int username_exists(const char *username)
+static GroupRec* group_find_unlocked(int gid)
 {
-    FILE *f = fopen(USERS_DB_PATH, "r");
-    if (!f)
-        return 0;
+    if (g_idx_cap == 0) return NULL;
+    size_t i = (size_t)hash_int(gid) & (g_idx_cap - 1);
+    while (g_idx_gid[i] != 0) {
+        GroupRec* g = &g_groups[g_idx_gid[i] - 1];
+        if (g->gid == gid) return g;
+        i = (i + 1) & (g_idx_cap - 1);
+    }
+    return NULL;
+}
 
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
-    {
-        int id, active;
-        char u[64], salt[64], hash[64], email[128];
+/*
+ * group_add_unlocked
+ * - Thêm 1 group vào cache (chưa có member nào). Return NULL nếu lỗi cấp phát.
+ */
+static GroupRec* group_add_unlocked(int gid, const char* name, const char* owner)
+{
+    if (g_group_count >= g_group_cap) {
+        int new_cap = g_group_cap ? g_group_cap * 2 : 32;
+        GroupRec* next = (GroupRec*)realloc(g_groups, (size_t)new_cap * sizeof(GroupRec));
+        if (!next) return NULL;
+        g_groups = next;
+        g_group_cap = new_cap;
+    }
+    // Giữ load factor <= 50% cho index
+    if ((size_t)(g_group_count + 1) * 2 > g_idx_cap) {
+        if (idx_grow_unlocked() != 0) return NULL;
+    }
 
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%63[^|]|%127[^|]|%d",
-                   &id, u, salt, hash, email, &active) == 6)
-        {
-            if (strcmp(u, username) == 0 && active)
-            {
-                fclose(f);
-                return 1;
-            }
-        }
+    GroupRec* g = &g_groups[g_group_count];
+    memset(g, 0, sizeof(*g));
+    g->gid = gid;
+    snprintf(g->name, sizeof(g->name), "%s", name ? name : "");
+    snprintf(g->owner, sizeof(g->owner), "%s", owner ? owner : "");
+    idx_insert_unlocked(gid, g_group_count);
+    g_group_count++;
+    return g;
+}
+
+static int member_find_unlocked(const GroupRec* g, const char* username)
+{
+    for (int i = 0; i < g->member_count; i++) {
+        if (strcmp(g->members[i], username) == 0) return i;
     }
+    return -1;
+}
 
-    fclose(f);
+static int member_add_unlocked(GroupRec* g, const char* username)
+{
+    if (g->member_count >= g->member_cap) {
+        int new_cap = g->member_cap ? g->member_cap * 2 : 8;
+        char (*next)[64] = (char (*)[64])realloc(g->members, (size_t)new_cap * 64);
+        if (!next) return -1;
+        g->members = next;
+        g->member_cap = new_cap;
+    }
+    snprintf(g->members[g->member_count], 64, "%s", username);
+    g->member_count++;
     return 0;
 }
 
+static void member_remove_unlocked(GroupRec* g, int pos)
+{
+    // Giữ nguyên thứ tự (khớp thứ tự dòng trong file)
+    memmove(&g->members[pos], &g->members[pos + 1],
+            (size_t)(g->member_count - pos - 1) * 64);
+    g->member_count--;
+}
+
+/* ===== Helpers ===== */
+
+static int get_username_by_id(int user_id, char *out, size_t cap)
+{
+    return accounts_get_username(user_id, out, cap);
+}
+
+static int username_exists(const char *username)
+{
+    return accounts_get_user_id(username) > 0;
+}
+
 static int is_group_owner(int group_id, const char *username)
 {
-    FILE *f = fopen(GROUPS_DB_PATH, "r");
-    if (!f)
-        return 0;
+    GroupRec* g = group_find_unlocked(group_id);
+    return g && strcmp(g->owner, username) == 0;
+}
+
+static int is_group_member(int group_id, const char *username)
+{
+    GroupRec* g = group_find_unlocked(group_id);
+    return g && member_find_unlocked(g, username) >= 0;
+}
+
+/* ===== Public APIs ===== */
+
+int groups_init(void)
+{
+    /*
+     * Load cache từ groups.db + group_members.db (gọi 1 lần lúc server start).
+     * Dòng membership trỏ tới group không có trong groups.db vẫn được giữ
+     * (tạo record rỗng) để hành vi giống bản scan file cũ.
+     */
+    pthread_mutex_lock(&groups_mutex);
 
     char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
+
+    FILE *g = fopen(GROUPS_DB_PATH, "r");
+    if (g)
     {
-        int gid;
-        char name[64], owner[64];
-        long ts;
+        while (fgets(line, sizeof(line), g))
+        {
+            int gid;
+            char name[64], owner[64];
+            long ts;
+
+            if (sscanf(line, "%d|%63[^|]|%63[^|]|%ld",
+                       &gid, name, owner, &ts) == 4)
+            {
+                if (!group_find_unlocked(gid))
+                    group_add_unlocked(gid, name, owner);
+            }
+        }
+        fclose(g);
+    }
 
-        if (sscanf(line, "%d|%63[^|]|%63[^|]|%ld",
-                   &gid, name, owner, &ts) == 4)
+    FILE *m = fopen(GROUP_MEMBERS_DB_PATH, "r");
+    if (m)
+    {
+        while (fgets(line, sizeof(line), m))
         {
-            if (gid == group_id && strcmp(owner, username) == 0)
+            int gid;
+            char u[64];
+
+            if (sscanf(line, "%d|%63s", &gid, u) == 2)
             {
-                fclose(f);
-                return 1;
+                GroupRec *rec = group_find_unlocked(gid);
+                if (!rec)
+                    rec = group_add_unlocked(gid, "", "");
+                if (rec && member_find_unlocked(rec, u) < 0)
+                    member_add_unlocked(rec, u);
             }
         }
+        fclose(m);
     }
 
-    fclose(f);
-    return 0;
+    pthread_mutex_unlock(&groups_mutex);
+    return GROUP_OK;
 }
 
-static int is_group_member(int group_id, const char *username)
+int groups_exists(int group_id)
+{
+    pthread_mutex_lock(&groups_mutex);
+    int found = group_find_unlocked(group_id) != NULL;
+    pthread_mutex_unlock(&groups_mutex);
+    return found;
+}
+
+int groups_get_name(int group_id, char *out, size_t cap)
 {
-    FILE *f = fopen(GROUP_MEMBERS_DB_PATH, "r");
-    if (!f)
+    pthread_mutex_lock(&groups_mutex);
+    GroupRec *g = group_find_unlocked(group_id);
+    if (g)
+        snprintf(out, cap, "%s", g->name);
+    pthread_mutex_unlock(&groups_mutex);
+    return g != NULL;
+}
+
+int groups_is_member_id(int user_id, int group_id)
+{
+    char username[64];
+    if (!get_username_by_id(user_id, username, sizeof(username)))
         return 0;
 
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f))
-    {
-        int gid;
-        char u[64];
+    pthread_mutex_lock(&groups_mutex);
+    int member = is_group_member(group_id, username);
+    pthread_mutex_unlock(&groups_mutex);
+    return member;
+}
 
-        if (sscanf(line, "%d|%63s", &gid, u) == 2)
+int groups_get_member_ids(int group_id, int *out_ids, int max_ids)
+{
+    pthread_mutex_lock(&groups_mutex);
+
+    GroupRec *g = group_find_unlocked(group_id);
+    int count = 0;
+    if (g)
+    {
+        for (int i = 0; i < g->member_count && count < max_ids; i++)
         {
-            if (gid == group_id && strcmp(u, username) == 0)
-            {
-                fclose(f);
-                return 1;
-            }
+            int uid = accounts_get_user_id(g->members[i]);
+            if (uid > 0)
+                out_ids[count++] = uid;
         }
     }
 
-    fclose(f);
-    return 0;
+    pthread_mutex_unlock(&groups_mutex);
+    return count;
 }
 
-/* ===== Public APIs ===== */
-
 int groups_create(int owner_user_id,
                   const char *group_name,
                   int *out_group_id)
@@ -140,6 +290,10 @@ int groups_create(int owner_user_id,
     pthread_mutex_lock(&groups_mutex);
 
     int gid = (int)time(NULL); // simple unique id
+    // Nhiều group tạo trong cùng 1 giây sẽ trùng id => dò tới id trống
+    // (cache cho phép check tồn tại O(1)).
+    while (group_find_unlocked(gid))
+        gid++;
 
     FILE *g = fopen(GROUPS_DB_PATH, "a");
     if (!g)
@@ -159,6 +313,11 @@ int groups_create(int owner_user_id,
         fclose(m);
     }
 
+    // Cập nhật cache: group mới + owner là member đầu tiên
+    GroupRec *rec = group_add_unlocked(gid, group_name, owner);
+    if (rec)
+        member_add_unlocked(rec, owner);
+
     pthread_mutex_unlock(&groups_mutex);
 
     if (out_group_id)
@@ -173,34 +332,21 @@ int groups_list(int user_id, char *out, size_t cap)
     if (!get_username_by_id(user_id, username, sizeof(username)))
         return GROUP_ERR_INTERNAL;
 
-    FILE *m = fopen(GROUP_MEMBERS_DB_PATH, "r");
-    if (!m)
-    {
-        out[0] = 0;
-        return GROUP_OK;
-    }
+    pthread_mutex_lock(&groups_mutex);
 
     out[0] = 0;
-    char line[LINE_MAX];
-
-    while (fgets(line, sizeof(line), m))
+    for (int s = 0; s < g_group_count; s++)
     {
-        int gid;
-        char u[64];
-
-        if (sscanf(line, "%d|%63s", &gid, u) == 2)
+        if (member_find_unlocked(&g_groups[s], username) >= 0)
         {
-            if (strcmp(u, username) == 0)
-            {
-                char buf[32];
-                snprintf(buf, sizeof(buf), "%d,", gid);
-                if (strlen(out) + strlen(buf) < cap)
-                    strcat(out, buf);
-            }
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%d,", g_groups[s].gid);
+            if (strlen(out) + strlen(buf) < cap)
+                strcat(out, buf);
         }
     }
 
-    fclose(m);
+    pthread_mutex_unlock(&groups_mutex);
     return GROUP_OK;
 }
 
@@ -219,35 +365,18 @@ int groups_list_members(int user_id, int group_id, char *out, size_t cap)
         return GROUP_ERR_PERMISSION;
     }
 
-    FILE *m = fopen(GROUP_MEMBERS_DB_PATH, "r");
-    if (!m)
-    {
-        pthread_mutex_unlock(&groups_mutex);
-        return GROUP_ERR_INTERNAL;
-    }
-
+    GroupRec *g = group_find_unlocked(group_id);
     out[0] = 0;
-    char line[LINE_MAX];
 
-    while (fgets(line, sizeof(line), m))
+    for (int i = 0; g && i < g->member_count; i++)
     {
-        int gid;
-        char u[64];
-
-        if (sscanf(line, "%d|%63s", &gid, u) == 2)
+        if (strlen(out) + strlen(g->members[i]) + 2 < cap)
         {
-            if (gid == group_id)
-            {
-                if (strlen(out) + strlen(u) + 2 < cap)
-                {
-                    strcat(out, u);
-                    strcat(out, ",");
-                }
-            }
+            strcat(out, g->members[i]);
+            strcat(out, ",");
         }
     }
 
-    fclose(m);
     pthread_mutex_unlock(&groups_mutex);
 
     /* Remove trailing comma */
@@ -296,39 +425,29 @@ int groups_add_member(int owner_user_id, int group_id, const char *username)
     fprintf(m, "%d|%s\n", group_id, username);
     fclose(m);
 
+    GroupRec *g = group_find_unlocked(group_id);
+    if (g)
+        member_add_unlocked(g, username);
+
     pthread_mutex_unlock(&groups_mutex);
     return GROUP_OK;
 }
 
-int groups_remove_member(int owner_user_id,
-                         int group_id,
-                         const char *username)
+/*
+ * remove_member_from_file
+ * - Rewrite group_members.db bỏ dòng (group_id, username).
+ * - Gọi khi đang giữ groups_mutex. Return 1 nếu có xóa, 0 nếu không thấy,
+ *   -1 nếu lỗi file.
+ */
+static int remove_member_from_file(int group_id, const char *username)
 {
-    char owner[64];
-
-    if (!get_username_by_id(owner_user_id, owner, sizeof(owner)))
-        return GROUP_ERR_INTERNAL;
-
-    pthread_mutex_lock(&groups_mutex);
-
-    if (!is_group_owner(group_id, owner)) {
-        pthread_mutex_unlock(&groups_mutex);
-        return GROUP_ERR_PERMISSION;
-    }
-
-    if (!is_group_member(group_id, username)) {
-        pthread_mutex_unlock(&groups_mutex);
-        return GROUP_ERR_NOT_FOUND;
-    }
-
     FILE *in = fopen(GROUP_MEMBERS_DB_PATH, "r");
     FILE *out = fopen(GROUP_MEMBERS_DB_PATH ".tmp", "w");
 
     if (!in || !out) {
         if (in) fclose(in);
         if (out) fclose(out);
-        pthread_mutex_unlock(&groups_mutex);
-        return GROUP_ERR_INTERNAL;
+        return -1;
     }
 
     char line[LINE_MAX];
@@ -352,11 +471,45 @@ int groups_remove_member(int owner_user_id,
 
     if (!removed) {
         remove(GROUP_MEMBERS_DB_PATH ".tmp");
+        return 0;
+    }
+
+    rename(GROUP_MEMBERS_DB_PATH ".tmp", GROUP_MEMBERS_DB_PATH);
+    return 1;
+}
+
+int groups_remove_member(int owner_user_id,
+                         int group_id,
+                         const char *username)
+{
+    char owner[64];
+
+    if (!get_username_by_id(owner_user_id, owner, sizeof(owner)))
+        return GROUP_ERR_INTERNAL;
+
+    pthread_mutex_lock(&groups_mutex);
+
+    if (!is_group_owner(group_id, owner)) {
+        pthread_mutex_unlock(&groups_mutex);
+        return GROUP_ERR_PERMISSION;
+    }
+
+    if (!is_group_member(group_id, username)) {
         pthread_mutex_unlock(&groups_mutex);
         return GROUP_ERR_NOT_FOUND;
     }
 
-    rename(GROUP_MEMBERS_DB_PATH ".tmp", GROUP_MEMBERS_DB_PATH);
+    int rc = remove_member_from_file(group_id, username);
+    if (rc <= 0) {
+        pthread_mutex_unlock(&groups_mutex);
+        return rc == 0 ? GROUP_ERR_NOT_FOUND : GROUP_ERR_INTERNAL;
+    }
+
+    GroupRec *g = group_find_unlocked(group_id);
+    int pos = g ? member_find_unlocked(g, username) : -1;
+    if (pos >= 0)
+        member_remove_unlocked(g, pos);
+
     pthread_mutex_unlock(&groups_mutex);
     return GROUP_OK;
 }
@@ -380,42 +533,17 @@ int groups_leave(int user_id, int group_id)
         return GROUP_ERR_NOT_FOUND;
     }
 
-    FILE *in = fopen(GROUP_MEMBERS_DB_PATH, "r");
-    FILE *out = fopen(GROUP_MEMBERS_DB_PATH ".tmp", "w");
-
-    if (!in || !out) {
-        if (in) fclose(in);
-        if (out) fclose(out);
+    int rc = remove_member_from_file(group_id, username);
+    if (rc <= 0) {
         pthread_mutex_unlock(&groups_mutex);
-        return GROUP_ERR_INTERNAL;
+        return rc == 0 ? GROUP_ERR_NOT_FOUND : GROUP_ERR_INTERNAL;
     }
 
-    char line[LINE_MAX];
-    int removed = 0;
-
-    while (fgets(line, sizeof(line), in)) {
-        int gid;
-        char u[64];
+    GroupRec *g = group_find_unlocked(group_id);
+    int pos = g ? member_find_unlocked(g, username) : -1;
+    if (pos >= 0)
+        member_remove_unlocked(g, pos);
 
-        if (sscanf(line, "%d|%63s", &gid, u) == 2) {
-            if (gid == group_id && strcmp(u, username) == 0) {
-                removed = 1;
-                continue;
-            }
-        }
-        fputs(line, out);
-    }
-
-    fclose(in);
-    fclose(out);
-
-    if (!removed) {
-        remove(GROUP_MEMBERS_DB_PATH ".tmp");
-        pthread_mutex_unlock(&groups_mutex);
-        return GROUP_ERR_NOT_FOUND;
-    }
-
-    rename(GROUP_MEMBERS_DB_PATH ".tmp", GROUP_MEMBERS_DB_PATH);
     pthread_mutex_unlock(&groups_mutex);
     return GROUP_OK;
 }
@@ -10,6 +10,15 @@
 #define GROUP_ERR_INTERNAL 4
 #define GROUP_ERR_SELF 5
 
+// Load cache group + membership từ file vào bộ nhớ (gọi 1 lần khi start).
+int groups_init(void);
+
+// Lookup trên cache (dùng cho cả group_messages.c, không re-parse file).
+int groups_exists(int group_id);
+int groups_get_name(int group_id, char *out, size_t cap);
+int groups_is_member_id(int user_id, int group_id);
+int groups_get_member_ids(int group_id, int *out_ids, int max_ids);
+
 int groups_create(int owner_user_id, const char *group_name, int *out_group_id);
 int groups_list(int user_id, char *out, size_t cap);
 int groups_add_member(int owner_user_id, int group_id, const char *username);
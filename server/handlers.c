@@ -14,6 +14,8 @@
 #include "groups.h"
 #include "group_messages.h"
 #include "logger.h"
+#include "presence.h"
+#include "stats.h"
 
 /*
  * server/handlers.c
@@ -84,1399 +86,1690 @@ static void send_simple_err(int sock, const char *rid, int code, const char *msg
     proto_send_err(sock, rid && rid[0] ? rid : "0", code, msg);
 }
 
-/*
- * handle_request
- * - Entry point xử lý 1 request của client trong server thread.
- * - Luôn cố gắng trả response (OK/ERR) theo đúng req_id để client match được.
- * - Khi thêm verb mới: parse payload bằng kv_get(), kiểm tra auth bằng sessions_validate().
- *
- * Return:
- * - 0  : xử lý xong (kể cả có lỗi nghiệp vụ), giữ connection
- * - -1 : cần đóng connection (bad_request hoặc DISCONNECT)
- */
-int handle_request(ServerCtx *ctx, const char *line)
+// Request có stream=1 => response trả dạng OK-PART/OK-END (xem protocol.h)
+// thay vì 1 frame OK qua buffer cố định. Opt-in per request.
+static int wants_stream(const char *payload)
 {
-    ProtoMsg msg;
-    if (proto_parse_line(line, &msg) != 0)
+    char v[8] = {0};
+    kv_get(payload, "stream", v, sizeof(v));
+    return v[0] == '1' && v[1] == 0;
+}
+// ============ Per-verb handlers ============
+
+static int handle_ping(ServerCtx *ctx, ProtoMsg *msg)
+{
+    proto_send_ok(ctx->client_sock, msg->req_id, "pong=1");
+    return 0;
+}
+
+static int handle_register(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char username[64], password[128], email[128];
+    if (!kv_get(msg->payload, "username", username, sizeof(username)) ||
+        !kv_get(msg->payload, "password", password, sizeof(password)) ||
+        !kv_get(msg->payload, "email", email, sizeof(email)))
     {
-        send_simple_err(ctx->client_sock, "0", 400, "bad_request");
-        return -1;
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
     }
 
-    // Lưu ý: handle_request nên luôn trả response theo req_id để client match được.
-    // PING
-    if (strcmp(msg.verb, "PING") == 0)
+    int user_id = 0;
+    int rc = accounts_register(username, password, email, &user_id);
+
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+
+    if (rc == ACC_OK)
     {
-        proto_send_ok(ctx->client_sock, msg.req_id, "pong=1");
-        proto_free(&msg);
-        return 0;
+        char payload[64];
+        snprintf(payload, sizeof(payload), "user_id=%d", user_id);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
     }
+    else if (rc == ACC_ERR_EXISTS)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 409, "username_exists");
+    }
+    else if (rc == ACC_ERR_INVALID)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "invalid_fields");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
+
+    return 0;
+}
 
-    // REGISTER
-    if (strcmp(msg.verb, "REGISTER") == 0)
+static int handle_login(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char username[64], password[128];
+    if (!kv_get(msg->payload, "username", username, sizeof(username)) ||
+        !kv_get(msg->payload, "password", password, sizeof(password)))
     {
-        char username[64], password[128], email[128];
-        if (!kv_get(msg.payload, "username", username, sizeof(username)) ||
-            !kv_get(msg.payload, "password", password, sizeof(password)) ||
-            !kv_get(msg.payload, "email", email, sizeof(email)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        int user_id = 0;
-        int rc = accounts_register(username, password, email, &user_id);
+    int user_id = 0;
+    int rc = accounts_authenticate(username, password, &user_id);
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        if (rc == ACC_OK)
-        {
-            char payload[64];
-            snprintf(payload, sizeof(payload), "user_id=%d", user_id);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == ACC_ERR_EXISTS)
+    if (rc == ACC_OK)
+    {
+        char token[SESS_TOKEN_LEN + 1];
+        int sr = sessions_create(user_id, ctx->client_sock, token);
+        if (sr == SESS_OK)
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 409, "username_exists");
+            char payload[128];
+            snprintf(payload, sizeof(payload), "token=%s user_id=%d", token, user_id);
+            proto_send_ok(ctx->client_sock, msg->req_id, payload);
         }
-        else if (rc == ACC_ERR_INVALID)
+        else if (sr == SESS_ERR_ALREADY)
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "invalid_fields");
+            send_simple_err(ctx->client_sock, msg->req_id, 409, "already_logged_in");
         }
         else
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
+            send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
         }
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_credentials");
+    }
+
+    return 0;
+}
 
-        proto_free(&msg);
+static int handle_logout(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // LOGIN
-    if (strcmp(msg.verb, "LOGIN") == 0)
-    {
-        char username[64], password[128];
-        if (!kv_get(msg.payload, "username", username, sizeof(username)) ||
-            !kv_get(msg.payload, "password", password, sizeof(password)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    int rc = sessions_destroy(token);
 
-        int user_id = 0;
-        int rc = accounts_authenticate(username, password, &user_id);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    if (rc == SESS_OK)
+    {
+        proto_send_ok(ctx->client_sock, msg->req_id, "ok=1");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+    }
 
-        if (rc == ACC_OK)
-        {
-            char token[SESS_TOKEN_LEN + 1];
-            int sr = sessions_create(user_id, ctx->client_sock, token);
-            if (sr == SESS_OK)
-            {
-                char payload[128];
-                snprintf(payload, sizeof(payload), "token=%s user_id=%d", token, user_id);
-                proto_send_ok(ctx->client_sock, msg.req_id, payload);
-            }
-            else if (sr == SESS_ERR_ALREADY)
-            {
-                send_simple_err(ctx->client_sock, msg.req_id, 409, "already_logged_in");
-            }
-            else
-            {
-                send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-            }
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_credentials");
-        }
+    return 0;
+}
 
-        proto_free(&msg);
+static int handle_whoami(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // LOGOUT
-    if (strcmp(msg.verb, "LOGOUT") == 0)
-    {
-        char token[128];
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    int user_id = 0;
+    int rc = sessions_validate(token, &user_id);
 
-        int rc = sessions_destroy(token);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    if (rc == SESS_OK)
+    {
+        char payload[64];
+        snprintf(payload, sizeof(payload), "user_id=%d", user_id);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+    }
 
-        if (rc == SESS_OK)
-        {
-            proto_send_ok(ctx->client_sock, msg.req_id, "ok=1");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-        }
+    return 0;
+}
 
-        proto_free(&msg);
-        return 0;
-    }
+static int handle_friend_invite(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], to[64];
 
-    // WHOAMI
-    if (strcmp(msg.verb, "WHOAMI") == 0)
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "username", to, sizeof(to)))
     {
-        char token[128];
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
-
-        int user_id = 0;
-        int rc = sessions_validate(token, &user_id);
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    // 2. Validate session
+    int from_user_id = 0;
+    int rc = sessions_validate(token, &from_user_id);
 
-        if (rc == SESS_OK)
-        {
-            char payload[64];
-            snprintf(payload, sizeof(payload), "user_id=%d", user_id);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-        }
+    // log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        proto_free(&msg);
+    if (rc != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
         return 0;
     }
 
-    // FRIEND_INVITE
-    if (strcmp(msg.verb, "FRIEND_INVITE") == 0)
-    {
-        char token[128], to[64];
+    // 3. Send unvitation
+    int fr = friends_send_invite(from_user_id, to);
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "username", to, sizeof(to)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, fr, safe_payload(msg->payload));
 
-        // 2. Validate session
-        int from_user_id = 0;
-        int rc = sessions_validate(token, &from_user_id);
+    if (fr == FRIEND_OK)
+    {
+        char payload[128];
+        snprintf(payload, sizeof(payload), "username=%s status=pending", to);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (fr == FRIEND_ERR_SELF)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "cannot_invite_self");
+    }
+    else if (fr == FRIEND_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "user_not_found");
+    }
+    else if (fr == FRIEND_ERR_EXISTS)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 409, "already_friend_or_pending");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        // log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    return 0;
+}
 
-        if (rc != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+static int handle_friend_accept(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], from[64];
 
-        // 3. Send unvitation
-        int fr = friends_send_invite(from_user_id, to);
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "username", from, sizeof(from)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, fr, safe_payload(msg.payload));
+    // 2. Validate session
+    int to_user_id = 0;
+    int rc = sessions_validate(token, &to_user_id);
 
-        if (fr == FRIEND_OK)
-        {
-            char payload[128];
-            snprintf(payload, sizeof(payload), "username=%s status=pending", to);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (fr == FRIEND_ERR_SELF)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "cannot_invite_self");
-        }
-        else if (fr == FRIEND_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "user_not_found");
-        }
-        else if (fr == FRIEND_ERR_EXISTS)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 409, "already_friend_or_pending");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+    // log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        proto_free(&msg);
+    if (rc != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
         return 0;
     }
 
-    // FRIEND_ACCEPT
-    if (strcmp(msg.verb, "FRIEND_ACCEPT") == 0)
-    {
-        char token[128], from[64];
+    // 3. Accept invite
+    int fr = friends_accept_invite(to_user_id, from);
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "username", from, sizeof(from)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, fr, safe_payload(msg->payload));
 
-        // 2. Validate session
-        int to_user_id = 0;
-        int rc = sessions_validate(token, &to_user_id);
+    if (fr == FRIEND_OK)
+    {
+        char payload[128];
+        snprintf(payload, sizeof(payload), "username=%s status=accepted", from);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (fr == FRIEND_ERR_SELF)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "cannot_accept_self");
+    }
+    else if (fr == FRIEND_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "invite_not_found");
+    }
+    else if (fr == FRIEND_ERR_EXISTS)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 409, "already_friends");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        // log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    return 0;
+}
 
-        if (rc != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+static int handle_friend_reject(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], from[64];
 
-        // 3. Accept invite
-        int fr = friends_accept_invite(to_user_id, from);
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "username", from, sizeof(from)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, fr, safe_payload(msg.payload));
+    // 2. Validate session
+    int to_user_id = 0;
+    int rc = sessions_validate(token, &to_user_id);
 
-        if (fr == FRIEND_OK)
-        {
-            char payload[128];
-            snprintf(payload, sizeof(payload), "username=%s status=accepted", from);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (fr == FRIEND_ERR_SELF)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "cannot_accept_self");
-        }
-        else if (fr == FRIEND_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "invite_not_found");
-        }
-        else if (fr == FRIEND_ERR_EXISTS)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 409, "already_friends");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+    // log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        proto_free(&msg);
+    if (rc != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
         return 0;
     }
 
-    // FRIEND_REJECT
-    if (strcmp(msg.verb, "FRIEND_REJECT") == 0)
-    {
-        char token[128], from[64];
+    // 3. Reject invite
+    int fr = friends_reject_invite(to_user_id, from);
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "username", from, sizeof(from)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, fr, safe_payload(msg->payload));
 
-        // 2. Validate session
-        int to_user_id = 0;
-        int rc = sessions_validate(token, &to_user_id);
+    if (fr == FRIEND_OK)
+    {
+        char payload[128];
+        snprintf(payload, sizeof(payload), "username=%s status=rejected", from);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (fr == FRIEND_ERR_SELF)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "cannot_reject_self");
+    }
+    else if (fr == FRIEND_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "invite_not_found");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        // log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    return 0;
+}
 
-        if (rc != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+static int handle_friend_pending(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        // 3. Reject invite
-        int fr = friends_reject_invite(to_user_id, from);
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, fr, safe_payload(msg.payload));
+    // 2. Validate session
+    int user_id = 0;
+    int rc = sessions_validate(token, &user_id);
 
-        if (fr == FRIEND_OK)
-        {
-            char payload[128];
-            snprintf(payload, sizeof(payload), "username=%s status=rejected", from);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (fr == FRIEND_ERR_SELF)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "cannot_reject_self");
-        }
-        else if (fr == FRIEND_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "invite_not_found");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+    // log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        proto_free(&msg);
+    if (rc != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
         return 0;
     }
 
-    // FRIEND_PENDING
-    if (strcmp(msg.verb, "FRIEND_PENDING") == 0)
-    {
-        char token[128];
+    // 3. Get pending friends
+    char list[512];
+    int fr = friends_pending(user_id, list, sizeof(list));
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, fr, safe_payload(msg->payload));
 
-        // 2. Validate session
-        int user_id = 0;
-        int rc = sessions_validate(token, &user_id);
+    if (fr != FRIEND_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+        return 0;
+    }
 
-        // log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    // 4. Return OK (even if empty)
+    char payload[600];
+    snprintf(payload, sizeof(payload), "username=%s", list);
+    proto_send_ok(ctx->client_sock, msg->req_id, payload);
 
-        if (rc != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    return 0;
+}
 
-        // 3. Get pending friends
-        char list[512];
-        int fr = friends_pending(user_id, list, sizeof(list));
+static int handle_friend_list(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, fr, safe_payload(msg.payload));
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        if (fr != FRIEND_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-            proto_free(&msg);
-            return 0;
-        }
+    // 2. Validate session
+    int user_id = 0;
+    int rc = sessions_validate(token, &user_id);
 
-        // 4. Return OK (even if empty)
-        char payload[600];
-        snprintf(payload, sizeof(payload), "username=%s", list);
-        proto_send_ok(ctx->client_sock, msg.req_id, payload);
+    // log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        proto_free(&msg);
+    if (rc != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
         return 0;
     }
 
-    // FRIEND_LIST
-    if (strcmp(msg.verb, "FRIEND_LIST") == 0)
+    // stream=1: đẩy từng friend thành OK-PART, không qua buffer 512B
+    // (lỗi của producer chỉ xảy ra trước khi emit nên ERR vẫn gửi được).
+    if (wants_stream(msg->payload))
     {
-        char token[128];
+        ProtoStream st;
+        proto_stream_begin(&st, ctx->client_sock, msg->req_id);
+        int src = friends_list_emit(user_id, proto_stream_emit, &st);
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
+        log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, src, safe_payload(msg->payload));
+
+        if (src != FRIEND_OK)
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
+            send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
             return 0;
         }
+        proto_stream_end(&st);
+        return 0;
+    }
 
-        // 2. Validate session
-        int user_id = 0;
-        int rc = sessions_validate(token, &user_id);
-
-        // log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    // 3. Get friends list
+    char list[512];
+    int fr = friends_list(user_id, list, sizeof(list));
 
-        if (rc != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, fr, safe_payload(msg->payload));
 
-        // 3. Get friends list
-        char list[512];
-        int fr = friends_list(user_id, list, sizeof(list));
+    if (fr != FRIEND_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+        return 0;
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, fr, safe_payload(msg.payload));
+    // 4. Return OK (even if empty)
+    char payload[600];
+    snprintf(payload, sizeof(payload), "username=%s", list);
+    proto_send_ok(ctx->client_sock, msg->req_id, payload);
 
-        if (fr != FRIEND_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-            proto_free(&msg);
-            return 0;
-        }
+    return 0;
+}
 
-        // 4. Return OK (even if empty)
-        char payload[600];
-        snprintf(payload, sizeof(payload), "username=%s", list);
-        proto_send_ok(ctx->client_sock, msg.req_id, payload);
+static int handle_friend_delete(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], friend[64];
 
-        proto_free(&msg);
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "username", friend, sizeof(friend)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // FRIEND_DELETE
-    if (strcmp(msg.verb, "FRIEND_DELETE") == 0)
-    {
-        char token[128], friend[64];
-
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "username", friend, sizeof(friend)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    // 2. Validate session
+    int user_id = 0;
+    int rc = sessions_validate(token, &user_id);
 
-        // 2. Validate session
-        int user_id = 0;
-        int rc = sessions_validate(token, &user_id);
+    // log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        // log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    if (rc != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        if (rc != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    // 3. Delete friend
+    int fr = friends_delete(user_id, friend);
 
-        // 3. Delete friend
-        int fr = friends_delete(user_id, friend);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, fr, safe_payload(msg->payload));
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, fr, safe_payload(msg.payload));
+    if (fr == FRIEND_OK)
+    {
+        char payload[128];
+        snprintf(payload, sizeof(payload), "username=%s status=deleted", friend);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (fr == FRIEND_ERR_SELF)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "cannot_delete_self");
+    }
+    else if (fr == FRIEND_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "friend_not_found");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        if (fr == FRIEND_OK)
-        {
-            char payload[128];
-            snprintf(payload, sizeof(payload), "username=%s status=deleted", friend);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (fr == FRIEND_ERR_SELF)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "cannot_delete_self");
-        }
-        else if (fr == FRIEND_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "friend_not_found");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+    return 0;
+}
+
+static int handle_group_create(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], name[64];
 
-        proto_free(&msg);
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "name", name, sizeof(name)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // GROUP CREATE
-    if (strcmp(msg.verb, "GROUP_CREATE") == 0)
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128], name[64];
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "name", name, sizeof(name)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    int group_id = 0;
+    int rc = groups_create(user_id, name, &group_id);
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        int group_id = 0;
-        int rc = groups_create(user_id, name, &group_id);
+    if (rc == GROUP_OK)
+    {
+        char payload[128];
+        snprintf(payload, sizeof(payload),
+                 "group_id=%d name=%s",
+                 group_id, name);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    return 0;
+}
 
-        if (rc == GROUP_OK)
-        {
-            char payload[128];
-            snprintf(payload, sizeof(payload),
-                     "group_id=%d name=%s",
-                     group_id, name);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+static int handle_group_list(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+    char groups[1024];
+    char payload[1100];
 
-        proto_free(&msg);
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // GROUP_LIST
-    if (strcmp(msg.verb, "GROUP_LIST") == 0)
+    // 2. Validate session
+    int user_id = 0;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128];
-        char groups[1024];
-        char payload[1100];
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    // 3. Query groups
+    int gr = groups_list(user_id, groups, sizeof(groups));
 
-        // 2. Validate session
-        int user_id = 0;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, gr, safe_payload(msg->payload));
 
-        // 3. Query groups
-        int gr = groups_list(user_id, groups, sizeof(groups));
+    if (gr != GROUP_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+        return 0;
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, gr, safe_payload(msg.payload));
+    // 4. Build payload
+    snprintf(payload, sizeof(payload), "groups=%s", groups);
 
-        if (gr != GROUP_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-            proto_free(&msg);
-            return 0;
-        }
+    proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    return 0;
+}
 
-        // 4. Build payload
-        snprintf(payload, sizeof(payload), "groups=%s", groups);
+static int handle_group_members(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+    char group_id_str[32];
+    char out[2048];
 
-        proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        proto_free(&msg);
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", group_id_str, sizeof(group_id_str)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
-    // GROUP MEMBERS
-    if (strcmp(msg.verb, "GROUP_MEMBERS") == 0)
+
+    int group_id = atoi(group_id_str);
+    if (group_id <= 0)
     {
-        char token[128];
-        char group_id_str[32];
-        char out[2048];
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "invalid_group_id");
+        return 0;
+    }
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", group_id_str, sizeof(group_id_str)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    // 2. Validate session
+    int user_id = 0;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        int group_id = atoi(group_id_str);
-        if (group_id <= 0)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "invalid_group_id");
-            proto_free(&msg);
-            return 0;
-        }
+    // 3. List members
+    out[0] = '\0';
+    int rc = groups_list_members(user_id, group_id, out, sizeof(out));
 
-        // 2. Validate session
-        int user_id = 0;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        // 3. List members
-        out[0] = '\0';
-        int rc = groups_list_members(user_id, group_id, out, sizeof(out));
+    if (rc == GROUP_OK)
+    {
+        char payload[2048];
+        snprintf(payload, sizeof(payload),
+                 "members=%s", out[0] ? out : "");
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == GROUP_ERR_PERMISSION)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_member");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    return 0;
+}
 
-        if (rc == GROUP_OK)
-        {
-            char payload[2048];
-            snprintf(payload, sizeof(payload),
-                     "members=%s", out[0] ? out : "");
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == GROUP_ERR_PERMISSION)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 403, "not_group_member");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+static int handle_group_add(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+    char group_id_str[32];
+    char username[64];
+
+    // 1. Parse payload
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", group_id_str, sizeof(group_id_str)) ||
+        !kv_get(msg->payload, "username", username, sizeof(username)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        proto_free(&msg);
+    int group_id = atoi(group_id_str);
+    if (group_id <= 0)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "invalid_group_id");
         return 0;
     }
 
-    // GROUP ADD MEMBER
-    if (strcmp(msg.verb, "GROUP_ADD") == 0)
+    // 2. Validate session
+    int user_id = 0;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128];
-        char group_id_str[32];
-        char username[64];
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        // 1. Parse payload
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", group_id_str, sizeof(group_id_str)) ||
-            !kv_get(msg.payload, "username", username, sizeof(username)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    // 3. Add member
+    int rc = groups_add_member(user_id, group_id, username);
 
-        int group_id = atoi(group_id_str);
-        if (group_id <= 0)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "invalid_group_id");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        // 2. Validate session
-        int user_id = 0;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    if (rc == GROUP_OK)
+    {
+        char payload[128];
+        snprintf(payload, sizeof(payload),
+                 "group_id=%d username=%s status=added",
+                 group_id, username);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == GROUP_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "user_not_found");
+    }
+    else if (rc == GROUP_ERR_PERMISSION)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_owner");
+    }
+    else if (rc == GROUP_ERR_EXISTS)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 409, "already_member");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        // 3. Add member
-        int rc = groups_add_member(user_id, group_id, username);
+    return 0;
+}
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+static int handle_group_remove(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], username[64], gid_str[32];
 
-        if (rc == GROUP_OK)
-        {
-            char payload[128];
-            snprintf(payload, sizeof(payload),
-                     "group_id=%d username=%s status=added",
-                     group_id, username);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == GROUP_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "user_not_found");
-        }
-        else if (rc == GROUP_ERR_PERMISSION)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 403, "not_group_owner");
-        }
-        else if (rc == GROUP_ERR_EXISTS)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 409, "already_member");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", gid_str, sizeof(gid_str)) ||
+        !kv_get(msg->payload, "username", username, sizeof(username)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
+
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
+
+    int gid = atoi(gid_str);
+    
+    // Lấy user_id của người bị remove trước khi xóa (để kick khỏi chat mode)
+    int removed_user_id = accounts_get_user_id(username);
+    
+    int rc = groups_remove_member(user_id, gid, username);
+
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+
+    if (rc == GROUP_OK)
+    {
+        // Nếu user bị remove đang trong group chat mode của group này, kick họ ra
+        if (removed_user_id > 0 && sessions_is_in_group_chat(removed_user_id, gid)) {
+            // Gửi PUSH GM_KICKED cho user bị remove
+            int removed_sock = sessions_get_socket(removed_user_id);
+            if (removed_sock > 0) {
+                char kick_msg[256];
+                snprintf(kick_msg, sizeof(kick_msg),
+                         "PUSH GM_KICKED group_id=%d reason=removed_by_owner\r\n", gid);
+                proto_send_push(removed_sock, kick_msg, strlen(kick_msg));
+            }
+            // Clear group chat mode
+            sessions_set_chat_group(removed_user_id, 0);
         }
+        
+        char payload[128];
+        snprintf(payload, sizeof(payload),
+                 "group_id=%d username=%s status=removed",
+                 gid, username);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == GROUP_ERR_PERMISSION)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_owner");
+    }
+    else if (rc == GROUP_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "member_not_found");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        proto_free(&msg);
+    return 0;
+}
+
+static int handle_group_leave(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], gid_str[32];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", gid_str, sizeof(gid_str)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // GROUP REMOVE MEMBER (OWNER)
-    if (strcmp(msg.verb, "GROUP_REMOVE") == 0)
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128], username[64], gid_str[32];
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", gid_str, sizeof(gid_str)) ||
-            !kv_get(msg.payload, "username", username, sizeof(username)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    int gid = atoi(gid_str);
+    int rc = groups_leave(user_id, gid);
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
 
-        int gid = atoi(gid_str);
-        
-        // Lấy user_id của người bị remove trước khi xóa (để kick khỏi chat mode)
-        int removed_user_id = accounts_get_user_id(username);
+    if (rc == GROUP_OK)
+    {
+        // Nếu user đang trong group chat mode của group này, tự động thoát
+        if (sessions_is_in_group_chat(user_id, gid)) {
+            sessions_set_chat_group(user_id, 0);
+        }
         
-        int rc = groups_remove_member(user_id, gid, username);
+        char payload[64];
+        snprintf(payload, sizeof(payload),
+                 "group_id=%d status=left", gid);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == GROUP_ERR_SELF)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "owner_cannot_leave");
+    }
+    else if (rc == GROUP_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "not_group_member");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+    return 0;
+}
 
-        if (rc == GROUP_OK)
-        {
-            // Nếu user bị remove đang trong group chat mode của group này, kick họ ra
-            if (removed_user_id > 0 && sessions_is_in_group_chat(removed_user_id, gid)) {
-                // Gửi PUSH GM_KICKED cho user bị remove
-                int removed_sock = sessions_get_socket(removed_user_id);
-                if (removed_sock > 0) {
-                    char kick_msg[256];
-                    snprintf(kick_msg, sizeof(kick_msg),
-                             "PUSH GM_KICKED group_id=%d reason=removed_by_owner\r\n", gid);
-                    send(removed_sock, kick_msg, strlen(kick_msg), 0);
-                }
-                // Clear group chat mode
-                sessions_set_chat_group(removed_user_id, 0);
-            }
-            
-            char payload[128];
-            snprintf(payload, sizeof(payload),
-                     "group_id=%d username=%s status=removed",
-                     gid, username);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == GROUP_ERR_PERMISSION)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 403, "not_group_owner");
-        }
-        else if (rc == GROUP_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "member_not_found");
-        }
-        else
+static int handle_pm_chat_start(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], with_user[64];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "with", with_user, sizeof(with_user)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
+
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
+
+    // Lấy username của mình
+    char my_username[64];
+    if (!accounts_get_username(user_id, my_username, sizeof(my_username)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "internal_error");
+        return 0;
+    }
+
+    // Lấy user_id của partner
+    int partner_id = accounts_get_user_id(with_user);
+    if (partner_id < 0)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "user_not_found");
+        return 0;
+    }
+
+    // Không được chat với chính mình
+    if (partner_id == user_id)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "cannot_chat_with_yourself");
+        return 0;
+    }
+
+    // Set chat_partner để server biết push message tới ai
+    sessions_set_chat_partner(user_id, partner_id);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    // Thông báo cho partner nếu họ đang chat với mình
+    if (sessions_is_chatting_with(partner_id, user_id))
+    {
+        int partner_sock = sessions_get_socket(partner_id);
+        if (partner_sock > 0)
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
+            char push_msg[256];
+            snprintf(push_msg, sizeof(push_msg),
+                     "PUSH JOIN user=%s\r\n", my_username);
+            proto_send_push(partner_sock, push_msg, strlen(push_msg));
         }
+    }
 
-        proto_free(&msg);
+    // Đánh dấu messages là đã đọc
+    pm_mark_read(user_id, with_user);
+
+    // Lấy history gần đây
+    char history[8192] = {0};
+    pm_get_history(user_id, with_user, history, sizeof(history), 50, 0);
+
+    char payload[8400];
+    snprintf(payload, sizeof(payload), "with=%s me=%s history=%s",
+             with_user, my_username, history[0] ? history : "empty");
+    proto_send_ok(ctx->client_sock, msg->req_id, payload);
+
+    return 0;
+}
+
+static int handle_pm_chat_end(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // GROUP LEAVE (MEMBER)
-    if (strcmp(msg.verb, "GROUP_LEAVE") == 0)
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128], gid_str[32];
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", gid_str, sizeof(gid_str)))
+    // Lấy partner_id trước khi clear để mark_read và gửi thông báo
+    int partner_id = sessions_get_chat_partner(user_id);
+    if (partner_id > 0)
+    {
+        char partner_username[64];
+        if (accounts_get_username(partner_id, partner_username, sizeof(partner_username)))
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
+            // Đánh dấu tất cả tin nhắn đã đọc khi thoát chat
+            pm_mark_read(user_id, partner_username);
         }
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
+        // Thông báo cho partner nếu họ đang chat với mình
+        if (sessions_is_chatting_with(partner_id, user_id))
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
+            int partner_sock = sessions_get_socket(partner_id);
+            if (partner_sock > 0)
+            {
+                char my_username[64];
+                if (accounts_get_username(user_id, my_username, sizeof(my_username)))
+                {
+                    char push_msg[256];
+                    snprintf(push_msg, sizeof(push_msg),
+                             "PUSH LEAVE user=%s\r\n", my_username);
+                    proto_send_push(partner_sock, push_msg, strlen(push_msg));
+                }
+            }
         }
+    }
 
-        int gid = atoi(gid_str);
-        int rc = groups_leave(user_id, gid);
+    // Xóa chat_partner
+    sessions_set_chat_partner(user_id, 0);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    proto_send_ok(ctx->client_sock, msg->req_id, "status=chat_ended");
+    return 0;
+}
 
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
+static int handle_pm_send(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], to_user[64], content[4096];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "to", to_user, sizeof(to_user)) ||
+        !kv_get(msg->payload, "content", content, sizeof(content)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
+
+    int from_user_id;
+    if (sessions_validate(token, &from_user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
+
+    // Content đã được encode Base64 từ client
+    int msg_id = 0;
+    int rc = pm_send(from_user_id, to_user, content, &msg_id);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == PM_OK)
+    {
+        // Gửi OK cho sender
+        char payload[128];
+        snprintf(payload, sizeof(payload), "msg_id=%d to=%s status=sent", msg_id, to_user);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
 
-        if (rc == GROUP_OK)
+        // Push message tới recipient nếu họ đang trong chat mode với sender
+        int to_user_id = accounts_get_user_id(to_user);
+        if (to_user_id > 0 && sessions_is_chatting_with(to_user_id, from_user_id))
         {
-            // Nếu user đang trong group chat mode của group này, tự động thoát
-            if (sessions_is_in_group_chat(user_id, gid)) {
-                sessions_set_chat_group(user_id, 0);
+            int to_sock = sessions_get_socket(to_user_id);
+            if (to_sock > 0)
+            {
+                // Lấy username của sender
+                char from_username[64];
+                accounts_get_username(from_user_id, from_username, sizeof(from_username));
+
+                // Push message tới recipient
+                // Format: PUSH PM from=username content=base64 msg_id=N ts=timestamp
+                char push_msg[4500];
+                snprintf(push_msg, sizeof(push_msg),
+                         "PUSH PM from=%s content=%s msg_id=%d ts=%ld\r\n",
+                         from_username, content, msg_id, (long)time(NULL));
+                proto_send_push(to_sock, push_msg, strlen(push_msg));
             }
-            
-            char payload[64];
-            snprintf(payload, sizeof(payload),
-                     "group_id=%d status=left", gid);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == GROUP_ERR_SELF)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "owner_cannot_leave");
         }
-        else if (rc == GROUP_ERR_NOT_FOUND)
+        // Nếu recipient online nhưng KHÔNG trong chat mode: push notification
+        // gọn (không kèm content) cho client đã opt-in qua PM_NOTIFY_SUB —
+        // thay vì client phải poll PM_CONVERSATIONS.
+        else if (to_user_id > 0 && sessions_wants_pm_notify(to_user_id))
         {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "not_group_member");
+            int to_sock = sessions_get_socket(to_user_id);
+            if (to_sock > 0)
+            {
+                char from_username[64];
+                accounts_get_username(from_user_id, from_username, sizeof(from_username));
+
+                char push_msg[256];
+                snprintf(push_msg, sizeof(push_msg),
+                         "PUSH PM_UNREAD from=%s count=%d\r\n",
+                         from_username, pm_pending_count(to_user_id, from_user_id));
+                proto_send_push(to_sock, push_msg, strlen(push_msg));
+            }
         }
+    }
+    else if (rc == PM_ERR_SELF)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "cannot_send_to_self");
+    }
+    else if (rc == PM_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "user_not_found");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
+
+    return 0;
+}
+
+static int handle_pm_history(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], with_user[64], limit_str[16], before_str[16];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "with", with_user, sizeof(with_user)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
+
+    int limit = 50;
+    if (kv_get(msg->payload, "limit", limit_str, sizeof(limit_str)))
+    {
+        limit = atoi(limit_str);
+        if (limit <= 0 || limit > 100)
+            limit = 50;
+    }
+
+    // Cursor: before=<msg_id> => chỉ lấy message cũ hơn msg_id đó
+    int before = 0;
+    if (kv_get(msg->payload, "before", before_str, sizeof(before_str)))
+    {
+        before = atoi(before_str);
+        if (before < 0)
+            before = 0;
+    }
+
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
+
+    // stream=1: mỗi message 1 item qua OK-PART, bộ nhớ per-request không
+    // phụ thuộc kích thước history.
+    if (wants_stream(msg->payload))
+    {
+        ProtoStream st;
+        proto_stream_begin(&st, ctx->client_sock, msg->req_id);
+        int src = pm_get_history_emit(user_id, with_user, limit, before,
+                                      proto_stream_emit, &st);
+
+        log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, src, safe_payload(msg->payload));
+
+        if (src == PM_OK)
+            proto_stream_end(&st);
+        else if (src == PM_ERR_NOT_FOUND)
+            send_simple_err(ctx->client_sock, msg->req_id, 404, "user_not_found");
         else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+            send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+        return 0;
+    }
+
+    char history[8192] = {0};
+    int rc = pm_get_history(user_id, with_user, history, sizeof(history), limit, before);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == PM_OK)
+    {
+        char payload[8300];
+        snprintf(payload, sizeof(payload), "with=%s messages=%s", with_user,
+                 history[0] ? history : "empty");
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == PM_ERR_NOT_FOUND)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "user_not_found");
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
+
+    return 0;
+}
+
+static int handle_pm_conversations(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
+
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
+
+    // stream=1: mỗi conversation 1 item qua OK-PART
+    if (wants_stream(msg->payload))
+    {
+        ProtoStream st;
+        proto_stream_begin(&st, ctx->client_sock, msg->req_id);
+        int src = pm_get_conversations_emit(user_id, proto_stream_emit, &st);
+
+        log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, src, safe_payload(msg->payload));
+
+        if (src == PM_OK)
+            proto_stream_end(&st);
+        else
+            send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+        return 0;
+    }
+
+    char convos[2048] = {0};
+    int rc = pm_get_conversations(user_id, convos, sizeof(convos));
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == PM_OK)
+    {
+        char payload[2200];
+        snprintf(payload, sizeof(payload), "conversations=%s",
+                 convos[0] ? convos : "empty");
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
+
+    return 0;
+}
+
+static int handle_pm_notify_sub(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
+
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
+
+    // Opt-in nhận PUSH PM_UNREAD khi có PM tới mà không trong chat mode
+    sessions_set_pm_notify(user_id, 1);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    proto_send_ok(ctx->client_sock, msg->req_id, "subscribed=1");
+    return 0;
+}
+
+static int handle_pm_notify_unsub(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        proto_free(&msg);
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
         return 0;
     }
 
-    // ============ Private Messaging (Nhắn tin 1-1) ============
+    sessions_set_pm_notify(user_id, 0);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    proto_send_ok(ctx->client_sock, msg->req_id, "subscribed=0");
+    return 0;
+}
 
-    // PM_CHAT_START - Vào chat mode với user khác (để nhận real-time push)
-    if (strcmp(msg.verb, "PM_CHAT_START") == 0)
-    {
-        char token[128], with_user[64];
+static int handle_presence_sub(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "with", with_user, sizeof(with_user)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        // Lấy username của mình
-        char my_username[64];
-        if (!accounts_get_username(user_id, my_username, sizeof(my_username)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "internal_error");
-            proto_free(&msg);
-            return 0;
-        }
+    // Subscribe PUSH PRESENCE cho friend set hiện tại (thay cho việc
+    // re-poll FRIEND_LIST); friend mới kết bạn sau đó cần sub lại.
+    int watching = presence_subscribe(user_id);
+    if (watching < 0)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "internal_error");
+        return 0;
+    }
 
-        // Lấy user_id của partner
-        int partner_id = accounts_get_user_id(with_user);
-        if (partner_id < 0)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "user_not_found");
-            proto_free(&msg);
-            return 0;
-        }
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    char payload[64];
+    snprintf(payload, sizeof(payload), "subscribed=1 watching=%d", watching);
+    proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    return 0;
+}
 
-        // Không được chat với chính mình
-        if (partner_id == user_id)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "cannot_chat_with_yourself");
-            proto_free(&msg);
-            return 0;
-        }
+static int handle_presence_unsub(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        // Set chat_partner để server biết push message tới ai
-        sessions_set_chat_partner(user_id, partner_id);
-        log_event("rid=%s action=%s status=0 payload=' %s '", msg.req_id, msg.verb, safe_payload(msg.payload));
-        // Thông báo cho partner nếu họ đang chat với mình
-        if (sessions_is_chatting_with(partner_id, user_id))
-        {
-            int partner_sock = sessions_get_socket(partner_id);
-            if (partner_sock > 0)
-            {
-                char push_msg[256];
-                snprintf(push_msg, sizeof(push_msg),
-                         "PUSH JOIN user=%s\r\n", my_username);
-                send(partner_sock, push_msg, strlen(push_msg), 0);
-            }
-        }
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        // Đánh dấu messages là đã đọc
-        pm_mark_read(user_id, with_user);
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        // Lấy history gần đây
-        char history[8192] = {0};
-        pm_get_history(user_id, with_user, history, sizeof(history), 50);
+    presence_unsubscribe(user_id);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    proto_send_ok(ctx->client_sock, msg->req_id, "subscribed=0");
+    return 0;
+}
 
-        char payload[8400];
-        snprintf(payload, sizeof(payload), "with=%s me=%s history=%s",
-                 with_user, my_username, history[0] ? history : "empty");
-        proto_send_ok(ctx->client_sock, msg.req_id, payload);
+static int handle_pm_pending(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        proto_free(&msg);
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // PM_CHAT_END - Thoát khỏi chat mode
-    if (strcmp(msg.verb, "PM_CHAT_END") == 0)
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128];
-
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    // Drain queue notification tích lũy từ lúc đăng nhập / lần drain trước
+    // (vd. PM tới khi client đang bận); queue bị xóa sau khi trả về.
+    char pending[2048] = {0};
+    int rc = pm_pending_drain(user_id, pending, sizeof(pending));
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == PM_OK)
+    {
+        char payload[2200];
+        snprintf(payload, sizeof(payload), "pending=%s",
+                 pending[0] ? pending : "empty");
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        // Lấy partner_id trước khi clear để mark_read và gửi thông báo
-        int partner_id = sessions_get_chat_partner(user_id);
-        if (partner_id > 0)
-        {
-            char partner_username[64];
-            if (accounts_get_username(partner_id, partner_username, sizeof(partner_username)))
-            {
-                // Đánh dấu tất cả tin nhắn đã đọc khi thoát chat
-                pm_mark_read(user_id, partner_username);
-            }
+    return 0;
+}
 
-            // Thông báo cho partner nếu họ đang chat với mình
-            if (sessions_is_chatting_with(partner_id, user_id))
-            {
-                int partner_sock = sessions_get_socket(partner_id);
-                if (partner_sock > 0)
-                {
-                    char my_username[64];
-                    if (accounts_get_username(user_id, my_username, sizeof(my_username)))
-                    {
-                        char push_msg[256];
-                        snprintf(push_msg, sizeof(push_msg),
-                                 "PUSH LEAVE user=%s\r\n", my_username);
-                        send(partner_sock, push_msg, strlen(push_msg), 0);
-                    }
-                }
-            }
-        }
+static int handle_stats(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        // Xóa chat_partner
-        sessions_set_chat_partner(user_id, 0);
-        log_event("rid=%s action=%s status=0 payload=' %s '", msg.req_id, msg.verb, safe_payload(msg.payload));
-        proto_send_ok(ctx->client_sock, msg.req_id, "status=chat_ended");
-        proto_free(&msg);
+    if (!kv_get(msg->payload, "token", token, sizeof(token)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // PM_SEND - Gửi private message
-    if (strcmp(msg.verb, "PM_SEND") == 0)
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK)
     {
-        char token[128], to_user[64], content[4096];
-
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "to", to_user, sizeof(to_user)) ||
-            !kv_get(msg.payload, "content", content, sizeof(content)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
-
-        int from_user_id;
-        if (sessions_validate(token, &from_user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        // Content đã được encode Base64 từ client
-        int msg_id = 0;
-        int rc = pm_send(from_user_id, to_user, content, &msg_id);
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
-        if (rc == PM_OK)
-        {
-            // Gửi OK cho sender
-            char payload[128];
-            snprintf(payload, sizeof(payload), "msg_id=%d to=%s status=sent", msg_id, to_user);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
+    char payload[4096];
+    int rc = stats_format(payload, sizeof(payload));
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == 0)
+    {
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-            // Push message tới recipient nếu họ đang trong chat mode với sender
-            int to_user_id = accounts_get_user_id(to_user);
-            if (to_user_id > 0 && sessions_is_chatting_with(to_user_id, from_user_id))
-            {
-                int to_sock = sessions_get_socket(to_user_id);
-                if (to_sock > 0)
-                {
-                    // Lấy username của sender
-                    char from_username[64];
-                    accounts_get_username(from_user_id, from_username, sizeof(from_username));
+    return 0;
+}
 
-                    // Push message tới recipient
-                    // Format: PUSH PM from=username content=base64 msg_id=N ts=timestamp
-                    char push_msg[4500];
-                    snprintf(push_msg, sizeof(push_msg),
-                             "PUSH PM from=%s content=%s msg_id=%d ts=%ld\r\n",
-                             from_username, content, msg_id, (long)time(NULL));
-                    send(to_sock, push_msg, strlen(push_msg), 0);
-                }
-            }
-        }
-        else if (rc == PM_ERR_SELF)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 422, "cannot_send_to_self");
-        }
-        else if (rc == PM_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "user_not_found");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+static int handle_upgrade(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char mode[32];
 
-        proto_free(&msg);
+    if (!kv_get(msg->payload, "mode", mode, sizeof(mode)))
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // PM_HISTORY - Lấy history chat với user khác
-    if (strcmp(msg.verb, "PM_HISTORY") == 0)
+    // Hiện chỉ hỗ trợ mode=binary (length-prefixed frame 2 chiều).
+    if (strcmp(mode, "binary") != 0)
     {
-        char token[128], with_user[64], limit_str[16];
+        send_simple_err(ctx->client_sock, msg->req_id, 422, "unsupported_mode");
+        return 0;
+    }
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "with", with_user, sizeof(with_user)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    if (!ctx->framer)
+    {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+        return 0;
+    }
 
-        int limit = 50;
-        if (kv_get(msg.payload, "limit", limit_str, sizeof(limit_str)))
-        {
-            limit = atoi(limit_str);
-            if (limit <= 0 || limit > 100)
-                limit = 50;
-        }
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    // Response OK đi theo framing CŨ (CRLF) — client chờ OK rồi mới gửi frame
+    // binary đầu tiên (không được pipeline request qua điểm chuyển). OK được
+    // append vào output buffer của batch hiện tại nên đặt cờ binary ngay sau
+    // đây chỉ ảnh hưởng các frame TIẾP THEO.
+    proto_send_ok(ctx->client_sock, msg->req_id, "mode=binary");
+    framer_set_mode(ctx->framer, FRAMER_MODE_LENGTH);
+    proto_set_binary(ctx->client_sock, 1);
+    return 0;
+}
 
-        char history[8192] = {0};
-        int rc = pm_get_history(user_id, with_user, history, sizeof(history), limit);
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
-        if (rc == PM_OK)
-        {
-            char payload[8300];
-            snprintf(payload, sizeof(payload), "with=%s messages=%s", with_user,
-                     history[0] ? history : "empty");
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == PM_ERR_NOT_FOUND)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "user_not_found");
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+static int handle_disconnect(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
+    kv_get(msg->payload, "token", token, sizeof(token));
 
-        proto_free(&msg);
-        return 0;
+    int user_id;
+    if (token[0] && sessions_validate(token, &user_id) == SESS_OK)
+    {
+        sessions_destroy(token);
+        // Optional: log disconnect event
     }
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    proto_send_ok(ctx->client_sock, msg->req_id, "disconnected=1");
+    return -1; // Signal to close connection
+}
 
-    // PM_CONVERSATIONS - Liệt kê tất cả conversations
-    if (strcmp(msg.verb, "PM_CONVERSATIONS") == 0)
-    {
-        char token[128];
+static int handle_gm_chat_start(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], gid_str[32];
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)))
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", gid_str, sizeof(gid_str))) {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK)
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK) {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        char convos[2048] = {0};
-        int rc = pm_get_conversations(user_id, convos, sizeof(convos));
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
-        if (rc == PM_OK)
-        {
-            char payload[2200];
-            snprintf(payload, sizeof(payload), "conversations=%s",
-                     convos[0] ? convos : "empty");
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else
-        {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+    int group_id = atoi(gid_str);
 
-        proto_free(&msg);
+    // Kiểm tra user là member của group
+    if (!gm_is_member(user_id, group_id)) {
+        send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_member");
         return 0;
     }
 
-    // DISCONNECT - client chủ động ngắt kết nối / graceful disconnect
-    // Khác với LOGOUT: DISCONNECT hủy session VÀ đóng TCP connection
-    if (strcmp(msg.verb, "DISCONNECT") == 0)
-    {
-        char token[128];
-        kv_get(msg.payload, "token", token, sizeof(token));
-
-        int user_id;
-        if (token[0] && sessions_validate(token, &user_id) == SESS_OK)
-        {
-            sessions_destroy(token);
-            // Optional: log disconnect event
-        }
-        log_event("rid=%s action=%s status=0 payload=' %s '", msg.req_id, msg.verb, safe_payload(msg.payload));
-        proto_send_ok(ctx->client_sock, msg.req_id, "disconnected=1");
-        proto_free(&msg);
-        return -1; // Signal to close connection
+    // Lấy username của mình
+    char my_username[64];
+    if (!accounts_get_username(user_id, my_username, sizeof(my_username))) {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "internal_error");
+        return 0;
     }
 
-    // ============ Group Messaging (Nhắn tin nhóm) ============
+    // Lấy tên group
+    char group_name[64] = {0};
+    gm_get_group_name(group_id, group_name, sizeof(group_name));
 
-    // GM_CHAT_START - Vào group chat mode
-    if (strcmp(msg.verb, "GM_CHAT_START") == 0) {
-        char token[128], gid_str[32];
+    // Set chat group mode
+    sessions_set_chat_group(user_id, group_id);
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", gid_str, sizeof(gid_str))) {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    // Thông báo cho các members khác đang trong group chat (format 1 lần,
+    // snapshot socket trong 1 lần lock, gửi ngoài lock)
+    char push_msg[256];
+    int push_len = snprintf(push_msg, sizeof(push_msg),
+                            "PUSH GM_JOIN user=%s group_id=%d\r\n", my_username, group_id);
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK) {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
+    int socks[256];
+    int sock_count = sessions_get_group_chat_sockets(group_id, user_id, socks, 256);
+    for (int i = 0; i < sock_count; i++) {
+        if (socks[i] > 0) {
+            proto_send_push(socks[i], push_msg, (size_t)push_len);
         }
+    }
 
-        int group_id = atoi(gid_str);
+    // Lấy history
+    char history[8192] = {0};
+    gm_get_history(user_id, group_id, history, sizeof(history), 50, 0);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    char payload[8500];
+    snprintf(payload, sizeof(payload), "group_id=%d group_name=%s me=%s history=%s",
+             group_id, group_name[0] ? group_name : "unknown", 
+             my_username, history[0] ? history : "empty");
+    proto_send_ok(ctx->client_sock, msg->req_id, payload);
 
-        // Kiểm tra user là member của group
-        if (!gm_is_member(user_id, group_id)) {
-            send_simple_err(ctx->client_sock, msg.req_id, 403, "not_group_member");
-            proto_free(&msg);
-            return 0;
-        }
+    return 0;
+}
 
-        // Lấy username của mình
-        char my_username[64];
-        if (!accounts_get_username(user_id, my_username, sizeof(my_username))) {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "internal_error");
-            proto_free(&msg);
-            return 0;
-        }
+static int handle_gm_chat_end(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128];
 
-        // Lấy tên group
-        char group_name[64] = {0};
-        gm_get_group_name(group_id, group_name, sizeof(group_name));
+    if (!kv_get(msg->payload, "token", token, sizeof(token))) {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
+        return 0;
+    }
 
-        // Set chat group mode
-        sessions_set_chat_group(user_id, group_id);
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK) {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        // Thông báo cho các members khác đang trong group chat
-        int member_ids[100];
-        int member_count = sessions_get_users_in_group_chat(group_id, member_ids, 100);
-        for (int i = 0; i < member_count; i++) {
-            if (member_ids[i] != user_id) {
-                int sock = sessions_get_socket(member_ids[i]);
-                if (sock > 0) {
-                    char push_msg[256];
-                    snprintf(push_msg, sizeof(push_msg),
-                             "PUSH GM_JOIN user=%s group_id=%d\r\n", my_username, group_id);
-                    send(sock, push_msg, strlen(push_msg), 0);
+    int group_id = sessions_get_chat_group(user_id);
+    log_event("rid=%s action=%s status=0 payload=' %s '", msg->req_id, msg->verb, safe_payload(msg->payload));
+    if (group_id > 0) {
+        // Lấy username
+        char my_username[64];
+        if (accounts_get_username(user_id, my_username, sizeof(my_username))) {
+            // Thông báo cho các members khác đang trong group chat
+            char push_msg[256];
+            int push_len = snprintf(push_msg, sizeof(push_msg),
+                                    "PUSH GM_LEAVE user=%s group_id=%d\r\n", my_username, group_id);
+
+            int socks[256];
+            int sock_count = sessions_get_group_chat_sockets(group_id, user_id, socks, 256);
+            for (int i = 0; i < sock_count; i++) {
+                if (socks[i] > 0) {
+                    proto_send_push(socks[i], push_msg, (size_t)push_len);
                 }
             }
         }
+    }
+
+    // Clear group chat mode
+    sessions_set_chat_group(user_id, 0);
+
+    proto_send_ok(ctx->client_sock, msg->req_id, "status=chat_ended");
+    return 0;
+}
 
-        // Lấy history
-        char history[8192] = {0};
-        gm_get_history(user_id, group_id, history, sizeof(history), 50);
-        log_event("rid=%s action=%s status=0 payload=' %s '", msg.req_id, msg.verb, safe_payload(msg.payload));
-        char payload[8500];
-        snprintf(payload, sizeof(payload), "group_id=%d group_name=%s me=%s history=%s",
-                 group_id, group_name[0] ? group_name : "unknown", 
-                 my_username, history[0] ? history : "empty");
-        proto_send_ok(ctx->client_sock, msg.req_id, payload);
+static int handle_gm_send(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], gid_str[32], content[4096];
 
-        proto_free(&msg);
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", gid_str, sizeof(gid_str)) ||
+        !kv_get(msg->payload, "content", content, sizeof(content))) {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // GM_CHAT_END - Thoát group chat mode
-    if (strcmp(msg.verb, "GM_CHAT_END") == 0) {
-        char token[128];
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK) {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token))) {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
+    int group_id = atoi(gid_str);
+
+    // Gửi tin nhắn
+    int msg_id = 0;
+    int rc = gm_send(user_id, group_id, content, &msg_id);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == GM_OK) {
+        // Lấy username để push
+        char from_username[64];
+        accounts_get_username(user_id, from_username, sizeof(from_username));
+
+        long ts = (long)time(NULL);
+
+        // Broadcast PUSH cho tất cả members đang trong group chat (trừ sender):
+        // format frame đúng 1 lần, snapshot socket list trong 1 lần lock,
+        // rồi gửi ngoài lock (ai vào group chat đều đã qua check member).
+        char push_msg[8192];
+        int push_len = snprintf(push_msg, sizeof(push_msg),
+                                "PUSH GM from=%s group_id=%d content=%s msg_id=%d ts=%ld\r\n",
+                                from_username, group_id, content, msg_id, ts);
+
+        int socks[256];
+        int sock_count = sessions_get_group_chat_sockets(group_id, user_id,
+                                                         socks, 256);
+        for (int i = 0; i < sock_count; i++) {
+            if (socks[i] > 0) {
+                proto_send_push(socks[i], push_msg, (size_t)push_len);
+            }
         }
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK) {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+        char payload[128];
+        snprintf(payload, sizeof(payload), "msg_id=%d group_id=%d status=sent", msg_id, group_id);
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == GM_ERR_NOT_MEMBER) {
+        send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_member");
+    }
+    else if (rc == GM_ERR_NOT_FOUND) {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "group_not_found");
+    }
+    else {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        int group_id = sessions_get_chat_group(user_id);
-        log_event("rid=%s action=%s status=0 payload=' %s '", msg.req_id, msg.verb, safe_payload(msg.payload));
-        if (group_id > 0) {
-            // Lấy username
-            char my_username[64];
-            if (accounts_get_username(user_id, my_username, sizeof(my_username))) {
-                // Thông báo cho các members khác đang trong group chat
-                int member_ids[100];
-                int member_count = sessions_get_users_in_group_chat(group_id, member_ids, 100);
-                for (int i = 0; i < member_count; i++) {
-                    if (member_ids[i] != user_id) {
-                        int sock = sessions_get_socket(member_ids[i]);
-                        if (sock > 0) {
-                            char push_msg[256];
-                            snprintf(push_msg, sizeof(push_msg),
-                                     "PUSH GM_LEAVE user=%s group_id=%d\r\n", my_username, group_id);
-                            send(sock, push_msg, strlen(push_msg), 0);
-                        }
-                    }
-                }
-            }
-        }
+    return 0;
+}
 
-        // Clear group chat mode
-        sessions_set_chat_group(user_id, 0);
+static int handle_gm_history(ServerCtx *ctx, ProtoMsg *msg)
+{
+    char token[128], gid_str[32], limit_str[16] = {0}, before_str[16] = {0};
 
-        proto_send_ok(ctx->client_sock, msg.req_id, "status=chat_ended");
-        proto_free(&msg);
+    if (!kv_get(msg->payload, "token", token, sizeof(token)) ||
+        !kv_get(msg->payload, "group_id", gid_str, sizeof(gid_str))) {
+        send_simple_err(ctx->client_sock, msg->req_id, 400, "missing_fields");
         return 0;
     }
 
-    // GM_SEND - Gửi tin nhắn vào group
-    if (strcmp(msg.verb, "GM_SEND") == 0) {
-        char token[128], gid_str[32], content[4096];
+    kv_get(msg->payload, "limit", limit_str, sizeof(limit_str));
+    int limit = limit_str[0] ? atoi(limit_str) : 50;
+    if (limit <= 0 || limit > 200) limit = 50;
 
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", gid_str, sizeof(gid_str)) ||
-            !kv_get(msg.payload, "content", content, sizeof(content))) {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    // Cursor scroll ngược: before=<msg_id> (0 = từ message mới nhất)
+    kv_get(msg->payload, "before", before_str, sizeof(before_str));
+    int before = before_str[0] ? atoi(before_str) : 0;
+    if (before < 0) before = 0;
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK) {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+    int user_id;
+    if (sessions_validate(token, &user_id) != SESS_OK) {
+        send_simple_err(ctx->client_sock, msg->req_id, 401, "invalid_token");
+        return 0;
+    }
 
-        int group_id = atoi(gid_str);
-
-        // Gửi tin nhắn
-        int msg_id = 0;
-        int rc = gm_send(user_id, group_id, content, &msg_id);
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
-        if (rc == GM_OK) {
-            // Lấy username để push
-            char from_username[64];
-            accounts_get_username(user_id, from_username, sizeof(from_username));
-
-            long ts = (long)time(NULL);
-
-            // Broadcast PUSH cho tất cả members đang trong group chat (trừ sender)
-            int member_ids[100];
-            int member_count = gm_get_member_ids(group_id, member_ids, 100);
-            
-            for (int i = 0; i < member_count; i++) {
-                if (member_ids[i] != user_id) {
-                    // Chỉ push cho những ai đang trong group chat này
-                    if (sessions_is_in_group_chat(member_ids[i], group_id)) {
-                        int sock = sessions_get_socket(member_ids[i]);
-                        if (sock > 0) {
-                            char push_msg[8192];
-                            snprintf(push_msg, sizeof(push_msg),
-                                     "PUSH GM from=%s group_id=%d content=%s msg_id=%d ts=%ld\r\n",
-                                     from_username, group_id, content, msg_id, ts);
-                            send(sock, push_msg, strlen(push_msg), 0);
-                        }
-                    }
-                }
-            }
+    int group_id = atoi(gid_str);
 
-            char payload[128];
-            snprintf(payload, sizeof(payload), "msg_id=%d group_id=%d status=sent", msg_id, group_id);
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
+    // stream=1: mỗi message 1 item qua OK-PART (giống PM_HISTORY)
+    if (wants_stream(msg->payload)) {
+        ProtoStream st;
+        proto_stream_begin(&st, ctx->client_sock, msg->req_id);
+        int src = gm_get_history_emit(user_id, group_id, limit, before,
+                                      proto_stream_emit, &st);
+
+        log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, src, safe_payload(msg->payload));
+
+        if (src == GM_OK) {
+            proto_stream_end(&st);
         }
-        else if (rc == GM_ERR_NOT_MEMBER) {
-            send_simple_err(ctx->client_sock, msg.req_id, 403, "not_group_member");
+        else if (src == GM_ERR_NOT_MEMBER) {
+            send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_member");
         }
-        else if (rc == GM_ERR_NOT_FOUND) {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "group_not_found");
+        else if (src == GM_ERR_NOT_FOUND) {
+            send_simple_err(ctx->client_sock, msg->req_id, 404, "group_not_found");
         }
         else {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
+            send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
         }
-
-        proto_free(&msg);
         return 0;
     }
 
-    // GM_HISTORY - Lấy lịch sử chat của group
-    if (strcmp(msg.verb, "GM_HISTORY") == 0) {
-        char token[128], gid_str[32], limit_str[16] = {0};
-
-        if (!kv_get(msg.payload, "token", token, sizeof(token)) ||
-            !kv_get(msg.payload, "group_id", gid_str, sizeof(gid_str))) {
-            send_simple_err(ctx->client_sock, msg.req_id, 400, "missing_fields");
-            proto_free(&msg);
-            return 0;
-        }
+    char history[8192] = {0};
+    int rc = gm_get_history(user_id, group_id, history, sizeof(history), limit, before);
+    log_event("rid=%s action=%s status=%d payload=' %s '", msg->req_id, msg->verb, rc, safe_payload(msg->payload));
+    if (rc == GM_OK) {
+        char payload[8400];
+        snprintf(payload, sizeof(payload), "group_id=%d history=%s",
+                 group_id, history[0] ? history : "empty");
+        proto_send_ok(ctx->client_sock, msg->req_id, payload);
+    }
+    else if (rc == GM_ERR_NOT_MEMBER) {
+        send_simple_err(ctx->client_sock, msg->req_id, 403, "not_group_member");
+    }
+    else if (rc == GM_ERR_NOT_FOUND) {
+        send_simple_err(ctx->client_sock, msg->req_id, 404, "group_not_found");
+    }
+    else {
+        send_simple_err(ctx->client_sock, msg->req_id, 500, "server_error");
+    }
 
-        kv_get(msg.payload, "limit", limit_str, sizeof(limit_str));
-        int limit = limit_str[0] ? atoi(limit_str) : 50;
-        if (limit <= 0 || limit > 200) limit = 50;
+    return 0;
+}
 
-        int user_id;
-        if (sessions_validate(token, &user_id) != SESS_OK) {
-            send_simple_err(ctx->client_sock, msg.req_id, 401, "invalid_token");
-            proto_free(&msg);
-            return 0;
-        }
+// ============ Dispatch ============
+
+typedef int (*HandlerFn)(ServerCtx *ctx, ProtoMsg *msg);
+
+typedef struct {
+    const char *verb;
+    HandlerFn fn;
+} VerbEntry;
+
+// Bảng dispatch SẮP XẾP THEO VERB (bsearch): thêm verb mới phải giữ đúng thứ tự alphabet.
+static const VerbEntry g_verb_table[] = {
+    { "DISCONNECT", handle_disconnect },
+    { "FRIEND_ACCEPT", handle_friend_accept },
+    { "FRIEND_DELETE", handle_friend_delete },
+    { "FRIEND_INVITE", handle_friend_invite },
+    { "FRIEND_LIST", handle_friend_list },
+    { "FRIEND_PENDING", handle_friend_pending },
+    { "FRIEND_REJECT", handle_friend_reject },
+    { "GM_CHAT_END", handle_gm_chat_end },
+    { "GM_CHAT_START", handle_gm_chat_start },
+    { "GM_HISTORY", handle_gm_history },
+    { "GM_SEND", handle_gm_send },
+    { "GROUP_ADD", handle_group_add },
+    { "GROUP_CREATE", handle_group_create },
+    { "GROUP_LEAVE", handle_group_leave },
+    { "GROUP_LIST", handle_group_list },
+    { "GROUP_MEMBERS", handle_group_members },
+    { "GROUP_REMOVE", handle_group_remove },
+    { "LOGIN", handle_login },
+    { "LOGOUT", handle_logout },
+    { "PING", handle_ping },
+    { "PM_CHAT_END", handle_pm_chat_end },
+    { "PM_CHAT_START", handle_pm_chat_start },
+    { "PM_CONVERSATIONS", handle_pm_conversations },
+    { "PM_HISTORY", handle_pm_history },
+    { "PM_NOTIFY_SUB", handle_pm_notify_sub },
+    { "PM_NOTIFY_UNSUB", handle_pm_notify_unsub },
+    { "PM_PENDING", handle_pm_pending },
+    { "PM_SEND", handle_pm_send },
+    { "PRESENCE_SUB", handle_presence_sub },
+    { "PRESENCE_UNSUB", handle_presence_unsub },
+    { "REGISTER", handle_register },
+    { "STATS", handle_stats },
+    { "UPGRADE", handle_upgrade },
+    { "WHOAMI", handle_whoami },
+};
+
+static int verb_cmp(const void *key, const void *elem)
+{
+    return strcmp((const char *)key, ((const VerbEntry *)elem)->verb);
+}
 
-        int group_id = atoi(gid_str);
+/*
+ * handle_request
+ * - Entry point xử lý 1 request của client trong server thread.
+ * - Luôn cố gắng trả response (OK/ERR) theo đúng req_id để client match được.
+ * - Dispatch qua bảng g_verb_table (binary search thay vì chuỗi strcmp tuần tự);
+ *   mỗi verb có handler riêng nhận (ServerCtx, ProtoMsg).
+ * - Khi thêm verb mới: viết handler static + thêm entry vào bảng (đúng vị trí alphabet).
+ *
+ * Return:
+ * - 0  : xử lý xong (kể cả có lỗi nghiệp vụ), giữ connection
+ * - -1 : cần đóng connection (bad_request hoặc DISCONNECT)
+ */
+int handle_request(ServerCtx *ctx, const char *line)
+{
+    ProtoMsg msg;
+    if (proto_parse_line_arena(line, &msg, ctx->arena) != 0)
+    {
+        send_simple_err(ctx->client_sock, "0", 400, "bad_request");
+        return -1;
+    }
 
-        char history[8192] = {0};
-        int rc = gm_get_history(user_id, group_id, history, sizeof(history), limit);
-        log_event("rid=%s action=%s status=%d payload=' %s '", msg.req_id, msg.verb, rc, safe_payload(msg.payload));
-        if (rc == GM_OK) {
-            char payload[8400];
-            snprintf(payload, sizeof(payload), "group_id=%d history=%s",
-                     group_id, history[0] ? history : "empty");
-            proto_send_ok(ctx->client_sock, msg.req_id, payload);
-        }
-        else if (rc == GM_ERR_NOT_MEMBER) {
-            send_simple_err(ctx->client_sock, msg.req_id, 403, "not_group_member");
-        }
-        else if (rc == GM_ERR_NOT_FOUND) {
-            send_simple_err(ctx->client_sock, msg.req_id, 404, "group_not_found");
-        }
-        else {
-            send_simple_err(ctx->client_sock, msg.req_id, 500, "server_error");
-        }
+    const VerbEntry *e = (const VerbEntry *)bsearch(
+        msg.verb, g_verb_table,
+        sizeof(g_verb_table) / sizeof(g_verb_table[0]),
+        sizeof(g_verb_table[0]), verb_cmp);
 
-        proto_free(&msg);
-        return 0;
+    int rc = 0;
+    if (e)
+    {
+        // Đo latency quanh dispatch cho STATS (CLOCK_MONOTONIC, độ phân
+        // giải us là đủ cho histogram bucket lũy thừa 2).
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        rc = e->fn(ctx, &msg);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        long latency_us = (t1.tv_sec - t0.tv_sec) * 1000000L +
+                          (t1.tv_nsec - t0.tv_nsec) / 1000L;
+        stats_record((int)(e - g_verb_table), e->verb, latency_us);
+    }
+    else
+    {
+        send_simple_err(ctx->client_sock, msg.req_id, 404, "unknown_command");
     }
 
-    send_simple_err(ctx->client_sock, msg.req_id, 404, "unknown_command");
     proto_free(&msg);
-    return 0;
+    if (ctx->arena)
+    {
+        proto_arena_reset(ctx->arena);
+    }
+    return rc;
 }
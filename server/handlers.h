@@ -1,6 +1,9 @@
 ﻿#ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include "../common/framing.h"
+#include "../common/protocol.h"
+
 /*
  * server/handlers.*
  * - Router xử lý request theo VERB (PING/REGISTER/LOGIN/LOGOUT/WHOAMI).
@@ -9,6 +12,11 @@
 
 typedef struct {
     int client_sock;
+    // Arena per-connection (nullable): payload/scratch của request hiện tại,
+    // handle_request reset sau mỗi request.
+    ProtoArena* arena;
+    // Framer của connection (nullable): UPGRADE cần đổi chế độ tách frame.
+    LineFramer* framer;
 } ServerCtx;
 
 // Xử lý 1 request line (không gồm \r\n).
@@ -0,0 +1,240 @@
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * server/journal.c
+ * - Group commit kiểu leader/follower:
+ *   + Mỗi writer append record vào buffer chung (dưới mutex) và nhận
+ *     sequence number.
+ *   + Writer đầu tiên thấy chưa ai flush sẽ làm leader: lấy nguyên
+ *     buffer hiện tại, nhả mutex, write + fsync 1 lần cho cả batch.
+ *   + Các writer khác chờ trên condvar tới khi seq của mình đã flush.
+ * - Trong lúc leader đang fsync, writer mới vẫn append được vào buffer
+ *   (đã được leader reset) nên batch kế tiếp hình thành song song.
+ */
+
+#define JRN_BUF_CAP (64 * 1024)
+#define JRN_REC_MAX 1024
+
+static pthread_mutex_t g_jrn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_jrn_cond = PTHREAD_COND_INITIALIZER;
+
+static int g_jrn_fd = -1;
+static char g_jrn_path[512] = {0};
+static int (*g_compact_cb)(void) = NULL;
+
+static char g_buf[JRN_BUF_CAP];
+static size_t g_buf_used = 0;
+
+static long g_seq_appended = 0;  // record cuối đã vào buffer
+static long g_seq_flushed = 0;   // record cuối đã fsync
+static int g_flushing = 0;       // 1 = đang có leader fsync
+static long g_pending = 0;       // record từ checkpoint gần nhất
+
+int journal_init(const char* path, int (*compact_cb)(void))
+{
+    if (!path || !path[0]) return JRN_ERR_INVALID;
+
+    pthread_mutex_lock(&g_jrn_mutex);
+
+    if (g_jrn_fd >= 0) close(g_jrn_fd);
+
+    strncpy(g_jrn_path, path, sizeof(g_jrn_path) - 1);
+    g_jrn_path[sizeof(g_jrn_path) - 1] = 0;
+    g_compact_cb = compact_cb;
+
+    if (strncmp(path, "data/", 5) == 0) {
+        mkdir("data", 0755);
+    }
+
+    g_jrn_fd = open(g_jrn_path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+    if (g_jrn_fd < 0) {
+        pthread_mutex_unlock(&g_jrn_mutex);
+        return JRN_ERR_IO;
+    }
+
+    g_buf_used = 0;
+    g_seq_appended = 0;
+    g_seq_flushed = 0;
+    g_flushing = 0;
+    g_pending = 0;
+
+    pthread_mutex_unlock(&g_jrn_mutex);
+    return JRN_OK;
+}
+
+/*
+ * flush_batch_unlocked
+ * - Leader: copy buffer hiện tại ra local, reset buffer cho batch kế,
+ *   nhả mutex trong lúc write + fsync, rồi báo flushed tới flush_to.
+ * - Gọi khi đang giữ mutex; return với mutex đang giữ.
+ */
+static int flush_batch_unlocked(void)
+{
+    char local[JRN_BUF_CAP];
+    size_t len = g_buf_used;
+    long flush_to = g_seq_appended;
+
+    memcpy(local, g_buf, len);
+    g_buf_used = 0;
+    g_flushing = 1;
+
+    pthread_mutex_unlock(&g_jrn_mutex);
+
+    int ok = 1;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(g_jrn_fd, local + off, len - off);
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+        off += (size_t)n;
+    }
+    if (ok && fsync(g_jrn_fd) != 0) ok = 0;
+
+    pthread_mutex_lock(&g_jrn_mutex);
+
+    g_flushing = 0;
+    if (ok && flush_to > g_seq_flushed) g_seq_flushed = flush_to;
+    pthread_cond_broadcast(&g_jrn_cond);
+
+    return ok ? JRN_OK : JRN_ERR_IO;
+}
+
+int journal_append(const char* rec)
+{
+    if (!rec || !rec[0]) return JRN_ERR_INVALID;
+
+    size_t len = strlen(rec);
+    if (len + 1 > JRN_REC_MAX) return JRN_ERR_INVALID;
+
+    pthread_mutex_lock(&g_jrn_mutex);
+
+    if (g_jrn_fd < 0) {
+        pthread_mutex_unlock(&g_jrn_mutex);
+        return JRN_ERR_INVALID;
+    }
+
+    // Buffer đầy: chờ leader hiện tại xả xong rồi thử lại.
+    while (g_buf_used + len + 1 > JRN_BUF_CAP) {
+        if (!g_flushing) {
+            int rc = flush_batch_unlocked();
+            if (rc != JRN_OK) {
+                pthread_mutex_unlock(&g_jrn_mutex);
+                return rc;
+            }
+        } else {
+            pthread_cond_wait(&g_jrn_cond, &g_jrn_mutex);
+        }
+    }
+
+    memcpy(g_buf + g_buf_used, rec, len);
+    g_buf[g_buf_used + len] = '\n';
+    g_buf_used += len + 1;
+
+    long my_seq = ++g_seq_appended;
+    g_pending++;
+
+    int rc = JRN_OK;
+    while (g_seq_flushed < my_seq) {
+        if (!g_flushing) {
+            // Làm leader: flush cả batch (gồm record của mình + các
+            // record follower đã append sau mình).
+            rc = flush_batch_unlocked();
+            if (rc != JRN_OK) break;
+        } else {
+            pthread_cond_wait(&g_jrn_cond, &g_jrn_mutex);
+        }
+    }
+
+    long pending = g_pending;
+    pthread_mutex_unlock(&g_jrn_mutex);
+
+    if (rc == JRN_OK && pending >= JOURNAL_COMPACT_EVERY) {
+        journal_checkpoint();
+    }
+
+    return rc;
+}
+
+long journal_pending(void)
+{
+    pthread_mutex_lock(&g_jrn_mutex);
+    long n = g_pending;
+    pthread_mutex_unlock(&g_jrn_mutex);
+    return n;
+}
+
+int journal_replay(int (*cb)(const char* rec))
+{
+    if (!cb) return JRN_ERR_INVALID;
+    if (!g_jrn_path[0]) return JRN_ERR_INVALID;
+
+    FILE* f = fopen(g_jrn_path, "r");
+    if (!f) return JRN_OK; // chưa có journal => không có gì replay
+
+    char line[JRN_REC_MAX];
+    long count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = strlen(line);
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = 0;
+        }
+        if (n == 0) continue;
+        cb(line);
+        count++;
+    }
+    fclose(f);
+
+    pthread_mutex_lock(&g_jrn_mutex);
+    g_pending = count;
+    pthread_mutex_unlock(&g_jrn_mutex);
+    return JRN_OK;
+}
+
+int journal_checkpoint(void)
+{
+    pthread_mutex_lock(&g_jrn_mutex);
+
+    if (g_jrn_fd < 0) {
+        pthread_mutex_unlock(&g_jrn_mutex);
+        return JRN_ERR_INVALID;
+    }
+
+    // Xả nốt batch đang dở để không truncate mất record chưa ghi.
+    while (g_buf_used > 0 || g_flushing) {
+        if (!g_flushing) {
+            int rc = flush_batch_unlocked();
+            if (rc != JRN_OK) {
+                pthread_mutex_unlock(&g_jrn_mutex);
+                return rc;
+            }
+        } else {
+            pthread_cond_wait(&g_jrn_cond, &g_jrn_mutex);
+        }
+    }
+
+    // Dồn state vào file DB gốc. Giữ mutex để chặn append mới trong lúc
+    // compact + truncate (checkpoint hiếm nên chấp nhận khựng ngắn).
+    if (g_compact_cb && g_compact_cb() != 0) {
+        pthread_mutex_unlock(&g_jrn_mutex);
+        return JRN_ERR_IO;
+    }
+
+    if (ftruncate(g_jrn_fd, 0) != 0) {
+        pthread_mutex_unlock(&g_jrn_mutex);
+        return JRN_ERR_IO;
+    }
+    g_pending = 0;
+
+    pthread_mutex_unlock(&g_jrn_mutex);
+    return JRN_OK;
+}
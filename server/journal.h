@@ -0,0 +1,43 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * server/journal.*
+ * - Append-only journal dùng chung cho các mutation account/friend
+ *   (data/journal.log), mỗi record là 1 dòng text "ACC|..." / "FRN|...".
+ * - Group commit: nhiều thread append đồng thời được gom thành 1 lần
+ *   write + fsync (leader/follower), nên throughput ghi scale theo batch
+ *   thay vì mỗi op 1 lần flush file.
+ * - Compaction: khi journal vượt ngưỡng, callback compact (đăng ký lúc
+ *   init) dồn state vào file DB gốc rồi truncate journal.
+ * - Replay lúc startup: đọc lại journal, dispatch từng record cho module
+ *   tương ứng (idempotent - record đã compact sẽ bị module bỏ qua).
+ */
+
+#define JRN_OK          0
+#define JRN_ERR_IO      1
+#define JRN_ERR_INVALID 2
+
+// Ngưỡng record chưa compact trước khi journal_append tự checkpoint.
+#define JOURNAL_COMPACT_EVERY 1024
+
+// Mở/tạo journal file và đăng ký callback compact (được gọi khi
+// checkpoint; phải ghi state hiện tại của module vào file DB gốc).
+int journal_init(const char* path, int (*compact_cb)(void));
+
+// Append 1 record (không chứa '\n'). Block tới khi record đã nằm trên
+// disk (fsync) - các append đồng thời chia sẻ chung 1 lần fsync.
+int journal_append(const char* rec);
+
+// Số record đã append từ lần checkpoint gần nhất.
+long journal_pending(void);
+
+// Đọc toàn bộ journal, gọi cb cho từng record (dùng lúc startup,
+// trước khi nhận request - không thread-safe với journal_append).
+int journal_replay(int (*cb)(const char* rec));
+
+// Chạy compact_cb rồi truncate journal. Tự động được gọi từ
+// journal_append khi pending vượt JOURNAL_COMPACT_EVERY.
+int journal_checkpoint(void);
+
+#endif
@@ -2,42 +2,155 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 
 #define LOG_PATH "data/server.log"
 
+/*
+ * server/logger.c
+ * - log_event() nằm trên hot path của handlers.c nên không được chặn worker
+ *   vì I/O: producer chỉ format line và đẩy vào ring buffer bounded (MPSC),
+ *   còn 1 flusher thread riêng gom batch và ghi xuống file descriptor mở
+ *   sẵn (không fopen/fclose mỗi dòng như trước).
+ * - Ring đầy => drop line và đếm; flusher sẽ ghi 1 dòng tổng kết số line
+ *   bị drop khi có chỗ trở lại (không bao giờ block producer).
+ * - Nếu logger_init() chưa được gọi (vd: tool test link logger riêng lẻ)
+ *   thì log_event() fallback về ghi đồng bộ như bản cũ.
+ */
+
+#define LOG_RING_SIZE 1024   // số line tối đa đang chờ flush
+#define LOG_LINE_MAX 512
+
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
 
-void log_event(const char *fmt, ...)
+static char g_ring[LOG_RING_SIZE][LOG_LINE_MAX];
+static int g_ring_head = 0;  // vị trí flusher đọc tiếp theo
+static int g_ring_count = 0; // số line đang chờ
+static long g_dropped = 0;   // số line bị drop vì ring đầy
+
+static int g_running = 0;    // flusher thread đã chạy chưa
+static pthread_t g_flusher_tid;
+
+/*
+ * format_line
+ * - Format "[timestamp] message\n" vào out. Return độ dài.
+ */
+static int format_line(char *out, size_t cap, const char *fmt, va_list ap)
 {
-    FILE *f;
-    time_t now;
-    struct tm *tm;
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
     char ts[32];
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", tm);
 
-    pthread_mutex_lock(&log_mutex);
+    int n = snprintf(out, cap, "[%s] ", ts);
+    if (n < 0) return 0;
+
+    int m = vsnprintf(out + n, cap - (size_t)n, fmt, ap);
+    if (m < 0) m = 0;
+
+    size_t len = (size_t)n + (size_t)m;
+    if (len >= cap - 1) len = cap - 2; // chừa chỗ cho '\n'
+    out[len++] = '\n';
+    out[len] = 0;
+    return (int)len;
+}
 
-    f = fopen(LOG_PATH, "a");
-    if (!f)
-    {
+/*
+ * flusher_main
+ * - Thread nền: chờ có line trong ring, drain 1 batch rồi ghi ra file
+ *   (giữ FILE* mở xuyên suốt). Ghi/flush luôn thực hiện NGOÀI lock.
+ */
+static void* flusher_main(void *arg)
+{
+    (void)arg;
+
+    FILE *f = fopen(LOG_PATH, "a");
+
+    char batch[32][LOG_LINE_MAX];
+
+    for (;;) {
+        pthread_mutex_lock(&log_mutex);
+        while (g_ring_count == 0) {
+            pthread_cond_wait(&log_cond, &log_mutex);
+        }
+
+        int n = 0;
+        while (g_ring_count > 0 && n < 32) {
+            memcpy(batch[n], g_ring[g_ring_head], LOG_LINE_MAX);
+            g_ring_head = (g_ring_head + 1) % LOG_RING_SIZE;
+            g_ring_count--;
+            n++;
+        }
+        long dropped = g_dropped;
+        g_dropped = 0;
         pthread_mutex_unlock(&log_mutex);
-        return;
+
+        if (!f) {
+            // Thử mở lại (vd: data/ được tạo sau khi logger start)
+            f = fopen(LOG_PATH, "a");
+            if (!f) continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            fputs(batch[i], f);
+        }
+        if (dropped > 0) {
+            fprintf(f, "[logger] dropped %ld line(s): ring buffer full\n", dropped);
+        }
+        fflush(f);
     }
 
-    now = time(NULL);
-    tm = localtime(&now);
-    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", tm);
+    return NULL;
+}
+
+void logger_init(void)
+{
+    pthread_mutex_lock(&log_mutex);
+    if (!g_running) {
+        if (pthread_create(&g_flusher_tid, NULL, flusher_main, NULL) == 0) {
+            pthread_detach(g_flusher_tid);
+            g_running = 1;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
 
-    fprintf(f, "[%s] ", ts);
+void log_event(const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX];
 
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(f, fmt, ap);
+    format_line(line, sizeof(line), fmt, ap);
     va_end(ap);
 
-    fprintf(f, "\n");
-    fclose(f);
+    pthread_mutex_lock(&log_mutex);
+
+    if (!g_running) {
+        // Fallback đồng bộ khi chưa init (giữ hành vi bản cũ).
+        pthread_mutex_unlock(&log_mutex);
+        FILE *f = fopen(LOG_PATH, "a");
+        if (f) {
+            fputs(line, f);
+            fclose(f);
+        }
+        return;
+    }
+
+    if (g_ring_count >= LOG_RING_SIZE) {
+        // Không block producer: drop và đếm.
+        g_dropped++;
+        pthread_mutex_unlock(&log_mutex);
+        return;
+    }
+
+    int tail = (g_ring_head + g_ring_count) % LOG_RING_SIZE;
+    memcpy(g_ring[tail], line, sizeof(line));
+    g_ring_count++;
 
+    pthread_cond_signal(&log_cond);
     pthread_mutex_unlock(&log_mutex);
 }
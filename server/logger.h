@@ -1,6 +1,18 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+/*
+ * server/logger.*
+ * - Ghi log ra data/server.log.
+ * - logger_init() bật chế độ async: log_event() chỉ đẩy line vào ring buffer,
+ *   flusher thread nền batch-write xuống file (không fopen mỗi dòng).
+ * - Chưa init thì log_event() ghi đồng bộ (fallback).
+ */
+
+// Khởi động flusher thread (gọi 1 lần khi server start).
+void logger_init(void);
+
+// Ghi 1 dòng log (printf-style). Không bao giờ block vì I/O sau khi init.
 void log_event(const char *fmt, ...);
 
 #endif
@@ -8,120 +8,257 @@
 #include <time.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 
 /*
  * server/messages.c
  * - Private messaging với file-based storage.
- * - Mỗi conversation lưu trong data/pm/{min_id}_{max_id}.txt
+ * - Mỗi conversation lưu trong data/pm/{min_id}_{max_id}.txt (append-only),
+ *   kèm side index {min_id}_{max_id}.idx chứa offset (binary, 8 byte/record)
+ *   của từng message để pm_get_history seek thẳng tới N message cuối
+ *   thay vì parse cả file.
  * - Content được encode Base64 để truyền an toàn qua protocol.
- * - Thread-safe với mutex protection.
+ * - Thread-safe: lock striped theo conversation + mutex riêng cho counter.
  */
 
 #define PM_DIR "data/pm"
 #define LINE_MAX 4096
 #define MSG_ID_FILE "data/pm/.msg_id"
+#define UNREAD_FILE "data/pm/.unread"
+#define WATERMARK_FILE "data/pm/.watermarks"
 
-static pthread_mutex_t pm_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Lock striped theo conversation: hash {min_id, max_id} -> 1 trong
+// PM_LOCK_STRIPES mutex, nên 2 conversation khác nhau (khác stripe)
+// gửi/đọc song song thay vì serialize qua 1 pm_mutex toàn cục như trước.
+// Counter msg_id có mutex riêng (chỉ giữ trong lúc cấp id).
+#define PM_LOCK_STRIPES 64
+
+static pthread_mutex_t pm_locks[PM_LOCK_STRIPES];
+static pthread_mutex_t msg_id_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int g_next_msg_id = 1;
 
-// ============ Base64 Implementation ============
-
-static const char b64_table[] = 
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-static const int b64_decode_table[256] = {
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,63,
-    52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
-    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
-    15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,
-    -1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
-    41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
-};
-
-int base64_encode(const unsigned char* src, size_t src_len, 
-                  char* out, size_t out_cap)
+// Mutex của conversation (user1, user2) - thứ tự tham số không quan trọng.
+static pthread_mutex_t* pm_lock_for(int user1_id, int user2_id)
 {
-    size_t out_len = ((src_len + 2) / 3) * 4;
-    if (out_len + 1 > out_cap) return -1;
-    
-    size_t i = 0, j = 0;
-    while (i < src_len) {
-        unsigned int a = i < src_len ? src[i++] : 0;
-        unsigned int b = i < src_len ? src[i++] : 0;
-        unsigned int c = i < src_len ? src[i++] : 0;
-        
-        unsigned int triple = (a << 16) | (b << 8) | c;
-        
-        out[j++] = b64_table[(triple >> 18) & 0x3F];
-        out[j++] = b64_table[(triple >> 12) & 0x3F];
-        out[j++] = b64_table[(triple >> 6) & 0x3F];
-        out[j++] = b64_table[triple & 0x3F];
+    int min_id = user1_id < user2_id ? user1_id : user2_id;
+    int max_id = user1_id < user2_id ? user2_id : user1_id;
+    unsigned h = (unsigned)min_id * 2654435761u ^ (unsigned)max_id * 40503u;
+    return &pm_locks[h & (PM_LOCK_STRIPES - 1)];
+}
+
+// Pending notification queue (định nghĩa bên dưới, dùng trong pm_send)
+static void pending_add(int user_id, int from_user_id);
+
+// ============ Read Watermarks ============
+// Thay cho việc rewrite cả file để flip read flag: trạng thái "đã đọc" lưu
+// dạng watermark (user_id, other_id) -> msg_id cao nhất đã xem. msg_id PM
+// tăng đơn điệu toàn cục nên mark-read chỉ là 1 phép gán + persist file nhỏ;
+// message file giữ nguyên append-only (flag trong record không dùng nữa).
+
+typedef struct {
+    int user_id;
+    int other_id;
+    int last_read_msg_id;
+} WatermarkEntry;
+
+static pthread_mutex_t wm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WatermarkEntry* g_watermarks = NULL;
+static int g_wm_count = 0;
+static int g_wm_cap = 0;
+
+// Tìm entry (user, other); tạo mới với watermark=0 nếu chưa có.
+// Return NULL nếu hết bộ nhớ. Gọi khi đang giữ wm_mutex.
+static WatermarkEntry* wm_find_or_add_unlocked(int user_id, int other_id)
+{
+    for (int i = 0; i < g_wm_count; i++) {
+        if (g_watermarks[i].user_id == user_id && g_watermarks[i].other_id == other_id) {
+            return &g_watermarks[i];
+        }
     }
-    
-    // Padding
-    size_t mod = src_len % 3;
-    if (mod == 1) {
-        out[j - 1] = '=';
-        out[j - 2] = '=';
-    } else if (mod == 2) {
-        out[j - 1] = '=';
+
+    if (g_wm_count >= g_wm_cap) {
+        int new_cap = g_wm_cap ? g_wm_cap * 2 : 64;
+        WatermarkEntry* next = realloc(g_watermarks, (size_t)new_cap * sizeof(WatermarkEntry));
+        if (!next) return NULL;
+        g_watermarks = next;
+        g_wm_cap = new_cap;
     }
-    
-    out[j] = '\0';
-    return (int)j;
+
+    WatermarkEntry* e = &g_watermarks[g_wm_count++];
+    e->user_id = user_id;
+    e->other_id = other_id;
+    e->last_read_msg_id = 0;
+    return e;
 }
 
-int base64_decode(const char* src, unsigned char* out, size_t out_cap)
+static void wm_save_unlocked(void)
 {
-    size_t src_len = strlen(src);
-    if (src_len % 4 != 0) return -1;
-    
-    size_t out_len = (src_len / 4) * 3;
-    if (src_len > 0 && src[src_len - 1] == '=') out_len--;
-    if (src_len > 1 && src[src_len - 2] == '=') out_len--;
-    
-    if (out_len + 1 > out_cap) return -1;
-    
-    size_t i = 0, j = 0;
-    while (i < src_len) {
-        int a = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
-        int b = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
-        int c = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
-        int d = src[i] == '=' ? 0 : b64_decode_table[(unsigned char)src[i]]; i++;
-        
-        if (a < 0 || b < 0 || c < 0 || d < 0) return -1;
-        
-        unsigned int triple = (a << 18) | (b << 12) | (c << 6) | d;
-        
-        if (j < out_len) out[j++] = (triple >> 16) & 0xFF;
-        if (j < out_len) out[j++] = (triple >> 8) & 0xFF;
-        if (j < out_len) out[j++] = triple & 0xFF;
+    FILE* f = fopen(WATERMARK_FILE, "w");
+    if (!f) return;
+    for (int i = 0; i < g_wm_count; i++) {
+        fprintf(f, "%d|%d|%d\n", g_watermarks[i].user_id, g_watermarks[i].other_id,
+                g_watermarks[i].last_read_msg_id);
     }
-    
-    out[j] = '\0';
-    return (int)out_len;
+    fclose(f);
 }
 
-int base64_encode_str(const char* text, char* out, size_t out_cap)
+static void wm_load_unlocked(void)
 {
-    return base64_encode((const unsigned char*)text, strlen(text), out, out_cap);
+    FILE* f = fopen(WATERMARK_FILE, "r");
+    if (!f) return;
+
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        int uid, oid, wm;
+        if (sscanf(line, "%d|%d|%d", &uid, &oid, &wm) == 3) {
+            WatermarkEntry* e = wm_find_or_add_unlocked(uid, oid);
+            if (e) e->last_read_msg_id = wm;
+        }
+    }
+    fclose(f);
 }
 
-int base64_decode_str(const char* b64, char* out, size_t out_cap)
+// Watermark hiện tại của (user, other); 0 nếu chưa từng mark-read.
+static int wm_get(int user_id, int other_id)
 {
-    return base64_decode(b64, (unsigned char*)out, out_cap);
+    int wm = 0;
+    pthread_mutex_lock(&wm_mutex);
+    for (int i = 0; i < g_wm_count; i++) {
+        if (g_watermarks[i].user_id == user_id && g_watermarks[i].other_id == other_id) {
+            wm = g_watermarks[i].last_read_msg_id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wm_mutex);
+    return wm;
+}
+
+// ============ Unread Counter Table ============
+// Mỗi entry: user_id có conversation với other_id và còn `unread` message
+// chưa đọc (2 entry cho mỗi conversation, 1 per chiều). Bảng giữ in-memory
+// và persist ra UNREAD_FILE, nên pm_get_conversations không cần đụng tới
+// message file nào nữa.
+
+typedef struct {
+    int user_id;
+    int other_id;
+    int unread;
+} UnreadEntry;
+
+static pthread_mutex_t unread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static UnreadEntry* g_unread = NULL;
+static int g_unread_count = 0;
+static int g_unread_cap = 0;
+
+// Tìm entry (user, other); tạo mới với unread=0 nếu chưa có.
+// Return NULL nếu hết bộ nhớ. Gọi khi đang giữ unread_mutex.
+static UnreadEntry* unread_find_or_add_unlocked(int user_id, int other_id)
+{
+    for (int i = 0; i < g_unread_count; i++) {
+        if (g_unread[i].user_id == user_id && g_unread[i].other_id == other_id) {
+            return &g_unread[i];
+        }
+    }
+
+    if (g_unread_count >= g_unread_cap) {
+        int new_cap = g_unread_cap ? g_unread_cap * 2 : 64;
+        UnreadEntry* next = realloc(g_unread, (size_t)new_cap * sizeof(UnreadEntry));
+        if (!next) return NULL;
+        g_unread = next;
+        g_unread_cap = new_cap;
+    }
+
+    UnreadEntry* e = &g_unread[g_unread_count++];
+    e->user_id = user_id;
+    e->other_id = other_id;
+    e->unread = 0;
+    return e;
+}
+
+// Ghi lại toàn bộ bảng (file nhỏ: 2 dòng/conversation).
+static void unread_save_unlocked(void)
+{
+    FILE* f = fopen(UNREAD_FILE, "w");
+    if (!f) return;
+    for (int i = 0; i < g_unread_count; i++) {
+        fprintf(f, "%d|%d|%d\n", g_unread[i].user_id, g_unread[i].other_id, g_unread[i].unread);
+    }
+    fclose(f);
+}
+
+/*
+ * unread_load_unlocked
+ * - Load bảng từ UNREAD_FILE nếu có; nếu chưa có (server cũ) thì rebuild
+ *   1 lần bằng cách scan toàn bộ data/pm rồi persist.
+ */
+static void unread_load_unlocked(void)
+{
+    FILE* f = fopen(UNREAD_FILE, "r");
+    if (f) {
+        char line[128];
+        while (fgets(line, sizeof(line), f)) {
+            int uid, oid, unread;
+            if (sscanf(line, "%d|%d|%d", &uid, &oid, &unread) == 3) {
+                UnreadEntry* e = unread_find_or_add_unlocked(uid, oid);
+                if (e) e->unread = unread;
+            }
+        }
+        fclose(f);
+        return;
+    }
+
+    // Rebuild: đếm unread (message từ phía kia, flag=0) cho cả 2 chiều.
+    DIR* dir = opendir(PM_DIR);
+    if (!dir) return;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len < 4 || strcmp(entry->d_name + name_len - 4, ".txt") != 0) {
+            continue;
+        }
+
+        int id1, id2;
+        if (sscanf(entry->d_name, "%d_%d.txt", &id1, &id2) != 2) continue;
+
+        char filepath[512];
+        snprintf(filepath, sizeof(filepath), "%s/%s", PM_DIR, entry->d_name);
+
+        FILE* pf = fopen(filepath, "r");
+        if (!pf) continue;
+
+        int unread1 = 0; // chưa đọc của id1 (từ id2)
+        int unread2 = 0; // chưa đọc của id2 (từ id1)
+
+        // Chưa đọc = msg_id vượt watermark của người đọc (xem wm_*).
+        int wm1 = wm_get(id1, id2);
+        int wm2 = wm_get(id2, id1);
+
+        char line[LINE_MAX];
+        while (fgets(line, sizeof(line), pf)) {
+            int msg_id, from_id, read_flag;
+            char content[2048];
+            long ts;
+
+            if (sscanf(line, "%d|%d|%2047[^|]|%ld|%d",
+                       &msg_id, &from_id, content, &ts, &read_flag) >= 4) {
+                if (from_id == id2 && msg_id > wm1) unread1++;
+                else if (from_id == id1 && msg_id > wm2) unread2++;
+            }
+        }
+        fclose(pf);
+
+        UnreadEntry* e = unread_find_or_add_unlocked(id1, id2);
+        if (e) e->unread = unread1;
+        e = unread_find_or_add_unlocked(id2, id1);
+        if (e) e->unread = unread2;
+    }
+
+    closedir(dir);
+    unread_save_unlocked();
 }
 
 // ============ Helper Functions ============
@@ -134,8 +271,117 @@ static void get_pm_filepath(int user1_id, int user2_id, char* out, size_t cap)
     snprintf(out, cap, "%s/%d_%d.txt", PM_DIR, min_id, max_id);
 }
 
+static void get_pm_idxpath(int user1_id, int user2_id, char* out, size_t cap)
+{
+    int min_id = user1_id < user2_id ? user1_id : user2_id;
+    int max_id = user1_id < user2_id ? user2_id : user1_id;
+    snprintf(out, cap, "%s/%d_%d.idx", PM_DIR, min_id, max_id);
+}
+
+// ============ Offset Index ============
+// Mỗi record trong .idx là 1 long (8 byte): offset đầu dòng tương ứng trong
+// file .txt. Message file append-only (mark-read chỉ cập nhật watermark)
+// nên offset đã ghi không bao giờ bị lệch.
+
+/*
+ * pm_index_rebuild_unlocked
+ * - Scan 1 lần file conversation và ghi lại toàn bộ offset đầu dòng.
+ * - Dùng khi .idx chưa có (file cũ) hoặc không khớp với file data.
+ * Return: 0 nếu OK, -1 nếu lỗi IO.
+ */
+static int pm_index_rebuild_unlocked(const char* filepath, const char* idxpath)
+{
+    FILE* in = fopen(filepath, "r");
+    if (!in) return -1;
+
+    FILE* idx = fopen(idxpath, "wb");
+    if (!idx) {
+        fclose(in);
+        return -1;
+    }
+
+    char line[LINE_MAX];
+    long offset = 0;
+    while (fgets(line, sizeof(line), in)) {
+        fwrite(&offset, sizeof(offset), 1, idx);
+        offset = ftell(in);
+    }
+
+    fclose(in);
+    fclose(idx);
+    return 0;
+}
+
+/*
+ * pm_index_open_unlocked
+ * - Mở index của conversation, tự rebuild nếu thiếu/không khớp
+ *   (entry cuối phải trỏ vào trong file data).
+ * Return: FILE* đã mở "rb" + số entry qua out_count, NULL nếu lỗi.
+ */
+static FILE* pm_index_open_unlocked(const char* filepath, const char* idxpath, long* out_count)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        FILE* idx = fopen(idxpath, "rb");
+        if (!idx) {
+            if (pm_index_rebuild_unlocked(filepath, idxpath) != 0) return NULL;
+            continue;
+        }
+
+        fseek(idx, 0, SEEK_END);
+        long size = ftell(idx);
+        long count = size / (long)sizeof(long);
+
+        // Sanity check: offset cuối phải nằm trong file data.
+        int valid = (size % (long)sizeof(long) == 0);
+        if (valid && count > 0) {
+            long last = 0;
+            fseek(idx, (count - 1) * (long)sizeof(long), SEEK_SET);
+            if (fread(&last, sizeof(last), 1, idx) != 1) valid = 0;
+
+            FILE* data = fopen(filepath, "r");
+            if (data) {
+                fseek(data, 0, SEEK_END);
+                if (last >= ftell(data)) valid = 0;
+                fclose(data);
+            } else {
+                valid = 0;
+            }
+        }
+
+        if (valid) {
+            *out_count = count;
+            return idx;
+        }
+
+        fclose(idx);
+        if (pm_index_rebuild_unlocked(filepath, idxpath) != 0) return NULL;
+    }
+
+    return NULL;
+}
+
+// Append offset của message vừa ghi vào index (gọi khi đang giữ mutex).
+static void pm_index_append_unlocked(const char* idxpath, long offset)
+{
+    FILE* idx = fopen(idxpath, "ab");
+    if (idx) {
+        fwrite(&offset, sizeof(offset), 1, idx);
+        fclose(idx);
+    }
+}
+
+// Cấp id theo block: file .msg_id chỉ lưu high watermark của block đã lease,
+// nên ghi file 1 lần mỗi MSG_ID_LEASE_BLOCK tin thay vì mỗi tin. Crash thì
+// mất nốt phần còn lại của block (id nhảy tới block kế) — chấp nhận được vì
+// msg_id chỉ cần tăng dần, không cần liên tục.
+#define MSG_ID_LEASE_BLOCK 1000
+
+static int g_msg_id_lease_end = 0; // id đầu tiên NGOÀI block đã lease
+
 static void load_next_msg_id(void)
 {
+    // File lưu watermark đã lease => start từ đó để không cấp trùng id
+    // của lần chạy trước (kể cả khi lần trước crash giữa block).
     FILE* f = fopen(MSG_ID_FILE, "r");
     if (f) {
         if (fscanf(f, "%d", &g_next_msg_id) != 1) {
@@ -145,11 +391,17 @@ static void load_next_msg_id(void)
     }
 }
 
-static void save_next_msg_id(void)
+/*
+ * lease_msg_id_block_unlocked
+ * - Reserve thêm MSG_ID_LEASE_BLOCK id: persist watermark mới 1 lần,
+ *   sau đó cấp id từ bộ nhớ đến khi cạn block.
+ */
+static void lease_msg_id_block_unlocked(void)
 {
+    g_msg_id_lease_end = g_next_msg_id + MSG_ID_LEASE_BLOCK;
     FILE* f = fopen(MSG_ID_FILE, "w");
     if (f) {
-        fprintf(f, "%d", g_next_msg_id);
+        fprintf(f, "%d", g_msg_id_lease_end);
         fclose(f);
     }
 }
@@ -158,16 +410,32 @@ static void save_next_msg_id(void)
 
 int pm_init(void)
 {
-    pthread_mutex_lock(&pm_mutex);
-    
+    // Stripe lock init (chạy 1 lần lúc startup, trước khi có thread).
+    for (int i = 0; i < PM_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&pm_locks[i], NULL);
+    }
+
     // Create data/pm directory
     mkdir("data", 0755);
     mkdir(PM_DIR, 0755);
-    
+
     // Load message ID counter
+    pthread_mutex_lock(&msg_id_mutex);
     load_next_msg_id();
-    
-    pthread_mutex_unlock(&pm_mutex);
+    pthread_mutex_unlock(&msg_id_mutex);
+
+    // Load read watermarks trước (unread rebuild cần tới chúng)
+    pthread_mutex_lock(&wm_mutex);
+    g_wm_count = 0;
+    wm_load_unlocked();
+    pthread_mutex_unlock(&wm_mutex);
+
+    // Load unread counter table (rebuild 1 lần nếu file chưa có)
+    pthread_mutex_lock(&unread_mutex);
+    g_unread_count = 0;
+    unread_load_unlocked();
+    pthread_mutex_unlock(&unread_mutex);
+
     return PM_OK;
 }
 
@@ -195,211 +463,359 @@ int pm_send(int from_user_id, const char* to_username,
         return PM_ERR_NOT_FOUND;
     }
     
-    pthread_mutex_lock(&pm_mutex);
-    
+    pthread_mutex_t* lock = pm_lock_for(from_user_id, to_user_id);
+    pthread_mutex_lock(lock);
+
     // Get file path
     char filepath[256];
+    char idxpath[256];
     get_pm_filepath(from_user_id, to_user_id, filepath, sizeof(filepath));
-    
+    get_pm_idxpath(from_user_id, to_user_id, idxpath, sizeof(idxpath));
+
     // Append message
     FILE* f = fopen(filepath, "a");
     if (!f) {
-        pthread_mutex_unlock(&pm_mutex);
+        pthread_mutex_unlock(lock);
         return PM_ERR_INTERNAL;
     }
-    
+
+    // Cấp msg_id dưới mutex riêng của counter, NESTED trong lock
+    // conversation: giữ bất biến msg_id tăng đơn điệu trong từng file
+    // (cursor binary search dựa vào đó), mà các stripe khác vẫn chỉ
+    // tranh nhau mutex counter trong vài lệnh.
+    pthread_mutex_lock(&msg_id_mutex);
+    // Hết block id đã lease => reserve block mới (ghi file 1 lần / 1000 tin)
+    if (g_next_msg_id >= g_msg_id_lease_end) {
+        lease_msg_id_block_unlocked();
+    }
     int msg_id = g_next_msg_id++;
+    pthread_mutex_unlock(&msg_id_mutex);
+
     long ts = (long)time(NULL);
-    
+
+    // Offset đầu record (append mode luôn ghi ở cuối file)
+    fseek(f, 0, SEEK_END);
+    long offset = ftell(f);
+
     // Format: msg_id|from_id|content_base64|timestamp|read(0/1)
     fprintf(f, "%d|%d|%s|%ld|0\n", msg_id, from_user_id, content_base64, ts);
     fclose(f);
-    
-    save_next_msg_id();
-    
+
+    pm_index_append_unlocked(idxpath, offset);
+
     if (out_msg_id) *out_msg_id = msg_id;
-    
-    pthread_mutex_unlock(&pm_mutex);
-    
+
+    pthread_mutex_unlock(lock);
+
+    // Cập nhật unread counter: +1 phía người nhận, đảm bảo chiều ngược
+    // tồn tại để conversation hiện ra trong list của người gửi.
+    pthread_mutex_lock(&unread_mutex);
+    UnreadEntry* e = unread_find_or_add_unlocked(to_user_id, from_user_id);
+    if (e) e->unread++;
+    unread_find_or_add_unlocked(from_user_id, to_user_id);
+    unread_save_unlocked();
+    pthread_mutex_unlock(&unread_mutex);
+
+    // Enqueue pending notification cho người nhận (event-driven thay vì
+    // client phải poll; handlers.c quyết định push hay để drain sau).
+    pending_add(to_user_id, from_user_id);
+
     // Try to push to recipient if online and in chat mode
     // This is handled by the caller (handlers.c) for better separation
-    
+
     return PM_OK;
 }
 
-int pm_get_history(int user_id, const char* other_username,
-                   char* out, size_t out_cap, int limit)
+// ============ Pending notification queue ============
+// In-memory: tin PM tới mà người nhận chưa được notify/drain trong phiên
+// server hiện tại, gộp theo người gửi. Mất khi restart — không sao, unread
+// table (persist) vẫn cho số liệu đầy đủ qua PM_CONVERSATIONS.
+
+typedef struct {
+    int user_id;   // người nhận
+    int from_id;   // người gửi
+    int count;     // số tin pending từ from_id
+} PendingEntry;
+
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PendingEntry* g_pending = NULL;
+static int g_pending_count = 0;
+static int g_pending_cap = 0;
+
+static void pending_add(int user_id, int from_user_id)
+{
+    pthread_mutex_lock(&pending_mutex);
+
+    for (int i = 0; i < g_pending_count; i++) {
+        if (g_pending[i].user_id == user_id && g_pending[i].from_id == from_user_id) {
+            g_pending[i].count++;
+            pthread_mutex_unlock(&pending_mutex);
+            return;
+        }
+    }
+
+    if (g_pending_count >= g_pending_cap) {
+        int new_cap = g_pending_cap ? g_pending_cap * 2 : 64;
+        PendingEntry* next = (PendingEntry*)realloc(g_pending,
+                                                    (size_t)new_cap * sizeof(PendingEntry));
+        if (!next) {
+            pthread_mutex_unlock(&pending_mutex);
+            return; // hết bộ nhớ: bỏ notification, unread table vẫn chính xác
+        }
+        g_pending = next;
+        g_pending_cap = new_cap;
+    }
+
+    g_pending[g_pending_count].user_id = user_id;
+    g_pending[g_pending_count].from_id = from_user_id;
+    g_pending[g_pending_count].count = 1;
+    g_pending_count++;
+
+    pthread_mutex_unlock(&pending_mutex);
+}
+
+int pm_pending_count(int user_id, int from_user_id)
+{
+    int count = 0;
+    pthread_mutex_lock(&pending_mutex);
+    for (int i = 0; i < g_pending_count; i++) {
+        if (g_pending[i].user_id == user_id && g_pending[i].from_id == from_user_id) {
+            count = g_pending[i].count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pending_mutex);
+    return count;
+}
+
+int pm_pending_drain(int user_id, char* out, size_t out_cap)
 {
-    if (!other_username || !out) return PM_ERR_INTERNAL;
+    if (!out) return PM_ERR_INTERNAL;
     out[0] = '\0';
-    
+
+    pthread_mutex_lock(&pending_mutex);
+
+    size_t used = 0;
+    int i = 0;
+    while (i < g_pending_count) {
+        if (g_pending[i].user_id != user_id) {
+            i++;
+            continue;
+        }
+
+        char from_username[64];
+        if (accounts_get_username(g_pending[i].from_id, from_username, sizeof(from_username))) {
+            int n = snprintf(out + used, out_cap - used, "%s%s:%d",
+                             used > 0 ? "," : "",
+                             from_username, g_pending[i].count);
+            if (n > 0 && (size_t)n < out_cap - used) {
+                used += (size_t)n;
+            } else {
+                out[used] = '\0';
+            }
+        }
+
+        // Xóa entry (swap với cuối: thứ tự queue không quan trọng sau khi gộp)
+        g_pending[i] = g_pending[g_pending_count - 1];
+        g_pending_count--;
+    }
+
+    pthread_mutex_unlock(&pending_mutex);
+    return PM_OK;
+}
+
+/*
+ * map_file_readonly
+ * - mmap toàn bộ file read-only để parse record tại chỗ (zero-copy,
+ *   tận dụng page cache cho các conversation được fetch lặp lại).
+ * Return: pointer map (out_size = kích thước), NULL nếu file rỗng/không có.
+ */
+static char* map_file_readonly(const char* path, size_t* out_size)
+{
+    *out_size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char* map = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    *out_size = (size_t)st.st_size;
+    return map;
+}
+
+int pm_get_history_emit(int user_id, const char* other_username,
+                        int limit, int before_msg_id,
+                        ProtoItemFn emit, void* ud)
+{
+    if (!other_username || !emit) return PM_ERR_INTERNAL;
+
     int other_id = accounts_get_user_id(other_username);
     if (other_id < 0) return PM_ERR_NOT_FOUND;
-    
-    pthread_mutex_lock(&pm_mutex);
-    
+
+    pthread_mutex_t* lock = pm_lock_for(user_id, other_id);
+    pthread_mutex_lock(lock);
+
     char filepath[256];
+    char idxpath[256];
     get_pm_filepath(user_id, other_id, filepath, sizeof(filepath));
-    
-    FILE* f = fopen(filepath, "r");
-    if (!f) {
-        // No chat history yet
-        pthread_mutex_unlock(&pm_mutex);
+    get_pm_idxpath(user_id, other_id, idxpath, sizeof(idxpath));
+
+    size_t map_size = 0;
+    char* map = map_file_readonly(filepath, &map_size);
+    if (!map) {
+        // No chat history yet (hoặc file rỗng)
+        pthread_mutex_unlock(lock);
         return PM_OK;
     }
-    
-    // Read all messages into array (we need to reverse order - latest first)
-    typedef struct {
-        int msg_id;
-        int from_id;
-        char content[2048];
-        long ts;
-    } Msg;
-    
-    Msg* msgs = NULL;
-    int msg_count = 0;
-    int msg_cap = 0;
-    
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), f)) {
-        int msg_id, from_id, read_flag;
-        char content[2048];
-        long ts;
-        
-        if (sscanf(line, "%d|%d|%2047[^|]|%ld|%d", 
-                   &msg_id, &from_id, content, &ts, &read_flag) >= 4) {
-            
-            if (msg_count >= msg_cap) {
-                msg_cap = msg_cap ? msg_cap * 2 : 64;
-                msgs = realloc(msgs, msg_cap * sizeof(Msg));
+
+    long idx_count = 0;
+    FILE* idx = pm_index_open_unlocked(filepath, idxpath, &idx_count);
+    if (!idx) {
+        munmap(map, map_size);
+        pthread_mutex_unlock(lock);
+        return PM_ERR_INTERNAL;
+    }
+
+    // Cursor: chỉ lấy record có msg_id < before_msg_id (0 = từ mới nhất).
+    // msg_id tăng đơn điệu trong file nên binary search trên index được:
+    // mỗi probe = 1 lần đọc offset + atoi msg_id tại chỗ trong map.
+    long end = idx_count;
+    if (before_msg_id > 0) {
+        long lo = 0, hi = idx_count;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            long off = -1;
+            fseek(idx, mid * (long)sizeof(long), SEEK_SET);
+            if (fread(&off, sizeof(long), 1, idx) != 1 ||
+                off < 0 || (size_t)off >= map_size) {
+                hi = mid;
+                continue;
             }
-            
-            msgs[msg_count].msg_id = msg_id;
-            msgs[msg_count].from_id = from_id;
-            snprintf(msgs[msg_count].content, sizeof(msgs[msg_count].content), "%s", content);
-            msgs[msg_count].ts = ts;
-            msg_count++;
+            if (atoi(map + off) >= before_msg_id) hi = mid;
+            else lo = mid + 1;
         }
+        end = lo;
     }
-    
-    fclose(f);
-    
-    // Build output (latest first, limited)
-    size_t used = 0;
-    int start = msg_count - 1;
-    int count = 0;
-    
+
+    // Chỉ cần `limit` entry cuối (trước cursor): seek 1 lần, đọc 1 mảng nhỏ.
+    long want = limit;
+    if (want > end) want = end;
+
+    long offsets[128]; // limit bị handlers chặn <= 100
+    if (want > (long)(sizeof(offsets) / sizeof(offsets[0]))) {
+        want = (long)(sizeof(offsets) / sizeof(offsets[0]));
+    }
+
+    fseek(idx, (end - want) * (long)sizeof(long), SEEK_SET);
+    long got = (long)fread(offsets, sizeof(long), (size_t)want, idx);
+    fclose(idx);
+
+    // Emit từng entry (latest first, limited) qua sink
+
     // Get usernames
     char my_username[64], their_username[64];
     accounts_get_username(user_id, my_username, sizeof(my_username));
     strcpy(their_username, other_username);
-    
-    for (int i = start; i >= 0 && count < limit; i--) {
-        char* from_name = (msgs[i].from_id == user_id) ? my_username : their_username;
-        
+
+    for (long i = got - 1; i >= 0; i--) {
+        if (offsets[i] < 0 || (size_t)offsets[i] >= map_size) continue;
+
+        // Parse record tại chỗ: msg_id|from_id|content|timestamp|read
+        const char* rec = map + offsets[i];
+        size_t rec_max = map_size - (size_t)offsets[i];
+
+        const char* p1 = memchr(rec, '|', rec_max);
+        if (!p1) continue;
+        const char* p2 = memchr(p1 + 1, '|', rec_max - (size_t)(p1 + 1 - rec));
+        if (!p2) continue;
+        const char* p3 = memchr(p2 + 1, '|', rec_max - (size_t)(p2 + 1 - rec));
+        if (!p3) continue;
+
+        int msg_id = atoi(rec);
+        int from_id = atoi(p1 + 1);
+        long ts = atol(p3 + 1);
+
+        const char* from_name = (from_id == user_id) ? my_username : their_username;
+
         // Format: msg_id:from_username:content_base64:timestamp
-        char entry[3000];
-        int entry_len = snprintf(entry, sizeof(entry), "%d:%s:%s:%ld",
-                                  msgs[i].msg_id, from_name, 
-                                  msgs[i].content, msgs[i].ts);
-        
-        if (used + entry_len + 2 >= out_cap) break;
-        
-        if (used > 0) {
-            out[used++] = ',';
-        }
-        memcpy(out + used, entry, entry_len);
-        used += entry_len;
-        out[used] = '\0';
-        count++;
+        // Chỉ cần 1 entry buffer dù history lớn đến đâu (sink streaming
+        // đẩy entry đi ngay thành frame bounded).
+        char entry[LINE_MAX + 160];
+        int n = snprintf(entry, sizeof(entry), "%d:%s:%.*s:%ld",
+                         msg_id, from_name,
+                         (int)(p3 - p2 - 1), p2 + 1, ts);
+        if (n < 0 || (size_t)n >= sizeof(entry)) continue; // record hỏng: bỏ
+
+        if (!emit(ud, entry)) break;
     }
-    
-    free(msgs);
-    pthread_mutex_unlock(&pm_mutex);
-    
+
+    munmap(map, map_size);
+    pthread_mutex_unlock(lock);
+
     return PM_OK;
 }
 
-int pm_get_conversations(int user_id, char* out, size_t out_cap)
+int pm_get_history(int user_id, const char* other_username,
+                   char* out, size_t out_cap, int limit, int before_msg_id)
 {
     if (!out) return PM_ERR_INTERNAL;
     out[0] = '\0';
-    
+
+    ProtoJoinBuf jb = { out, out_cap, 0 };
+    return pm_get_history_emit(user_id, other_username, limit, before_msg_id,
+                               proto_joinbuf_emit, &jb);
+}
+
+int pm_get_conversations_emit(int user_id, ProtoItemFn emit, void* ud)
+{
+    if (!emit) return PM_ERR_INTERNAL;
+
     char my_username[64];
     if (!accounts_get_username(user_id, my_username, sizeof(my_username))) {
         return PM_ERR_INTERNAL;
     }
-    
-    pthread_mutex_lock(&pm_mutex);
-    
-    DIR* dir = opendir(PM_DIR);
-    if (!dir) {
-        pthread_mutex_unlock(&pm_mutex);
-        return PM_OK;
-    }
-    
-    size_t used = 0;
-    struct dirent* entry;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        int id1, id2;
-        if (sscanf(entry->d_name, "%d_%d.txt", &id1, &id2) == 2) {
-            // Check if this conversation involves user_id
-            int other_id = -1;
-            if (id1 == user_id) other_id = id2;
-            else if (id2 == user_id) other_id = id1;
-            
-            if (other_id > 0) {
-                char other_username[64];
-                if (accounts_get_username(other_id, other_username, sizeof(other_username))) {
-                    // Count unread messages
-                    char filepath[512];
-                    snprintf(filepath, sizeof(filepath), "%s/%s", PM_DIR, entry->d_name);
-                    
-                    FILE* f = fopen(filepath, "r");
-                    int unread = 0;
-                    if (f) {
-                        char line[LINE_MAX];
-                        while (fgets(line, sizeof(line), f)) {
-                            int msg_id, from_id, read_flag;
-                            char content[2048];
-                            long ts;
-                            
-                            if (sscanf(line, "%d|%d|%2047[^|]|%ld|%d",
-                                       &msg_id, &from_id, content, &ts, &read_flag) >= 4) {
-                                // Unread = sent by other AND not read
-                                if (from_id == other_id && read_flag == 0) {
-                                    unread++;
-                                }
-                            }
-                        }
-                        fclose(f);
-                    }
-                    
-                    // Format: username:unread_count
-                    char conv_entry[128];
-                    int len = snprintf(conv_entry, sizeof(conv_entry), "%s:%d", 
-                                       other_username, unread);
-                    
-                    if (used + len + 2 >= out_cap) break;
-                    
-                    if (used > 0) {
-                        out[used++] = ',';
-                    }
-                    memcpy(out + used, conv_entry, len);
-                    used += len;
-                    out[used] = '\0';
-                }
-            }
+
+    // Walk bảng unread in-memory: không opendir, không đọc message file.
+    pthread_mutex_lock(&unread_mutex);
+
+    for (int i = 0; i < g_unread_count; i++) {
+        if (g_unread[i].user_id != user_id) continue;
+
+        char other_username[64];
+        if (!accounts_get_username(g_unread[i].other_id, other_username, sizeof(other_username))) {
+            continue;
         }
+
+        // Format: username:unread_count
+        char conv_entry[128];
+        snprintf(conv_entry, sizeof(conv_entry), "%s:%d",
+                 other_username, g_unread[i].unread);
+
+        if (!emit(ud, conv_entry)) break;
     }
-    
-    closedir(dir);
-    pthread_mutex_unlock(&pm_mutex);
-    
+
+    pthread_mutex_unlock(&unread_mutex);
+
     return PM_OK;
 }
 
+int pm_get_conversations(int user_id, char* out, size_t out_cap)
+{
+    if (!out) return PM_ERR_INTERNAL;
+    out[0] = '\0';
+
+    ProtoJoinBuf jb = { out, out_cap, 0 };
+    return pm_get_conversations_emit(user_id, proto_joinbuf_emit, &jb);
+}
+
 int pm_mark_read(int user_id, const char* other_username)
 {
     if (!other_username) return PM_ERR_INTERNAL;
@@ -407,49 +823,33 @@ int pm_mark_read(int user_id, const char* other_username)
     int other_id = accounts_get_user_id(other_username);
     if (other_id < 0) return PM_ERR_NOT_FOUND;
     
-    pthread_mutex_lock(&pm_mutex);
-    
-    char filepath[256];
-    get_pm_filepath(user_id, other_id, filepath, sizeof(filepath));
-    
-    FILE* in = fopen(filepath, "r");
-    if (!in) {
-        pthread_mutex_unlock(&pm_mutex);
-        return PM_OK;
-    }
-    
-    char tmppath[260];
-    snprintf(tmppath, sizeof(tmppath), "%s.tmp", filepath);
-    
-    FILE* out = fopen(tmppath, "w");
-    if (!out) {
-        fclose(in);
-        pthread_mutex_unlock(&pm_mutex);
+    // "Đã đọc tới đâu" = msg_id cao nhất đã cấp phát (counter toàn cục,
+    // tăng đơn điệu) — mọi message hiện có trong conversation đều <= nó.
+    // O(1), không đụng vào message file.
+    pthread_mutex_lock(&msg_id_mutex);
+    int latest_msg_id = g_next_msg_id - 1;
+    pthread_mutex_unlock(&msg_id_mutex);
+
+    pthread_mutex_lock(&wm_mutex);
+    WatermarkEntry* w = wm_find_or_add_unlocked(user_id, other_id);
+    if (!w) {
+        pthread_mutex_unlock(&wm_mutex);
         return PM_ERR_INTERNAL;
     }
-    
-    char line[LINE_MAX];
-    while (fgets(line, sizeof(line), in)) {
-        int msg_id, from_id, read_flag;
-        char content[2048];
-        long ts;
-        
-        if (sscanf(line, "%d|%d|%2047[^|]|%ld|%d",
-                   &msg_id, &from_id, content, &ts, &read_flag) >= 4) {
-            // Mark as read if from the other user
-            if (from_id == other_id) {
-                read_flag = 1;
-            }
-            fprintf(out, "%d|%d|%s|%ld|%d\n", msg_id, from_id, content, ts, read_flag);
-        } else {
-            fputs(line, out);
-        }
+    if (w->last_read_msg_id < latest_msg_id) {
+        w->last_read_msg_id = latest_msg_id;
+        wm_save_unlocked();
     }
-    
-    fclose(in);
-    fclose(out);
-    rename(tmppath, filepath);
-    
-    pthread_mutex_unlock(&pm_mutex);
+    pthread_mutex_unlock(&wm_mutex);
+
+    // Reset unread counter của (user, other)
+    pthread_mutex_lock(&unread_mutex);
+    UnreadEntry* e = unread_find_or_add_unlocked(user_id, other_id);
+    if (e && e->unread != 0) {
+        e->unread = 0;
+        unread_save_unlocked();
+    }
+    pthread_mutex_unlock(&unread_mutex);
+
     return PM_OK;
 }
@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 
+#include "../common/base64.h"
+#include "../common/protocol.h" // ProtoItemFn
+
 /*
  * server/messages.*
  * - Module Private Message (PM) - nhắn tin 1-1 giữa 2 user.
@@ -27,32 +30,35 @@ int pm_send(int from_user_id, const char* to_username,
 
 // Lấy history chat với user khác
 // Return format: "msg_id:from_id:content_base64:timestamp,..."
-// Message mới nhất trước, giới hạn bởi 'limit'
+// Message mới nhất trước, giới hạn bởi 'limit'.
+// before_msg_id > 0: chỉ lấy message CŨ HƠN msg_id đó (cursor để scroll
+// ngược từng trang; client dùng msg_id nhỏ nhất của trang làm cursor kế).
+// before_msg_id = 0: từ message mới nhất.
 int pm_get_history(int user_id, const char* other_username,
-                   char* out, size_t out_cap, int limit);
+                   char* out, size_t out_cap, int limit, int before_msg_id);
+
+// Biến thể streaming: đẩy từng entry "msg_id:from:content:ts" qua sink
+// (stream OK-PART) thay vì build vào buffer cố định. Sink trả 0 => dừng sớm.
+int pm_get_history_emit(int user_id, const char* other_username,
+                        int limit, int before_msg_id,
+                        ProtoItemFn emit, void* ud);
 
 // Lấy danh sách conversations (các user đã chat)
 // Return: "username:unread_count,..."
 int pm_get_conversations(int user_id, char* out, size_t out_cap);
 
-// Đánh dấu messages là đã đọc (khi vào chat với ai đó)
-int pm_mark_read(int user_id, const char* other_username);
-
-// ============ Base64 Utilities ============
-
-// Encode binary data thành Base64 string
-// Return độ dài chuỗi encoded, hoặc -1 nếu lỗi
-int base64_encode(const unsigned char* src, size_t src_len, 
-                  char* out, size_t out_cap);
+// Biến thể streaming của pm_get_conversations (entry "username:unread").
+int pm_get_conversations_emit(int user_id, ProtoItemFn emit, void* ud);
 
-// Decode Base64 string thành binary data
-// Return độ dài data decoded, hoặc -1 nếu lỗi
-int base64_decode(const char* src, unsigned char* out, size_t out_cap);
+// Đếm số tin đang pending (chưa notify/drain) từ from_user_id tới user_id.
+int pm_pending_count(int user_id, int from_user_id);
 
-// Helper: encode plain text to Base64 (convenience wrapper)
-int base64_encode_str(const char* text, char* out, size_t out_cap);
+// Drain toàn bộ pending notification của user thành "from1:count1,from2:count2"
+// (rỗng => out=""). Queue của user bị xóa sau khi drain.
+// Return: PM_OK.
+int pm_pending_drain(int user_id, char* out, size_t out_cap);
 
-// Helper: decode Base64 to plain text (convenience wrapper)
-int base64_decode_str(const char* b64, char* out, size_t out_cap);
+// Đánh dấu messages là đã đọc (khi vào chat với ai đó)
+int pm_mark_read(int user_id, const char* other_username);
 
 #endif
@@ -0,0 +1,176 @@
+#include "presence.h"
+#include "accounts.h"
+#include "friends.h"
+#include "sessions.h"
+#include "../common/protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * server/presence.c
+ * - Mỗi subscriber giữ 1 snapshot friend id (sorted, binary search khi
+ *   có transition). Subscriber là user đang online nên số lượng bị chặn
+ *   bởi số session active; 1 transition quét danh sách subscriber O(S log F).
+ * - Push được gửi sau khi nhả presence mutex (gom socket trước) để
+ *   send() chậm của 1 client không chặn subscribe/transition khác.
+ */
+
+#define PRESENCE_MAX_FRIENDS 256
+#define PRESENCE_MAX_NOTIFY  512
+
+typedef struct {
+    int user_id;
+    int* friends;     // sorted friend ids
+    int friend_count;
+} PresenceSub;
+
+static pthread_mutex_t g_pres_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PresenceSub* g_subs = NULL;
+static int g_sub_count = 0;
+static int g_sub_cap = 0;
+
+static int cmp_int(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+// Tìm subscriber theo user_id. Return index hoặc -1 (gọi khi giữ mutex).
+static int sub_find_unlocked(int user_id)
+{
+    for (int i = 0; i < g_sub_count; i++) {
+        if (g_subs[i].user_id == user_id) return i;
+    }
+    return -1;
+}
+
+// Gỡ subscriber tại index (swap-delete, gọi khi giữ mutex).
+static void sub_remove_unlocked(int i)
+{
+    free(g_subs[i].friends);
+    g_subs[i] = g_subs[g_sub_count - 1];
+    g_sub_count--;
+}
+
+static int sub_watches_unlocked(const PresenceSub* s, int user_id)
+{
+    int lo = 0, hi = s->friend_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (s->friends[mid] == user_id) return 1;
+        if (s->friends[mid] < user_id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return 0;
+}
+
+int presence_subscribe(int user_id)
+{
+    // Snapshot friend set TRƯỚC khi lock presence mutex (friends.c tự
+    // lock mutex riêng của nó; không nest 2 mutex).
+    int ids[PRESENCE_MAX_FRIENDS];
+    int n = friends_get_friend_ids(user_id, ids, PRESENCE_MAX_FRIENDS);
+    if (n < 0) return -1;
+
+    qsort(ids, (size_t)n, sizeof(int), cmp_int);
+
+    int* copy = NULL;
+    if (n > 0) {
+        copy = (int*)malloc((size_t)n * sizeof(int));
+        if (!copy) return -1;
+        memcpy(copy, ids, (size_t)n * sizeof(int));
+    }
+
+    pthread_mutex_lock(&g_pres_mutex);
+
+    int i = sub_find_unlocked(user_id);
+    if (i >= 0) {
+        // Re-subscribe: thay snapshot cũ (friend set có thể đã đổi).
+        free(g_subs[i].friends);
+        g_subs[i].friends = copy;
+        g_subs[i].friend_count = n;
+        pthread_mutex_unlock(&g_pres_mutex);
+        return n;
+    }
+
+    if (g_sub_count >= g_sub_cap) {
+        int new_cap = g_sub_cap ? g_sub_cap * 2 : 16;
+        PresenceSub* next = (PresenceSub*)realloc(g_subs, (size_t)new_cap * sizeof(PresenceSub));
+        if (!next) {
+            pthread_mutex_unlock(&g_pres_mutex);
+            free(copy);
+            return -1;
+        }
+        g_subs = next;
+        g_sub_cap = new_cap;
+    }
+
+    g_subs[g_sub_count].user_id = user_id;
+    g_subs[g_sub_count].friends = copy;
+    g_subs[g_sub_count].friend_count = n;
+    g_sub_count++;
+
+    pthread_mutex_unlock(&g_pres_mutex);
+    return n;
+}
+
+int presence_unsubscribe(int user_id)
+{
+    pthread_mutex_lock(&g_pres_mutex);
+    int i = sub_find_unlocked(user_id);
+    if (i >= 0) {
+        sub_remove_unlocked(i);
+    }
+    pthread_mutex_unlock(&g_pres_mutex);
+    return PRESENCE_OK;
+}
+
+void presence_on_transition(int user_id, int online)
+{
+    int notify_ids[PRESENCE_MAX_NOTIFY];
+    int notify_count = 0;
+
+    pthread_mutex_lock(&g_pres_mutex);
+
+    if (g_sub_count == 0) {
+        pthread_mutex_unlock(&g_pres_mutex);
+        return;
+    }
+
+    for (int i = 0; i < g_sub_count && notify_count < PRESENCE_MAX_NOTIFY; i++) {
+        if (g_subs[i].user_id != user_id && sub_watches_unlocked(&g_subs[i], user_id)) {
+            notify_ids[notify_count++] = g_subs[i].user_id;
+        }
+    }
+
+    // User offline thì subscription của chính họ cũng hết tác dụng.
+    if (!online) {
+        int i = sub_find_unlocked(user_id);
+        if (i >= 0) {
+            sub_remove_unlocked(i);
+        }
+    }
+
+    pthread_mutex_unlock(&g_pres_mutex);
+
+    if (notify_count == 0) return;
+
+    char username[64];
+    if (!accounts_get_username(user_id, username, sizeof(username))) {
+        return;
+    }
+
+    char push_msg[160];
+    int push_len = snprintf(push_msg, sizeof(push_msg),
+                            "PUSH PRESENCE user=%s status=%s\r\n",
+                            username, online ? "online" : "offline");
+
+    for (int i = 0; i < notify_count; i++) {
+        int sock = sessions_get_socket(notify_ids[i]);
+        if (sock >= 0) {
+            proto_send_push(sock, push_msg, (size_t)push_len);
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+/*
+ * server/presence.*
+ * - Presence service: push "PUSH PRESENCE user=... status=online|offline"
+ *   cho các user đã subscribe khi bạn của họ login/logout/disconnect,
+ *   thay cho việc client re-poll FRIEND_LIST để refresh online status.
+ * - Subscribe qua verb PRESENCE_SUB: snapshot friend set của user tại
+ *   thời điểm subscribe (friends_get_friend_ids); PRESENCE_UNSUB hoặc
+ *   offline thì gỡ.
+ * - Transition được sessions.c publish qua hook (đăng ký lúc startup),
+ *   gọi NGOÀI session mutex nên push không chặn validate/create.
+ */
+
+#define PRESENCE_OK           0
+#define PRESENCE_ERR_INTERNAL 1
+
+// Subscribe user vào presence của friend set hiện tại.
+// Return số friend được theo dõi (>= 0), hoặc -1 nếu lỗi.
+int presence_subscribe(int user_id);
+
+// Gỡ subscription của user (idempotent).
+int presence_unsubscribe(int user_id);
+
+// Hook cho sessions.c: user_id vừa chuyển online (1) / offline (0).
+// Push PRESENCE tới mọi subscriber có user này trong friend set.
+void presence_on_transition(int user_id, int online);
+
+#endif
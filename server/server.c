@@ -8,19 +8,30 @@
 #include <arpa/inet.h>
 
 #include "../common/framing.h"
+#include "../common/protocol.h"
 #include "handlers.h"
 #include "accounts.h"
+#include "friends.h"
+#include "journal.h"
+#include "presence.h"
 #include "sessions.h"
 #include "messages.h"
+#include "groups.h"
 #include "group_messages.h"
+#include "logger.h"
+#include "event_loop.h"
 
 /*
  * server/server.c
- * - TCP server dạng thread-per-connection (mỗi client 1 pthread).
- * - Mỗi thread đọc line bằng framer_recv_line() và dispatch qua handle_request().
+ * - TCP server với 2 chế độ:
+ *   + thread (mặc định): thread-per-connection, mỗi client 1 pthread.
+ *   + epoll: event-loop với worker pool cố định (xem server/event_loop.*),
+ *     dùng khi cần giữ nhiều connection mà không tốn thread/stack per socket.
+ * - Mỗi connection đọc line qua LineFramer và dispatch qua handle_request().
  *
  * Usage:
- *   ./build/server <port> [session_timeout_seconds]
+ *   ./build/server <port> [session_timeout_seconds] [mode]
+ *   mode: "thread" (default) hoặc "epoll" / "epoll:<num_workers>"
  */
 
 typedef struct {
@@ -28,6 +39,20 @@ typedef struct {
     struct sockaddr_in addr;
 } ClientArgs;
 
+// Replay journal 2 pass: account trước (friends_init cần map username ->
+// user_id đầy đủ để build index), friend sau. Record lạ: bỏ qua.
+static int journal_replay_acc(const char* rec)
+{
+    if (strncmp(rec, "ACC|", 4) == 0) return accounts_replay_journal(rec);
+    return 0;
+}
+
+static int journal_replay_frn(const char* rec)
+{
+    if (strncmp(rec, "FRN|", 4) == 0) return friends_replay_journal(rec);
+    return 0;
+}
+
 static void* client_thread(void* arg)
 {
     /*
@@ -42,22 +67,50 @@ static void* client_thread(void* arg)
     LineFramer fr;
     framer_init(&fr, 2048);
 
+    // Arena per-connection: payload parse + scratch, reset sau mỗi request
+    ProtoArena arena;
+    proto_arena_init(&arena, 0);
+
     ServerCtx ctx;
     ctx.client_sock = c;
+    ctx.arena = &arena;
+    ctx.framer = &fr;
+
+    // fd có thể được OS tái sử dụng: reset framing mode của connection trước.
+    proto_set_binary(c, 0);
 
     char line[4096];
-    for (;;) {
+    int running = 1;
+    while (running) {
         int r = framer_recv_line(c, &fr, line, sizeof(line));
-        if (r == 0) break;
-        if (r < 0) break;
-        // handle_request trả về -1 khi cần đóng connection (DISCONNECT)
-        if (handle_request(&ctx, line) < 0) break;
+        if (r <= 0) break;
+
+        // Batch: xử lý line vừa nhận + mọi line client đã pipeline sẵn trong
+        // buffer; toàn bộ response được gom vào output buffer và flush 1 lần
+        // trước khi block chờ recv tiếp theo.
+        proto_out_begin(c);
+        for (;;) {
+            // handle_request trả về -1 khi cần đóng connection (DISCONNECT)
+            if (handle_request(&ctx, line) < 0) {
+                running = 0;
+                break;
+            }
+            int popped = framer_pop_line(&fr, line, sizeof(line));
+            if (popped == 0) break;
+            if (popped < 0) {
+                running = 0;
+                break;
+            }
+        }
+        proto_out_end(c);
     }
 
     // Auto-destroy session when socket disconnects
     sessions_remove_by_socket(c);
 
+    proto_arena_destroy(&arena);
     framer_free(&fr);
+    proto_out_close(c); // dọn hàng đợi push trước khi fd được OS tái sử dụng
     close(c);
     free(a);
     return NULL;
@@ -98,9 +151,19 @@ int main(int argc, char** argv)
 
     unsigned short port = 8888;
     int session_timeout_seconds = 3600;
+    int use_epoll = 0;
+    int epoll_workers = EVLOOP_DEFAULT_WORKERS;
 
     if (argc >= 2) port = (unsigned short)atoi(argv[1]);
     if (argc >= 3) session_timeout_seconds = atoi(argv[2]);
+    if (argc >= 4 && strncmp(argv[3], "epoll", 5) == 0) {
+        use_epoll = 1;
+        // Cho phép chỉ định số worker: "epoll:8"
+        if (argv[3][5] == ':') {
+            int n = atoi(argv[3] + 6);
+            if (n > 0) epoll_workers = n;
+        }
+    }
 
     // File DB được tạo tự động nếu chưa có.
     if (accounts_init("data/users.db") != 0) {
@@ -108,6 +171,30 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // Journal group-commit cho mutation account/friend: replay record
+    // chưa compact từ lần chạy trước, rồi checkpoint để journal gọn lại.
+    if (journal_init("data/journal.log", accounts_compact) != 0) {
+        printf("Failed to init journal\n");
+        return 1;
+    }
+    journal_replay(journal_replay_acc);
+
+    // Load friends.db vào adjacency index - sau replay account (cần đủ
+    // map username -> user_id) và trước replay friend (replay đi qua
+    // path apply của friends.c nên tự cập nhật index).
+    friends_init();
+
+    journal_replay(journal_replay_frn);
+    if (journal_pending() > 0) {
+        journal_checkpoint();
+    }
+
+    // Bật async logger (flusher thread) trước khi nhận request
+    logger_init();
+
+    // Load cache group + membership vào bộ nhớ
+    groups_init();
+
     // Initialize PM module
     pm_init();
 
@@ -116,13 +203,28 @@ int main(int argc, char** argv)
 
     sessions_init(session_timeout_seconds);
 
+    // Publish online/offline transition cho presence service (PUSH PRESENCE)
+    sessions_set_presence_hook(presence_on_transition);
+
     int s = listen_on(port);
     if (s < 0) {
         printf("Failed to listen on port %d\n", (int)port);
         return 1;
     }
 
-    printf("Server listening on 0.0.0.0:%d (session_timeout=%ds)\n", (int)port, session_timeout_seconds);
+    printf("Server listening on 0.0.0.0:%d (session_timeout=%ds, mode=%s)\n",
+           (int)port, session_timeout_seconds, use_epoll ? "epoll" : "thread");
+
+    if (use_epoll) {
+        // Event-loop mode: không quay lại accept loop bên dưới.
+        if (event_loop_run(s, epoll_workers) != 0) {
+            printf("Event loop failed\n");
+            close(s);
+            return 1;
+        }
+        close(s);
+        return 0;
+    }
 
     for (;;) {
         struct sockaddr_in caddr;
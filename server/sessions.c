@@ -1,4 +1,4 @@
-﻿#include "sessions.h"
+#include "sessions.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -9,12 +9,24 @@
 /*
  * server/sessions.c
  * - Session in-memory: tối đa MAX_SESSIONS.
+ * - Store xây quanh 3 hash index (token -> slot, user_id -> slot,
+ *   socket -> slot) nên validate/lookup trên hot path là O(1) thay vì
+ *   scan tuyến tính toàn bộ bảng.
  * - sessions_validate() sẽ cập nhật last_activity để tính timeout.
+ * - Expiry chạy ngoài request path: min-heap theo thời điểm hết hạn +
+ *   reaper thread riêng (xem "Expiry heap + reaper" bên dưới), nên chi
+ *   phí validate không phụ thuộc kích thước bảng.
  * - Khi client disconnect, server gọi sessions_remove_by_socket() để cleanup.
  * - Hỗ trợ chat_partner tracking cho real-time PM push.
  */
 
-#define MAX_SESSIONS 1000
+#define MAX_SESSIONS 10000
+
+// Index table: power of two, >= 2 * MAX_SESSIONS để probe ngắn.
+#define IDX_CAP 32768
+#define IDX_MASK (IDX_CAP - 1)
+#define IDX_EMPTY 0
+#define IDX_TOMBSTONE -1
 
 typedef struct {
     int active;
@@ -25,12 +37,28 @@ typedef struct {
     time_t last_activity;
     int chat_partner_id;  // User ID của partner đang chat 1-1 (0 nếu không trong PM mode)
     int chat_group_id;    // Group ID đang chat (0 nếu không trong group chat mode)
+    int notify_pm;        // 1 = đã subscribe PUSH PM_UNREAD (PM_NOTIFY_SUB)
+    unsigned gen;         // Generation: tăng mỗi lần clear slot (phát hiện heap entry cũ)
 } Session;
 
 static pthread_mutex_t g_sess_mutex = PTHREAD_MUTEX_INITIALIZER;
 static Session g_sessions[MAX_SESSIONS];
 static int g_timeout = 3600;
 
+// Presence hook: publish online/offline transition (gọi ngoài mutex).
+static SessionPresenceHook g_presence_hook = NULL;
+
+// 3 bảng index open-addressing: chứa slot+1; 0 = trống, -1 = tombstone.
+// Policy 1 user/1 socket chỉ có 1 session active nên map là 1:1.
+static int g_idx_token[IDX_CAP];
+static int g_idx_user[IDX_CAP];
+static int g_idx_socket[IDX_CAP];
+static int g_tombstones = 0;
+
+// Free list các slot chưa dùng để cấp phát O(1).
+static int g_free_slots[MAX_SESSIONS];
+static int g_free_count = 0;
+
 /*
  * seed_once
  * - Seed RNG đúng 1 lần (phục vụ việc generate token).
@@ -56,17 +84,304 @@ static void generate_token(char out[SESS_TOKEN_LEN + 1])
     out[SESS_TOKEN_LEN] = 0;
 }
 
-static void cleanup_expired_unlocked(void)
+// ============ Hash Index (gọi khi đang giữ mutex) ============
+
+static unsigned long long hash_str(const char* s)
 {
-    // Gọi khi đang giữ mutex: dọn các session đã quá hạn theo last_activity.
-    time_t now = time(NULL);
+    // FNV-1a 64-bit
+    unsigned long long h = 1469598103934665603ULL;
+    while (*s) {
+        h ^= (unsigned char)(*s++);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long hash_int(int v)
+{
+    // Knuth multiplicative hash
+    return (unsigned long long)((unsigned int)v * 2654435761u);
+}
+
+/*
+ * idx_insert
+ * - Chèn slot vào bảng; tái sử dụng tombstone đầu tiên gặp được.
+ */
+static void idx_insert(int* table, unsigned long long hash, int slot)
+{
+    size_t i = (size_t)hash & IDX_MASK;
+    size_t reuse = (size_t)-1;
+    while (table[i] != IDX_EMPTY) {
+        if (table[i] == IDX_TOMBSTONE && reuse == (size_t)-1) reuse = i;
+        i = (i + 1) & IDX_MASK;
+    }
+    if (reuse != (size_t)-1) {
+        i = reuse;
+        g_tombstones--;
+    }
+    table[i] = slot + 1;
+}
+
+/*
+ * idx_remove
+ * - Xóa slot khỏi bảng (đánh tombstone để không đứt chuỗi probe).
+ */
+static void idx_remove(int* table, unsigned long long hash, int slot)
+{
+    size_t i = (size_t)hash & IDX_MASK;
+    while (table[i] != IDX_EMPTY) {
+        if (table[i] == slot + 1) {
+            table[i] = IDX_TOMBSTONE;
+            g_tombstones++;
+            return;
+        }
+        i = (i + 1) & IDX_MASK;
+    }
+}
+
+// Tìm slot theo token. Return slot hoặc -1.
+static int idx_find_token(const char* token)
+{
+    size_t i = (size_t)hash_str(token) & IDX_MASK;
+    while (g_idx_token[i] != IDX_EMPTY) {
+        if (g_idx_token[i] > 0) {
+            int slot = g_idx_token[i] - 1;
+            if (g_sessions[slot].active && strcmp(g_sessions[slot].token, token) == 0) {
+                return slot;
+            }
+        }
+        i = (i + 1) & IDX_MASK;
+    }
+    return -1;
+}
+
+// Tìm slot theo user_id. Return slot hoặc -1.
+static int idx_find_user(int user_id)
+{
+    size_t i = (size_t)hash_int(user_id) & IDX_MASK;
+    while (g_idx_user[i] != IDX_EMPTY) {
+        if (g_idx_user[i] > 0) {
+            int slot = g_idx_user[i] - 1;
+            if (g_sessions[slot].active && g_sessions[slot].user_id == user_id) {
+                return slot;
+            }
+        }
+        i = (i + 1) & IDX_MASK;
+    }
+    return -1;
+}
+
+// Tìm slot theo socket. Return slot hoặc -1.
+static int idx_find_socket(int client_socket)
+{
+    size_t i = (size_t)hash_int(client_socket) & IDX_MASK;
+    while (g_idx_socket[i] != IDX_EMPTY) {
+        if (g_idx_socket[i] > 0) {
+            int slot = g_idx_socket[i] - 1;
+            if (g_sessions[slot].active && g_sessions[slot].client_socket == client_socket) {
+                return slot;
+            }
+        }
+        i = (i + 1) & IDX_MASK;
+    }
+    return -1;
+}
+
+/*
+ * idx_rehash_if_needed
+ * - Tombstone tích tụ làm chuỗi probe dài ra; khi vượt 1/4 bảng thì
+ *   rebuild cả 3 bảng từ slot array (hiếm, O(MAX_SESSIONS)).
+ */
+static void idx_rehash_if_needed(void)
+{
+    if (g_tombstones < IDX_CAP / 4) return;
+
+    memset(g_idx_token, 0, sizeof(g_idx_token));
+    memset(g_idx_user, 0, sizeof(g_idx_user));
+    memset(g_idx_socket, 0, sizeof(g_idx_socket));
+    g_tombstones = 0;
+
     for (int i = 0; i < MAX_SESSIONS; i++) {
         if (g_sessions[i].active) {
-            if ((int)(now - g_sessions[i].last_activity) >= g_timeout) {
-                g_sessions[i].active = 0;
+            idx_insert(g_idx_token, hash_str(g_sessions[i].token), i);
+            idx_insert(g_idx_user, hash_int(g_sessions[i].user_id), i);
+            idx_insert(g_idx_socket, hash_int(g_sessions[i].client_socket), i);
+        }
+    }
+}
+
+/*
+ * session_clear_unlocked
+ * - Hủy 1 session: gỡ khỏi 3 index, trả slot về free list.
+ * - Tăng gen để heap entry còn sót của slot này bị reaper bỏ qua.
+ */
+static void session_clear_unlocked(int slot)
+{
+    Session* s = &g_sessions[slot];
+    if (!s->active) return;
+
+    idx_remove(g_idx_token, hash_str(s->token), slot);
+    idx_remove(g_idx_user, hash_int(s->user_id), slot);
+    idx_remove(g_idx_socket, hash_int(s->client_socket), slot);
+    s->active = 0;
+    s->gen++;
+
+    g_free_slots[g_free_count++] = slot;
+    idx_rehash_if_needed();
+}
+
+// ============ Expiry heap + reaper ============
+
+/*
+ * Min-heap các thời điểm hết hạn, phục vụ bởi reaper thread riêng thay
+ * cho sweep O(MAX_SESSIONS) trong validate/create như trước:
+ * - Mỗi session active có đúng 1 entry trong heap (push lúc create).
+ * - Touch (validate) KHÔNG đụng heap: chỉ cập nhật last_activity. Khi
+ *   entry lên đỉnh heap, reaper so với last_activity thật - session còn
+ *   sống thì push lại với hạn mới (lazy re-insert), hết hạn thì clear.
+ * - Entry của session đã bị destroy/logout nhận diện qua (slot, gen)
+ *   lệch và bị bỏ qua khi pop; heap đầy thì nén bỏ entry cũ.
+ * - Validate vẫn tự chặn session quá hạn theo timestamp nên reaper chỉ
+ *   là dọn rác, không ảnh hưởng tính đúng.
+ */
+typedef struct {
+    time_t expire_at;
+    int slot;
+    unsigned gen;
+} ExpiryEnt;
+
+#define HEAP_CAP (MAX_SESSIONS * 2)
+
+static ExpiryEnt g_heap[HEAP_CAP];
+static int g_heap_count = 0;
+static pthread_cond_t g_reaper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_reaper_tid;
+static int g_reaper_running = 0;
+
+static void heap_sift_up_unlocked(int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (g_heap[parent].expire_at <= g_heap[i].expire_at) break;
+        ExpiryEnt tmp = g_heap[parent];
+        g_heap[parent] = g_heap[i];
+        g_heap[i] = tmp;
+        i = parent;
+    }
+}
+
+static void heap_sift_down_unlocked(int i)
+{
+    for (;;) {
+        int left = 2 * i + 1, right = 2 * i + 2, min = i;
+        if (left < g_heap_count && g_heap[left].expire_at < g_heap[min].expire_at) min = left;
+        if (right < g_heap_count && g_heap[right].expire_at < g_heap[min].expire_at) min = right;
+        if (min == i) break;
+        ExpiryEnt tmp = g_heap[min];
+        g_heap[min] = g_heap[i];
+        g_heap[i] = tmp;
+        i = min;
+    }
+}
+
+static void heap_push_unlocked(time_t expire_at, int slot, unsigned gen)
+{
+    if (g_heap_count >= HEAP_CAP) {
+        // Heap đầy vì entry cũ (session đã logout) chưa trôi lên đỉnh:
+        // nén lại, chỉ giữ entry còn khớp (slot, gen) active. Hiếm.
+        int n = 0;
+        for (int i = 0; i < g_heap_count; i++) {
+            int s = g_heap[i].slot;
+            if (g_sessions[s].active && g_sessions[s].gen == g_heap[i].gen) {
+                g_heap[n++] = g_heap[i];
             }
         }
+        g_heap_count = n;
+        for (int i = g_heap_count / 2 - 1; i >= 0; i--) {
+            heap_sift_down_unlocked(i);
+        }
+        if (g_heap_count >= HEAP_CAP) return; // không thể xảy ra: <=1 entry/session
     }
+
+    g_heap[g_heap_count].expire_at = expire_at;
+    g_heap[g_heap_count].slot = slot;
+    g_heap[g_heap_count].gen = gen;
+    heap_sift_up_unlocked(g_heap_count);
+    g_heap_count++;
+}
+
+static ExpiryEnt heap_pop_unlocked(void)
+{
+    ExpiryEnt top = g_heap[0];
+    g_heap_count--;
+    if (g_heap_count > 0) {
+        g_heap[0] = g_heap[g_heap_count];
+        heap_sift_down_unlocked(0);
+    }
+    return top;
+}
+
+/*
+ * reaper_main
+ * - Ngủ tới hạn của entry đỉnh heap (hoặc 1s khi heap rỗng), pop các
+ *   entry tới hạn và clear session thật sự quá hạn.
+ * - Entry mới luôn có hạn >= đỉnh hiện tại (now + timeout) nên ngủ tới
+ *   hạn đỉnh không bao giờ bỏ sót session mới.
+ */
+static void* reaper_main(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&g_sess_mutex);
+
+    while (g_reaper_running) {
+        time_t now = time(NULL);
+
+        // Gom user_id hết hạn để publish presence NGOÀI mutex (quá 128
+        // trong 1 lượt thì chỉ mất push, session vẫn bị dọn đúng).
+        int expired_ids[128];
+        int expired_count = 0;
+
+        while (g_heap_count > 0 && g_heap[0].expire_at <= now) {
+            ExpiryEnt e = heap_pop_unlocked();
+            Session* s = &g_sessions[e.slot];
+
+            if (!s->active || s->gen != e.gen) continue; // entry cũ
+
+            time_t expire_at = s->last_activity + g_timeout;
+            if (expire_at <= now) {
+                if (expired_count < (int)(sizeof(expired_ids) / sizeof(expired_ids[0]))) {
+                    expired_ids[expired_count++] = s->user_id;
+                }
+                session_clear_unlocked(e.slot);
+            } else {
+                // Session được touch sau khi push: đẩy lại với hạn mới.
+                heap_push_unlocked(expire_at, e.slot, e.gen);
+            }
+        }
+
+        if (expired_count > 0 && g_presence_hook) {
+            pthread_mutex_unlock(&g_sess_mutex);
+            for (int i = 0; i < expired_count; i++) {
+                g_presence_hook(expired_ids[i], 0);
+            }
+            pthread_mutex_lock(&g_sess_mutex);
+        }
+
+        struct timespec ts;
+        ts.tv_sec = (g_heap_count > 0) ? g_heap[0].expire_at : now + 1;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&g_reaper_cond, &g_sess_mutex, &ts);
+    }
+
+    pthread_mutex_unlock(&g_sess_mutex);
+    return NULL;
+}
+
+void sessions_set_presence_hook(SessionPresenceHook hook)
+{
+    pthread_mutex_lock(&g_sess_mutex);
+    g_presence_hook = hook;
+    pthread_mutex_unlock(&g_sess_mutex);
 }
 
 void sessions_init(int timeout_seconds)
@@ -74,7 +389,26 @@ void sessions_init(int timeout_seconds)
     // Reset toàn bộ store; timeout_seconds <=0 => dùng mặc định 3600s.
     pthread_mutex_lock(&g_sess_mutex);
     memset(g_sessions, 0, sizeof(g_sessions));
+    memset(g_idx_token, 0, sizeof(g_idx_token));
+    memset(g_idx_user, 0, sizeof(g_idx_user));
+    memset(g_idx_socket, 0, sizeof(g_idx_socket));
+    g_tombstones = 0;
+    g_free_count = 0;
+    for (int i = MAX_SESSIONS - 1; i >= 0; i--) {
+        g_free_slots[g_free_count++] = i;
+    }
     g_timeout = timeout_seconds > 0 ? timeout_seconds : 3600;
+    g_heap_count = 0;
+
+    // Khởi động reaper thread đúng 1 lần (init lại chỉ reset store).
+    if (!g_reaper_running) {
+        g_reaper_running = 1;
+        if (pthread_create(&g_reaper_tid, NULL, reaper_main, NULL) != 0) {
+            g_reaper_running = 0;
+        } else {
+            pthread_detach(g_reaper_tid);
+        }
+    }
     pthread_mutex_unlock(&g_sess_mutex);
 }
 
@@ -82,17 +416,15 @@ int sessions_is_user_logged_in(int user_id, int exclude_socket)
 {
     // Trả 1 nếu user_id đã có session active trên socket khác (chặn multi-login).
     pthread_mutex_lock(&g_sess_mutex);
-    cleanup_expired_unlocked();
 
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id && g_sessions[i].client_socket != exclude_socket) {
-            pthread_mutex_unlock(&g_sess_mutex);
-            return 1;
-        }
-    }
+    // Session quá hạn nhưng reaper chưa kịp dọn không tính là online.
+    int slot = idx_find_user(user_id);
+    int logged_in = (slot >= 0 &&
+                     (int)(time(NULL) - g_sessions[slot].last_activity) < g_timeout &&
+                     g_sessions[slot].client_socket != exclude_socket);
 
     pthread_mutex_unlock(&g_sess_mutex);
-    return 0;
+    return logged_in;
 }
 
 int sessions_create(int user_id, int client_socket, char out_token[SESS_TOKEN_LEN + 1])
@@ -104,38 +436,39 @@ int sessions_create(int user_id, int client_socket, char out_token[SESS_TOKEN_LE
      * - 1 user chỉ login được ở 1 socket tại 1 thời điểm (SESS_ERR_ALREADY).
      */
     pthread_mutex_lock(&g_sess_mutex);
-    cleanup_expired_unlocked();
 
     // Avoid multiple active tokens per connection
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].client_socket == client_socket) {
-            g_sessions[i].active = 0;
+    int old_user = 0;
+    int old_slot = idx_find_socket(client_socket);
+    if (old_slot >= 0) {
+        // Socket đổi chủ (user khác login trên cùng connection): user cũ offline.
+        if (g_sessions[old_slot].user_id != user_id) {
+            old_user = g_sessions[old_slot].user_id;
         }
+        session_clear_unlocked(old_slot);
     }
 
     // Prevent multi-login from different sockets
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id && g_sessions[i].client_socket != client_socket) {
+    int user_slot = idx_find_user(user_id);
+    if (user_slot >= 0 && g_sessions[user_slot].client_socket != client_socket) {
+        // Session cũ đã quá hạn (reaper chưa kịp dọn) thì không chặn login mới.
+        if ((int)(time(NULL) - g_sessions[user_slot].last_activity) < g_timeout) {
             pthread_mutex_unlock(&g_sess_mutex);
             return SESS_ERR_ALREADY;
         }
+        session_clear_unlocked(user_slot);
     }
 
-    int slot = -1;
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (!g_sessions[i].active) {
-            slot = i;
-            break;
-        }
-    }
-
-    if (slot < 0) {
+    if (g_free_count == 0) {
         pthread_mutex_unlock(&g_sess_mutex);
         return SESS_ERR_FULL;
     }
 
+    int slot = g_free_slots[--g_free_count];
     Session* s = &g_sessions[slot];
+    unsigned gen = s->gen; // giữ generation qua các lần tái sử dụng slot
     memset(s, 0, sizeof(*s));
+    s->gen = gen;
     s->active = 1;
     s->user_id = user_id;
     s->client_socket = client_socket;
@@ -145,19 +478,28 @@ int sessions_create(int user_id, int client_socket, char out_token[SESS_TOKEN_LE
     // Ensure uniqueness best-effort
     for (int attempt = 0; attempt < 10; attempt++) {
         generate_token(s->token);
-        int dup = 0;
-        for (int i = 0; i < MAX_SESSIONS; i++) {
-            if (i != slot && g_sessions[i].active && strcmp(g_sessions[i].token, s->token) == 0) {
-                dup = 1;
-                break;
-            }
-        }
-        if (!dup) break;
+        if (idx_find_token(s->token) < 0) break;
+    }
+
+    idx_insert(g_idx_token, hash_str(s->token), slot);
+    idx_insert(g_idx_user, hash_int(s->user_id), slot);
+    idx_insert(g_idx_socket, hash_int(s->client_socket), slot);
+
+    // Entry duy nhất của session trong expiry heap; đánh thức reaper
+    // nếu nó đang ngủ dài hơn hạn này (heap trước đó rỗng).
+    heap_push_unlocked(s->last_activity + g_timeout, slot, s->gen);
+    if (g_heap_count == 1) {
+        pthread_cond_signal(&g_reaper_cond);
     }
 
     strcpy(out_token, s->token);
 
     pthread_mutex_unlock(&g_sess_mutex);
+
+    if (g_presence_hook) {
+        if (old_user > 0) g_presence_hook(old_user, 0);
+        g_presence_hook(user_id, 1);
+    }
     return SESS_OK;
 }
 
@@ -168,25 +510,24 @@ int sessions_validate(const char* token, int* out_user_id)
     if (!token || !token[0]) return SESS_ERR_NOT_FOUND;
 
     pthread_mutex_lock(&g_sess_mutex);
-    cleanup_expired_unlocked();
 
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && strcmp(g_sessions[i].token, token) == 0) {
-            time_t now = time(NULL);
-            if ((int)(now - g_sessions[i].last_activity) >= g_timeout) {
-                g_sessions[i].active = 0;
-                pthread_mutex_unlock(&g_sess_mutex);
-                return SESS_ERR_EXPIRED;
-            }
-            g_sessions[i].last_activity = now;
-            if (out_user_id) *out_user_id = g_sessions[i].user_id;
-            pthread_mutex_unlock(&g_sess_mutex);
-            return SESS_OK;
-        }
+    int slot = idx_find_token(token);
+    if (slot < 0) {
+        pthread_mutex_unlock(&g_sess_mutex);
+        return SESS_ERR_NOT_FOUND;
+    }
+
+    time_t now = time(NULL);
+    if ((int)(now - g_sessions[slot].last_activity) >= g_timeout) {
+        session_clear_unlocked(slot);
+        pthread_mutex_unlock(&g_sess_mutex);
+        return SESS_ERR_EXPIRED;
     }
 
+    g_sessions[slot].last_activity = now;
+    if (out_user_id) *out_user_id = g_sessions[slot].user_id;
     pthread_mutex_unlock(&g_sess_mutex);
-    return SESS_ERR_NOT_FOUND;
+    return SESS_OK;
 }
 
 int sessions_destroy(const char* token)
@@ -195,12 +536,13 @@ int sessions_destroy(const char* token)
     if (!token || !token[0]) return SESS_ERR_NOT_FOUND;
 
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && strcmp(g_sessions[i].token, token) == 0) {
-            g_sessions[i].active = 0;
-            pthread_mutex_unlock(&g_sess_mutex);
-            return SESS_OK;
-        }
+    int slot = idx_find_token(token);
+    if (slot >= 0) {
+        int user_id = g_sessions[slot].user_id;
+        session_clear_unlocked(slot);
+        pthread_mutex_unlock(&g_sess_mutex);
+        if (g_presence_hook) g_presence_hook(user_id, 0);
+        return SESS_OK;
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return SESS_ERR_NOT_FOUND;
@@ -209,13 +551,16 @@ int sessions_destroy(const char* token)
 void sessions_remove_by_socket(int client_socket)
 {
     // Cleanup theo socket (gọi khi client disconnect để tránh session treo).
+    int user_id = 0;
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].client_socket == client_socket) {
-            g_sessions[i].active = 0;
-        }
+    int slot = idx_find_socket(client_socket);
+    if (slot >= 0) {
+        user_id = g_sessions[slot].user_id;
+        session_clear_unlocked(slot);
     }
     pthread_mutex_unlock(&g_sess_mutex);
+
+    if (user_id > 0 && g_presence_hook) g_presence_hook(user_id, 0);
 }
 
 int sessions_is_online(int user_id)
@@ -230,11 +575,9 @@ int sessions_is_online(int user_id)
 void sessions_set_chat_partner(int user_id, int partner_user_id)
 {
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id) {
-            g_sessions[i].chat_partner_id = partner_user_id;
-            break;
-        }
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        g_sessions[slot].chat_partner_id = partner_user_id;
     }
     pthread_mutex_unlock(&g_sess_mutex);
 }
@@ -243,11 +586,9 @@ int sessions_get_chat_partner(int user_id)
 {
     int partner = 0;
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id) {
-            partner = g_sessions[i].chat_partner_id;
-            break;
-        }
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        partner = g_sessions[slot].chat_partner_id;
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return partner;
@@ -257,11 +598,9 @@ int sessions_get_socket(int user_id)
 {
     int sock = -1;
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id) {
-            sock = g_sessions[i].client_socket;
-            break;
-        }
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        sock = g_sessions[slot].client_socket;
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return sock;
@@ -271,13 +610,9 @@ int sessions_is_chatting_with(int user_id, int partner_user_id)
 {
     int result = 0;
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && 
-            g_sessions[i].user_id == user_id &&
-            g_sessions[i].chat_partner_id == partner_user_id) {
-            result = 1;
-            break;
-        }
+    int slot = idx_find_user(user_id);
+    if (slot >= 0 && g_sessions[slot].chat_partner_id == partner_user_id) {
+        result = 1;
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return result;
@@ -288,14 +623,12 @@ int sessions_is_chatting_with(int user_id, int partner_user_id)
 void sessions_set_chat_group(int user_id, int group_id)
 {
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id) {
-            g_sessions[i].chat_group_id = group_id;
-            // Clear PM partner khi vào group chat
-            if (group_id > 0) {
-                g_sessions[i].chat_partner_id = 0;
-            }
-            break;
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        g_sessions[slot].chat_group_id = group_id;
+        // Clear PM partner khi vào group chat
+        if (group_id > 0) {
+            g_sessions[slot].chat_partner_id = 0;
         }
     }
     pthread_mutex_unlock(&g_sess_mutex);
@@ -305,11 +638,9 @@ int sessions_get_chat_group(int user_id)
 {
     int group_id = 0;
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && g_sessions[i].user_id == user_id) {
-            group_id = g_sessions[i].chat_group_id;
-            break;
-        }
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        group_id = g_sessions[slot].chat_group_id;
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return group_id;
@@ -319,13 +650,9 @@ int sessions_is_in_group_chat(int user_id, int group_id)
 {
     int result = 0;
     pthread_mutex_lock(&g_sess_mutex);
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (g_sessions[i].active && 
-            g_sessions[i].user_id == user_id &&
-            g_sessions[i].chat_group_id == group_id) {
-            result = 1;
-            break;
-        }
+    int slot = idx_find_user(user_id);
+    if (slot >= 0 && g_sessions[slot].chat_group_id == group_id) {
+        result = 1;
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return result;
@@ -333,7 +660,8 @@ int sessions_is_in_group_chat(int user_id, int group_id)
 
 int sessions_get_users_in_group_chat(int group_id, int *out_user_ids, int max_users)
 {
-    // Lấy danh sách user_id đang trong group chat này
+    // Lấy danh sách user_id đang trong group chat này.
+    // Không có index theo group_id: scan bảng (chỉ dùng cho broadcast).
     int count = 0;
     pthread_mutex_lock(&g_sess_mutex);
     for (int i = 0; i < MAX_SESSIONS && count < max_users; i++) {
@@ -343,4 +671,54 @@ int sessions_get_users_in_group_chat(int group_id, int *out_user_ids, int max_us
     }
     pthread_mutex_unlock(&g_sess_mutex);
     return count;
-}
\ No newline at end of file
+}
+
+int sessions_count_active(void)
+{
+    // Free list chỉ chứa slot trống nên không cần scan bảng
+    // (session quá hạn được reaper trả về free list trong <= 1s).
+    pthread_mutex_lock(&g_sess_mutex);
+    int count = MAX_SESSIONS - g_free_count;
+    pthread_mutex_unlock(&g_sess_mutex);
+    return count;
+}
+
+void sessions_set_pm_notify(int user_id, int enabled)
+{
+    pthread_mutex_lock(&g_sess_mutex);
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        g_sessions[slot].notify_pm = enabled ? 1 : 0;
+    }
+    pthread_mutex_unlock(&g_sess_mutex);
+}
+
+int sessions_wants_pm_notify(int user_id)
+{
+    int result = 0;
+    pthread_mutex_lock(&g_sess_mutex);
+    int slot = idx_find_user(user_id);
+    if (slot >= 0) {
+        result = g_sessions[slot].notify_pm;
+    }
+    pthread_mutex_unlock(&g_sess_mutex);
+    return result;
+}
+
+int sessions_get_group_chat_sockets(int group_id, int exclude_user_id,
+                                    int *out_socks, int max_socks)
+{
+    // Snapshot socket người nhận broadcast trong 1 lần giữ mutex
+    // (thay vì 2 lần lock per member như trước: is_in_group_chat + get_socket).
+    int count = 0;
+    pthread_mutex_lock(&g_sess_mutex);
+    for (int i = 0; i < MAX_SESSIONS && count < max_socks; i++) {
+        if (g_sessions[i].active &&
+            g_sessions[i].chat_group_id == group_id &&
+            g_sessions[i].user_id != exclude_user_id) {
+            out_socks[count++] = g_sessions[i].client_socket;
+        }
+    }
+    pthread_mutex_unlock(&g_sess_mutex);
+    return count;
+}
@@ -39,6 +39,17 @@ int sessions_is_user_logged_in(int user_id, int exclude_socket);
 // Kiểm tra user có đang online không (có session active).
 int sessions_is_online(int user_id);
 
+// Số session đang active (phục vụ STATS).
+int sessions_count_active(void);
+
+// Hook được gọi khi user chuyển online (1) / offline (0) - login,
+// logout, disconnect, hết hạn. Luôn gọi NGOÀI session mutex nên hook
+// được phép push qua socket / gọi lại sessions_*.
+typedef void (*SessionPresenceHook)(int user_id, int online);
+
+// Đăng ký presence hook (1 hook duy nhất, set lúc startup).
+void sessions_set_presence_hook(SessionPresenceHook hook);
+
 // ============ Chat Mode (Real-time PM) ============
 
 // Set chat_partner cho user (0 để clear)
@@ -54,6 +65,12 @@ int sessions_get_socket(int user_id);
 // Kiểm tra user có đang chat với partner cụ thể không
 int sessions_is_chatting_with(int user_id, int partner_user_id);
 
+// Bật/tắt subscription PUSH PM_UNREAD cho user (opt-in, mất khi logout)
+void sessions_set_pm_notify(int user_id, int enabled);
+
+// User có đang subscribe PUSH PM_UNREAD không
+int sessions_wants_pm_notify(int user_id);
+
 // ============ Group Chat Mode ============
 
 // Set group chat cho user (0 để clear)
@@ -69,4 +86,11 @@ int sessions_is_in_group_chat(int user_id, int group_id);
 // Return: số lượng user, lưu user_ids vào out_user_ids
 int sessions_get_users_in_group_chat(int group_id, int *out_user_ids, int max_users);
 
+// Snapshot socket của mọi user đang trong group chat này (bỏ exclude_user_id)
+// trong ĐÚNG 1 lần giữ mutex — dùng cho broadcast: format frame 1 lần rồi
+// gửi tới từng socket ngoài lock.
+// Return: số socket lưu vào out_socks.
+int sessions_get_group_chat_sockets(int group_id, int exclude_user_id,
+                                    int *out_socks, int max_socks);
+
 #endif
@@ -0,0 +1,118 @@
+#include "stats.h"
+#include "sessions.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../common/framing.h"
+#include "../common/protocol.h"
+
+/*
+ * server/stats.c
+ * - Per-verb: count + histogram latency 24 bucket lũy thừa 2 (bucket i chứa
+ *   latency < 2^i us => bucket cuối ~8.4s). Percentile trả về cận trên của
+ *   bucket chứa sample thứ p% — đủ chính xác để tìm hot path, không cần
+ *   lưu từng sample.
+ * - 1 mutex cho cả bảng: record chỉ là 2 phép cộng nên contention không
+ *   đáng kể so với chi phí xử lý request (cùng trade-off với logger/outbuf).
+ * - Bytes in/out lấy từ counter có sẵn ở layer framing/protocol.
+ */
+
+#define STATS_BUCKETS 24
+
+typedef struct {
+    const char* name;            // static string từ g_verb_table
+    long count;
+    long buckets[STATS_BUCKETS]; // buckets[i]: số request có latency < 2^i us
+} VerbStat;
+
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static VerbStat g_verb_stats[STATS_MAX_VERBS];
+static time_t g_start_time = 0;
+
+// Bucket index = vị trí bit cao nhất + 1 (latency 0-1us vào bucket 0).
+static int bucket_for(long latency_us)
+{
+    int b = 0;
+    while (latency_us > 0 && b < STATS_BUCKETS - 1) {
+        latency_us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void stats_record(int verb_idx, const char* verb, long latency_us)
+{
+    if (verb_idx < 0 || verb_idx >= STATS_MAX_VERBS) return;
+
+    pthread_mutex_lock(&g_stats_mutex);
+    if (g_start_time == 0) g_start_time = time(NULL);
+
+    VerbStat* vs = &g_verb_stats[verb_idx];
+    vs->name = verb;
+    vs->count++;
+    vs->buckets[bucket_for(latency_us)]++;
+    pthread_mutex_unlock(&g_stats_mutex);
+}
+
+// Cận trên (us) của bucket chứa sample thứ pct% (0.0-1.0). Gọi khi đang giữ mutex.
+static long percentile_unlocked(const VerbStat* vs, double pct)
+{
+    long target = (long)((double)vs->count * pct);
+    if (target < 1) target = 1;
+
+    long seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += vs->buckets[i];
+        if (seen >= target) return 1L << i;
+    }
+    return 1L << (STATS_BUCKETS - 1);
+}
+
+int stats_format(char* out, size_t out_cap)
+{
+    if (!out || out_cap == 0) return -1;
+
+    pthread_mutex_lock(&g_stats_mutex);
+
+    time_t now = time(NULL);
+    long uptime = g_start_time ? (long)(now - g_start_time) : 0;
+
+    size_t used = (size_t)snprintf(out, out_cap,
+                                   "uptime=%ld sessions=%d bytes_in=%lld bytes_out=%lld pushes_dropped=%lld verbs=",
+                                   uptime, sessions_count_active(),
+                                   framer_bytes_received(), proto_bytes_sent(),
+                                   proto_pushes_dropped());
+    if (used >= out_cap) {
+        pthread_mutex_unlock(&g_stats_mutex);
+        out[out_cap - 1] = 0;
+        return -1;
+    }
+
+    int emitted = 0;
+    for (int i = 0; i < STATS_MAX_VERBS; i++) {
+        VerbStat* vs = &g_verb_stats[i];
+        if (vs->count == 0 || !vs->name) continue;
+
+        int n = snprintf(out + used, out_cap - used, "%s%s:%ld:%ld:%ld",
+                         emitted ? "," : "",
+                         vs->name, vs->count,
+                         percentile_unlocked(vs, 0.50),
+                         percentile_unlocked(vs, 0.99));
+        if (n < 0 || (size_t)n >= out_cap - used) {
+            out[used] = 0; // hết chỗ: cắt tại verb trước đó
+            break;
+        }
+        used += (size_t)n;
+        emitted++;
+    }
+
+    if (!emitted) {
+        snprintf(out + used, out_cap - used, "none");
+    }
+
+    pthread_mutex_unlock(&g_stats_mutex);
+    return 0;
+}
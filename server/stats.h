@@ -0,0 +1,28 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/*
+ * server/stats.*
+ * - Instrumentation layer: counter + latency histogram per verb, thu thập
+ *   trong handle_request() quanh mỗi dispatch.
+ * - Histogram bucket cố định theo lũy thừa 2 (microsecond) nên record là
+ *   O(1) và p50/p99 tính được không cần lưu sample.
+ * - Đọc qua verb STATS (authenticated) — xem handlers.c.
+ */
+
+// Số verb tối đa theo dõi được (hiện tại ~31, chừa chỗ thêm verb mới).
+#define STATS_MAX_VERBS 48
+
+// Ghi nhận 1 request đã xử lý xong: verb_idx là index trong g_verb_table
+// (ổn định trong suốt phiên server), verb là static string tên verb.
+void stats_record(int verb_idx, const char* verb, long latency_us);
+
+// Format toàn bộ stats thành payload 1 dòng:
+//   "uptime=<s> sessions=<n> bytes_in=<n> bytes_out=<n>
+//    verbs=VERB:count:p50us:p99us,..."
+// Chỉ liệt kê verb có count > 0. Return 0 nếu OK.
+int stats_format(char* out, size_t out_cap);
+
+#endif
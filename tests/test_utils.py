@@ -464,6 +464,7 @@ def stop_server(proc: subprocess.Popen):
 
 DB_FILES = [
     "users.db",
+    "journal.log",
     "friends.db", 
     "groups.db",
     "group_members.db",